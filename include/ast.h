@@ -1,6 +1,8 @@
 #ifndef AST_H
 #define AST_H
 
+#include <stdbool.h>
+
 #include "bth_lex.h"
 typedef struct bth_lex_token Token;
 #include "token.h"
@@ -186,7 +188,7 @@ typedef struct SymbolTable {
     struct SymbolTable* parent; // For nested scopes
 } SymbolTable;
 
-struct ASTNode;
+typedef struct ASTNode ASTNode;
 
 typedef struct {
     ASTNode* left;
@@ -475,7 +477,7 @@ typedef struct {
     Token* token;
 } ErrorNode;
 
-typedef struct ASTNode {
+struct ASTNode {
     NodeType type;
     Type* expr_type;      // Type of the expression (for type checking)
     int first_line;
@@ -554,6 +556,6 @@ typedef struct ASTNode {
         EmptyNode empty;
         ErrorNode error;
     } u;
-} ASTNode;
+};
 
 #endif
@@ -0,0 +1,669 @@
+// MIT No Attribution
+//
+// Copyright (c) 2025 bobthehuge
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// Reads a list of files ahead of their consumer: the next depth files are
+// always being opened and read, through io_uring where the kernel has it,
+// else by a few reader threads. Files are handed out in list order.
+
+#ifndef BTH_AIO_H
+#define BTH_AIO_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#if defined(__linux__)
+#  include <linux/io_uring.h>
+#  define BTH_AIO_URING
+#endif
+
+#ifndef BTH_AIO_ALLOC
+#define BTH_AIO_ALLOC(n) malloc(n)
+#endif
+
+#ifndef BTH_AIO_REALLOC
+#define BTH_AIO_REALLOC(p, n) realloc(p, n)
+#endif
+
+#ifndef BTH_AIO_FREE
+#define BTH_AIO_FREE(p) free(p)
+#endif
+
+// zero bytes after the data of every file, like bth_io's mapfn
+#ifndef BTH_AIO_PADDING
+#define BTH_AIO_PADDING 64
+#endif
+
+// files read ahead when the caller does not say
+#ifndef BTH_AIO_DEPTH
+#define BTH_AIO_DEPTH 32
+#endif
+
+// reader threads of the fallback
+#ifndef BTH_AIO_THREADS
+#define BTH_AIO_THREADS 4
+#endif
+
+#define BTH_AIO_NO_URING 0x1 // use the reader threads even with io_uring
+
+enum bth_aio_backend
+{
+    BTH_AIO_BACKEND_URING,
+    BTH_AIO_BACKEND_THREADS,
+};
+
+struct bth_aio_file
+{
+    const char *path;
+    char *data;  // BTH_AIO_PADDING zero bytes follow, NULL on error
+    size_t size;
+    int error;   // errno of the failed open or read, else 0
+};
+
+enum bth_aio_state
+{
+    BTH_AIO_FREE,
+    BTH_AIO_OPENING,
+    BTH_AIO_READING,
+    BTH_AIO_READY,
+};
+
+struct bth_aio_slot
+{
+    struct bth_aio_file file;
+    enum bth_aio_state state;
+    int fd;
+    int regular;
+    size_t cap;  // bytes data can hold before the padding
+};
+
+struct bth_aio
+{
+    const char *const *paths;
+    size_t count;
+    size_t next;   // first file not handed out yet
+    size_t queued; // first file not started yet
+    unsigned depth;
+    struct bth_aio_slot *slots; // file i goes through slots[i % depth]
+    enum bth_aio_backend backend;
+    unsigned long long wait_ns; // time bth_aio_next spent blocked
+
+#ifdef BTH_AIO_URING
+    int ring;
+    void *sq_map;
+    void *cq_map;
+    size_t sq_map_len;
+    size_t cq_map_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned pending; // sqes queued but not submitted
+#endif
+
+    pthread_t threads[BTH_AIO_THREADS];
+    unsigned nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t ready; // a slot got READY
+    pthread_cond_t freed; // a slot got FREE
+    int stop;
+};
+
+int bth_aio_init(struct bth_aio *a, const char *const *paths, size_t count,
+                 unsigned depth, int flags);
+int bth_aio_next(struct bth_aio *a, struct bth_aio_file *f);
+void bth_aio_release(struct bth_aio_file *f);
+void bth_aio_fini(struct bth_aio *a);
+const char *bth_aio_backend2str(enum bth_aio_backend b);
+
+#ifdef BTH_AIO_IMPLEMENTATION
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef BTH_AIO_URING
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#endif
+
+static unsigned long long bth_aio_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+const char *bth_aio_backend2str(enum bth_aio_backend b)
+{
+    switch (b)
+    {
+    case BTH_AIO_BACKEND_URING: return "io_uring";
+    case BTH_AIO_BACKEND_THREADS: return "threads";
+    default: return "unknown";
+    }
+}
+
+// sizes the buffer of an opened file, 0 when out of memory
+static int bth_aio_prepare(struct bth_aio_slot *s)
+{
+    struct stat st;
+
+    s->regular = !fstat(s->fd, &st) && S_ISREG(st.st_mode);
+    s->cap = s->regular ? (size_t)st.st_size : 64 * 1024;
+    s->file.size = 0;
+    s->file.data = BTH_AIO_ALLOC(s->cap + BTH_AIO_PADDING);
+
+    return s->file.data != NULL;
+}
+
+// makes room for more of a file that is not regular or grew
+static int bth_aio_grow(struct bth_aio_slot *s)
+{
+    size_t cap = s->cap ? s->cap * 2 : 64 * 1024;
+    char *d = BTH_AIO_REALLOC(s->file.data, cap + BTH_AIO_PADDING);
+
+    if (!d)
+        return 0;
+
+    s->file.data = d;
+    s->cap = cap;
+    return 1;
+}
+
+// a regular file is done once its stat size is read, anything else at EOF
+static int bth_aio_complete(const struct bth_aio_slot *s)
+{
+    return s->regular && s->file.size == s->cap;
+}
+
+// closes the file of s and pads its data, the state left to the caller
+static void bth_aio_close(struct bth_aio_slot *s, int error)
+{
+    if (s->fd >= 0)
+        close(s->fd);
+
+    s->fd = -1;
+    s->file.error = error;
+
+    if (error)
+    {
+        BTH_AIO_FREE(s->file.data);
+        s->file.data = NULL;
+        s->file.size = 0;
+    }
+    else
+        memset(s->file.data + s->file.size, 0, BTH_AIO_PADDING);
+}
+
+#ifdef BTH_AIO_URING
+// the thread reaping completions is the one handing out the files, s can
+// get READY without the lock
+static void bth_aio_finish(struct bth_aio_slot *s, int error)
+{
+    bth_aio_close(s, error);
+    s->state = BTH_AIO_READY;
+}
+
+static int bth_aio_uring_setup(struct bth_aio *a)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    a->ring = syscall(__NR_io_uring_setup, a->depth, &p);
+
+    if (a->ring < 0)
+        return 0;
+
+    // opening and reading must both be supported
+    struct
+    {
+        struct io_uring_probe probe;
+        struct io_uring_probe_op ops[256];
+    } probe;
+
+    memset(&probe, 0, sizeof(probe));
+
+    if (syscall(__NR_io_uring_register, a->ring, IORING_REGISTER_PROBE,
+                &probe, 256) < 0
+        || probe.probe.last_op < IORING_OP_READ
+        || !(probe.ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED)
+        || !(probe.ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED))
+    {
+        close(a->ring);
+        return 0;
+    }
+
+    a->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    a->cq_map_len = p.cq_off.cqes
+        + p.cq_entries * sizeof(struct io_uring_cqe);
+    a->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (a->cq_map_len > a->sq_map_len)
+            a->sq_map_len = a->cq_map_len;
+        a->cq_map_len = a->sq_map_len;
+    }
+
+    a->sq_map = mmap(NULL, a->sq_map_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, a->ring, IORING_OFF_SQ_RING);
+    a->cq_map = a->sq_map;
+
+    if (a->sq_map != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+        a->cq_map = mmap(NULL, a->cq_map_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, a->ring,
+                         IORING_OFF_CQ_RING);
+
+    a->sqes = mmap(NULL, a->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, a->ring, IORING_OFF_SQES);
+
+    if (a->sq_map == MAP_FAILED || a->cq_map == MAP_FAILED
+        || a->sqes == MAP_FAILED)
+    {
+        if (a->sqes != MAP_FAILED)
+            munmap(a->sqes, a->sqes_len);
+        if (a->cq_map != MAP_FAILED && a->cq_map != a->sq_map)
+            munmap(a->cq_map, a->cq_map_len);
+        if (a->sq_map != MAP_FAILED)
+            munmap(a->sq_map, a->sq_map_len);
+        close(a->ring);
+        return 0;
+    }
+
+    char *sq = a->sq_map;
+    char *cq = a->cq_map;
+
+    a->sq_head = (unsigned *)(sq + p.sq_off.head);
+    a->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    a->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    a->sq_array = (unsigned *)(sq + p.sq_off.array);
+    a->cq_head = (unsigned *)(cq + p.cq_off.head);
+    a->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    a->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    a->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    a->pending = 0;
+
+    return 1;
+}
+
+static void bth_aio_uring_fini(struct bth_aio *a)
+{
+    munmap(a->sqes, a->sqes_len);
+    if (a->cq_map != a->sq_map)
+        munmap(a->cq_map, a->cq_map_len);
+    munmap(a->sq_map, a->sq_map_len);
+    close(a->ring);
+}
+
+// at most one sqe per slot is in flight, so there is always room
+static struct io_uring_sqe *bth_aio_sqe(struct bth_aio *a, size_t slot)
+{
+    unsigned tail = *a->sq_tail;
+    unsigned idx = tail & *a->sq_mask;
+    struct io_uring_sqe *sqe = a->sqes + idx;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = slot;
+    a->sq_array[idx] = idx;
+    __atomic_store_n(a->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    a->pending++;
+
+    return sqe;
+}
+
+static void bth_aio_uring_open(struct bth_aio *a, size_t slot)
+{
+    struct io_uring_sqe *sqe = bth_aio_sqe(a, slot);
+
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)a->slots[slot].file.path;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+}
+
+static void bth_aio_uring_read(struct bth_aio *a, size_t slot)
+{
+    struct bth_aio_slot *s = a->slots + slot;
+    struct io_uring_sqe *sqe = bth_aio_sqe(a, slot);
+    size_t left = s->cap - s->file.size;
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = s->fd;
+    sqe->addr = (unsigned long)(s->file.data + s->file.size);
+    sqe->len = left < (1U << 30) ? left : (1U << 30);
+    sqe->off = s->file.size;
+}
+
+// next step of the slot whose last operation returned res
+static void bth_aio_uring_step(struct bth_aio *a, size_t slot, int res)
+{
+    struct bth_aio_slot *s = a->slots + slot;
+
+    if (res == -EINTR || res == -EAGAIN)
+    {
+        if (s->state == BTH_AIO_OPENING)
+            bth_aio_uring_open(a, slot);
+        else
+            bth_aio_uring_read(a, slot);
+        return;
+    }
+
+    if (res < 0)
+        return bth_aio_finish(s, -res);
+
+    if (s->state == BTH_AIO_OPENING)
+    {
+        s->fd = res;
+        s->state = BTH_AIO_READING;
+
+        if (!bth_aio_prepare(s))
+            return bth_aio_finish(s, ENOMEM);
+    }
+    else
+    {
+        s->file.size += res;
+
+        if (!res || bth_aio_complete(s))
+            return bth_aio_finish(s, 0);
+    }
+
+    if (s->file.size == s->cap && !bth_aio_grow(s))
+        return bth_aio_finish(s, ENOMEM);
+
+    bth_aio_uring_read(a, slot);
+}
+
+// submits what is queued, waiting for at least one completion if wait,
+// then handles every completion there is
+static void bth_aio_uring_poll(struct bth_aio *a, int wait)
+{
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+
+    if (a->pending || wait)
+    {
+        long r = syscall(__NR_io_uring_enter, a->ring, a->pending,
+                         wait ? 1 : 0, flags, NULL, 0);
+
+        if (r >= 0)
+            a->pending -= r < (long)a->pending ? (unsigned)r : a->pending;
+    }
+
+    unsigned head = *a->cq_head;
+    unsigned tail = __atomic_load_n(a->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe *cqe = a->cqes + (head & *a->cq_mask);
+
+        bth_aio_uring_step(a, cqe->user_data, cqe->res);
+    }
+
+    __atomic_store_n(a->cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+// blocking read of a whole file for the reader threads, which publish
+// the slot READY under the lock
+static void bth_aio_read(struct bth_aio_slot *s)
+{
+    s->fd = open(s->file.path, O_RDONLY | O_CLOEXEC);
+
+    if (s->fd < 0)
+        return bth_aio_close(s, errno);
+
+    if (!bth_aio_prepare(s))
+        return bth_aio_close(s, ENOMEM);
+
+    for (;;)
+    {
+        if (s->file.size == s->cap && !bth_aio_complete(s)
+            && !bth_aio_grow(s))
+            return bth_aio_close(s, ENOMEM);
+
+        ssize_t r = read(s->fd, s->file.data + s->file.size,
+                         s->cap - s->file.size);
+
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return bth_aio_close(s, errno);
+
+        s->file.size += r;
+
+        if (!r || bth_aio_complete(s))
+            return bth_aio_close(s, 0);
+    }
+}
+
+static void *bth_aio_reader(void *arg)
+{
+    struct bth_aio *a = arg;
+
+    pthread_mutex_lock(&a->lock);
+
+    for (;;)
+    {
+        while (!a->stop && (a->queued == a->count
+                            || a->queued >= a->next + a->depth))
+            pthread_cond_wait(&a->freed, &a->lock);
+
+        if (a->stop)
+            break;
+
+        struct bth_aio_slot *s = a->slots + a->queued % a->depth;
+
+        s->file = (struct bth_aio_file){.path = a->paths[a->queued]};
+        s->state = BTH_AIO_READING;
+        a->queued++;
+
+        pthread_mutex_unlock(&a->lock);
+        bth_aio_read(s);
+        pthread_mutex_lock(&a->lock);
+
+        s->state = BTH_AIO_READY;
+        pthread_cond_broadcast(&a->ready);
+    }
+
+    pthread_mutex_unlock(&a->lock);
+    return NULL;
+}
+
+// starts the files that now have a free slot
+static void bth_aio_start(struct bth_aio *a)
+{
+#ifdef BTH_AIO_URING
+    if (a->backend == BTH_AIO_BACKEND_URING)
+    {
+        for (; a->queued < a->count && a->queued < a->next + a->depth;
+             a->queued++)
+        {
+            size_t slot = a->queued % a->depth;
+
+            a->slots[slot] = (struct bth_aio_slot){
+                .file = {.path = a->paths[a->queued]},
+                .state = BTH_AIO_OPENING,
+                .fd = -1,
+            };
+            bth_aio_uring_open(a, slot);
+        }
+
+        bth_aio_uring_poll(a, 0);
+        return;
+    }
+#endif
+
+    pthread_cond_broadcast(&a->freed);
+}
+
+// reads the count files of paths, depth of them at a time (0 for
+// BTH_AIO_DEPTH). paths must outlive a
+int bth_aio_init(struct bth_aio *a, const char *const *paths, size_t count,
+                 unsigned depth, int flags)
+{
+    memset(a, 0, sizeof(*a));
+    a->paths = paths;
+    a->count = count;
+    a->depth = depth ? depth : BTH_AIO_DEPTH;
+    a->slots = BTH_AIO_ALLOC(a->depth * sizeof(*a->slots));
+
+    if (!a->slots)
+        return 0;
+
+    memset(a->slots, 0, a->depth * sizeof(*a->slots));
+    a->backend = BTH_AIO_BACKEND_THREADS;
+
+#ifdef BTH_AIO_URING
+    if (!(flags & BTH_AIO_NO_URING) && bth_aio_uring_setup(a))
+    {
+        a->backend = BTH_AIO_BACKEND_URING;
+        bth_aio_start(a);
+        return 1;
+    }
+#else
+    (void)flags;
+#endif
+
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->ready, NULL);
+    pthread_cond_init(&a->freed, NULL);
+
+    unsigned n = a->depth < BTH_AIO_THREADS ? a->depth : BTH_AIO_THREADS;
+
+    for (; a->nthreads < n; a->nthreads++)
+        if (pthread_create(a->threads + a->nthreads, NULL, bth_aio_reader, a))
+            break;
+
+    if (!a->nthreads)
+    {
+        bth_aio_fini(a);
+        return 0;
+    }
+
+    return 1;
+}
+
+// hands out the next file of the list in f, waiting for it to be read if
+// needed. Returns 0 past the last file. f is the caller's to release
+int bth_aio_next(struct bth_aio *a, struct bth_aio_file *f)
+{
+    if (a->next == a->count)
+        return 0;
+
+    struct bth_aio_slot *s = a->slots + a->next % a->depth;
+    unsigned long long t0 = 0;
+
+#ifdef BTH_AIO_URING
+    if (a->backend == BTH_AIO_BACKEND_URING)
+    {
+        if (s->state != BTH_AIO_READY)
+            t0 = bth_aio_now();
+
+        while (s->state != BTH_AIO_READY)
+            bth_aio_uring_poll(a, 1);
+
+        if (t0)
+            a->wait_ns += bth_aio_now() - t0;
+
+        *f = s->file;
+        s->state = BTH_AIO_FREE;
+        a->next++;
+        bth_aio_start(a);
+        return 1;
+    }
+#endif
+
+    pthread_mutex_lock(&a->lock);
+
+    if (s->state != BTH_AIO_READY || a->next >= a->queued)
+        t0 = bth_aio_now();
+
+    while (a->next >= a->queued || s->state != BTH_AIO_READY)
+        pthread_cond_wait(&a->ready, &a->lock);
+
+    if (t0)
+        a->wait_ns += bth_aio_now() - t0;
+
+    *f = s->file;
+    s->state = BTH_AIO_FREE;
+    a->next++;
+    bth_aio_start(a);
+
+    pthread_mutex_unlock(&a->lock);
+    return 1;
+}
+
+void bth_aio_release(struct bth_aio_file *f)
+{
+    BTH_AIO_FREE(f->data);
+    f->data = NULL;
+}
+
+// files read but never handed out are dropped
+void bth_aio_fini(struct bth_aio *a)
+{
+#ifdef BTH_AIO_URING
+    if (a->backend == BTH_AIO_BACKEND_URING)
+    {
+        // the kernel may still write to the buffers of started files
+        while (a->next < a->queued)
+        {
+            struct bth_aio_file f;
+
+            bth_aio_next(a, &f);
+            bth_aio_release(&f);
+        }
+
+        bth_aio_uring_fini(a);
+        BTH_AIO_FREE(a->slots);
+        return;
+    }
+#endif
+
+    if (a->nthreads)
+    {
+        pthread_mutex_lock(&a->lock);
+        a->stop = 1;
+        pthread_cond_broadcast(&a->freed);
+        pthread_mutex_unlock(&a->lock);
+
+        for (unsigned i = 0; i < a->nthreads; i++)
+            pthread_join(a->threads[i], NULL);
+    }
+
+    for (size_t i = a->next; i < a->queued; i++)
+        if (a->slots[i % a->depth].state == BTH_AIO_READY)
+            BTH_AIO_FREE(a->slots[i % a->depth].file.data);
+
+    pthread_mutex_destroy(&a->lock);
+    pthread_cond_destroy(&a->ready);
+    pthread_cond_destroy(&a->freed);
+    BTH_AIO_FREE(a->slots);
+}
+#endif
+#endif
@@ -0,0 +1,367 @@
+// MIT No Attribution
+//
+// Copyright (c) 2025 bobthehuge
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// Allocator interface taken by the bth_* headers wherever they allocate.
+// Callers always give back the size they asked for, so allocators need no
+// headers of their own. Structs embed a struct bth_allocator by value and
+// a zeroed one stands for the ALLOC macros of each header.
+
+#ifndef BTH_ALLOC_H
+#define BTH_ALLOC_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifndef BTH_ALLOC_CACHE_CLASSES
+#define BTH_ALLOC_CACHE_CLASSES 25 // blocks up to 16 MiB are cached
+#endif
+
+#ifndef BTH_ALLOC_CACHE_KEEP
+#define BTH_ALLOC_CACHE_KEEP 16 // free blocks kept per size class
+#endif
+
+struct bth_allocator
+{
+    void *(*alloc)(void *ctx, size_t n);
+    void *(*realloc)(void *ctx, void *p, size_t old, size_t n);
+    void (*free)(void *ctx, void *p, size_t n);
+    void *ctx;
+};
+
+static inline void *bth_alloc(const struct bth_allocator *a, size_t n)
+{
+    return a->alloc(a->ctx, n);
+}
+
+static inline void *bth_realloc(const struct bth_allocator *a, void *p,
+                                size_t old, size_t n)
+{
+    return a->realloc(a->ctx, p, old, n);
+}
+
+static inline void bth_free(const struct bth_allocator *a, void *p, size_t n)
+{
+    if (p)
+        a->free(a->ctx, p, n);
+}
+
+extern const struct bth_allocator bth_alloc_heap;
+
+// free lists of one thread, by power of two size class. Blocks freed by
+// other threads wait on a lock-free list until the owner needs them, so a
+// worker can hand its allocations over to the thread that releases them
+struct bth_alloc_cache
+{
+    struct bth_allocator parent;
+    pthread_t owner;
+    struct bth_alloc_block *lists[BTH_ALLOC_CACHE_CLASSES];
+    size_t kept[BTH_ALLOC_CACHE_CLASSES];
+    struct bth_alloc_block *remote;
+};
+
+struct bth_alloc_stats
+{
+    size_t allocs;
+    size_t reallocs;
+    size_t frees;
+    size_t bytes; // asked for in total
+    size_t live;  // bytes not freed yet
+    size_t peak;  // highest live
+};
+
+// counts what goes through it to parent, from any thread. If trace is set
+// every call is also written there
+struct bth_alloc_counter
+{
+    struct bth_allocator parent;
+    struct bth_alloc_stats stats;
+    FILE *trace;
+};
+
+struct bth_allocator bth_alloc_cache_init(struct bth_alloc_cache *c,
+                                          const struct bth_allocator *parent);
+void bth_alloc_cache_fini(struct bth_alloc_cache *c);
+struct bth_allocator bth_alloc_counting(struct bth_alloc_counter *c,
+                                        const struct bth_allocator *parent,
+                                        FILE *trace);
+
+#ifdef BTH_ALLOC_IMPLEMENTATION
+#include <stdlib.h>
+#include <string.h>
+
+static void *bth_alloc_heap_alloc(void *ctx, size_t n)
+{
+    (void)ctx;
+    return malloc(n);
+}
+
+static void *bth_alloc_heap_realloc(void *ctx, void *p, size_t old, size_t n)
+{
+    (void)ctx;
+    (void)old;
+    return realloc(p, n);
+}
+
+static void bth_alloc_heap_free(void *ctx, void *p, size_t n)
+{
+    (void)ctx;
+    (void)n;
+    free(p);
+}
+
+const struct bth_allocator bth_alloc_heap = {
+    .alloc = bth_alloc_heap_alloc,
+    .realloc = bth_alloc_heap_realloc,
+    .free = bth_alloc_heap_free,
+};
+
+// a free block of class cls, written over its own first bytes
+struct bth_alloc_block
+{
+    struct bth_alloc_block *next;
+    size_t cls;
+};
+
+// smallest class whose blocks hold n bytes, BTH_ALLOC_CACHE_CLASSES if none
+static size_t bth_alloc_class(size_t n)
+{
+    size_t cls = 0;
+
+    while (cls < BTH_ALLOC_CACHE_CLASSES && ((size_t)16 << cls) < n)
+        cls++;
+
+    return cls;
+}
+
+static void bth_alloc_cache_keep(struct bth_alloc_cache *c,
+                                 struct bth_alloc_block *b)
+{
+    if (c->kept[b->cls] == BTH_ALLOC_CACHE_KEEP)
+    {
+        bth_free(&c->parent, b, (size_t)16 << b->cls);
+        return;
+    }
+
+    b->next = c->lists[b->cls];
+    c->lists[b->cls] = b;
+    c->kept[b->cls]++;
+}
+
+// takes back what other threads freed since last time
+static void bth_alloc_cache_drain(struct bth_alloc_cache *c)
+{
+    struct bth_alloc_block *b = __atomic_exchange_n(&c->remote, NULL,
+                                                    __ATOMIC_ACQUIRE);
+
+    while (b)
+    {
+        struct bth_alloc_block *next = b->next;
+
+        bth_alloc_cache_keep(c, b);
+        b = next;
+    }
+}
+
+static void *bth_alloc_cache_alloc(void *ctx, size_t n)
+{
+    struct bth_alloc_cache *c = ctx;
+    size_t cls = bth_alloc_class(n);
+
+    if (cls == BTH_ALLOC_CACHE_CLASSES)
+        return bth_alloc(&c->parent, n);
+
+    if (!c->lists[cls] && __atomic_load_n(&c->remote, __ATOMIC_RELAXED))
+        bth_alloc_cache_drain(c);
+
+    struct bth_alloc_block *b = c->lists[cls];
+
+    if (!b)
+        return bth_alloc(&c->parent, (size_t)16 << cls);
+
+    c->lists[cls] = b->next;
+    c->kept[cls]--;
+    return b;
+}
+
+static void bth_alloc_cache_free(void *ctx, void *p, size_t n)
+{
+    struct bth_alloc_cache *c = ctx;
+    size_t cls = bth_alloc_class(n);
+    struct bth_alloc_block *b = p;
+
+    if (cls == BTH_ALLOC_CACHE_CLASSES)
+        return bth_free(&c->parent, p, n);
+
+    b->cls = cls;
+
+    if (pthread_equal(pthread_self(), c->owner))
+        return bth_alloc_cache_keep(c, b);
+
+    b->next = __atomic_load_n(&c->remote, __ATOMIC_RELAXED);
+
+    while (!__atomic_compare_exchange_n(&c->remote, &b->next, b, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+static void *bth_alloc_cache_realloc(void *ctx, void *p, size_t old, size_t n)
+{
+    struct bth_alloc_cache *c = ctx;
+    size_t from = bth_alloc_class(old);
+    size_t to = bth_alloc_class(n);
+
+    if (p && from == to)
+        return from < BTH_ALLOC_CACHE_CLASSES ? p
+            : bth_realloc(&c->parent, p, old, n);
+
+    void *q = bth_alloc_cache_alloc(ctx, n);
+
+    if (q && p)
+    {
+        memcpy(q, p, old < n ? old : n);
+        bth_alloc_cache_free(ctx, p, old);
+    }
+
+    return q;
+}
+
+// the calling thread owns c, any thread may free what it allocated
+struct bth_allocator bth_alloc_cache_init(struct bth_alloc_cache *c,
+                                          const struct bth_allocator *parent)
+{
+    memset(c, 0, sizeof(*c));
+    c->parent = *parent;
+    c->owner = pthread_self();
+
+    return (struct bth_allocator){
+        .alloc = bth_alloc_cache_alloc,
+        .realloc = bth_alloc_cache_realloc,
+        .free = bth_alloc_cache_free,
+        .ctx = c,
+    };
+}
+
+// gives every kept block back to the parent, once no thread uses c anymore
+void bth_alloc_cache_fini(struct bth_alloc_cache *c)
+{
+    c->owner = pthread_self();
+    bth_alloc_cache_drain(c);
+
+    for (size_t cls = 0; cls < BTH_ALLOC_CACHE_CLASSES; cls++)
+    {
+        while (c->lists[cls])
+        {
+            struct bth_alloc_block *b = c->lists[cls];
+
+            c->lists[cls] = b->next;
+            bth_free(&c->parent, b, (size_t)16 << cls);
+        }
+
+        c->kept[cls] = 0;
+    }
+}
+
+#define BTH_ALLOC_ADD(p, n) __atomic_add_fetch(p, n, __ATOMIC_RELAXED)
+#define BTH_ALLOC_SUB(p, n) __atomic_sub_fetch(p, n, __ATOMIC_RELAXED)
+
+static void bth_alloc_count_live(struct bth_alloc_counter *c, size_t n)
+{
+    size_t live = BTH_ALLOC_ADD(&c->stats.live, n);
+    size_t peak = __atomic_load_n(&c->stats.peak, __ATOMIC_RELAXED);
+
+    while (live > peak
+           && !__atomic_compare_exchange_n(&c->stats.peak, &peak, live, 1,
+                                           __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED))
+        ;
+}
+
+static void *bth_alloc_count_alloc(void *ctx, size_t n)
+{
+    struct bth_alloc_counter *c = ctx;
+    void *p = bth_alloc(&c->parent, n);
+
+    if (c->trace)
+        fprintf(c->trace, "alloc %zu = %p\n", n, p);
+
+    if (p)
+    {
+        BTH_ALLOC_ADD(&c->stats.allocs, 1);
+        BTH_ALLOC_ADD(&c->stats.bytes, n);
+        bth_alloc_count_live(c, n);
+    }
+
+    return p;
+}
+
+static void *bth_alloc_count_realloc(void *ctx, void *p, size_t old, size_t n)
+{
+    struct bth_alloc_counter *c = ctx;
+    void *q = bth_realloc(&c->parent, p, old, n);
+
+    if (c->trace)
+        fprintf(c->trace, "realloc %p %zu %zu = %p\n", p, old, n, q);
+
+    if (q)
+    {
+        BTH_ALLOC_ADD(p ? &c->stats.reallocs : &c->stats.allocs, 1);
+
+        if (n > old)
+        {
+            BTH_ALLOC_ADD(&c->stats.bytes, n - old);
+            bth_alloc_count_live(c, n - old);
+        }
+        else
+            BTH_ALLOC_SUB(&c->stats.live, old - n);
+    }
+
+    return q;
+}
+
+static void bth_alloc_count_free(void *ctx, void *p, size_t n)
+{
+    struct bth_alloc_counter *c = ctx;
+
+    if (c->trace)
+        fprintf(c->trace, "free %p %zu\n", p, n);
+
+    BTH_ALLOC_ADD(&c->stats.frees, 1);
+    BTH_ALLOC_SUB(&c->stats.live, n);
+    bth_free(&c->parent, p, n);
+}
+
+#undef BTH_ALLOC_ADD
+#undef BTH_ALLOC_SUB
+
+struct bth_allocator bth_alloc_counting(struct bth_alloc_counter *c,
+                                        const struct bth_allocator *parent,
+                                        FILE *trace)
+{
+    *c = (struct bth_alloc_counter){.parent = *parent, .trace = trace};
+
+    return (struct bth_allocator){
+        .alloc = bth_alloc_count_alloc,
+        .realloc = bth_alloc_count_realloc,
+        .free = bth_alloc_count_free,
+        .ctx = c,
+    };
+}
+#endif
+#endif
@@ -0,0 +1,183 @@
+// MIT No Attribution
+//
+// Copyright (c) 2025 bobthehuge
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#ifndef BTH_ARENA_H
+#define BTH_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bth_alloc.h"
+
+#ifndef BTH_ARENA_ALLOC
+#define BTH_ARENA_ALLOC(n) malloc(n)
+#endif
+
+#ifndef BTH_ARENA_FREE
+#define BTH_ARENA_FREE(p) free(p)
+#endif
+
+#ifndef BTH_ARENA_BLOCK_SIZE
+#define BTH_ARENA_BLOCK_SIZE (64 * 1024)
+#endif
+
+#define BTH_ARENA_ALIGN 16
+
+struct bth_arena_block
+{
+    struct bth_arena_block *prev;
+    size_t size;
+    size_t used;
+    unsigned char data[];
+};
+
+// bump allocator, everything it gave is released at once by bth_arena_fini.
+// A zeroed struct is an empty arena.
+struct bth_arena
+{
+    struct bth_arena_block *head;
+    void *last; // latest allocation, the only one realloc grows in place
+    struct bth_allocator alloc; // of the blocks, zeroed for BTH_ARENA_ALLOC
+};
+
+void *bth_arena_alloc(struct bth_arena *a, size_t n);
+void *bth_arena_realloc(struct bth_arena *a, void *p, size_t old, size_t n);
+void bth_arena_fini(struct bth_arena *a);
+struct bth_allocator bth_arena_allocator(struct bth_arena *a);
+
+#ifdef BTH_ARENA_IMPLEMENTATION
+static size_t bth_arena_round(size_t n)
+{
+    return (n + BTH_ARENA_ALIGN - 1) & ~(size_t)(BTH_ARENA_ALIGN - 1);
+}
+
+// offset of the first aligned byte at or after used in b
+static size_t bth_arena_next(const struct bth_arena_block *b)
+{
+    uintptr_t p = (uintptr_t)(b->data + b->used);
+
+    return b->used + (bth_arena_round(p) - p);
+}
+
+void *bth_arena_alloc(struct bth_arena *a, size_t n)
+{
+    struct bth_arena_block *b = a->head;
+    size_t off = b ? bth_arena_next(b) : 0;
+
+    n = bth_arena_round(n);
+
+    if (!b || off > b->size || b->size - off < n)
+    {
+        // big requests get a block of their own
+        size_t size = n > BTH_ARENA_BLOCK_SIZE ? n : BTH_ARENA_BLOCK_SIZE;
+
+        b = a->alloc.alloc
+            ? bth_alloc(&a->alloc, sizeof(*b) + size + BTH_ARENA_ALIGN)
+            : BTH_ARENA_ALLOC(sizeof(*b) + size + BTH_ARENA_ALIGN);
+
+        if (!b)
+            return NULL;
+
+        b->prev = a->head;
+        b->size = size + BTH_ARENA_ALIGN;
+        b->used = 0;
+        a->head = b;
+        off = bth_arena_next(b);
+    }
+
+    a->last = b->data + off;
+    b->used = off + n;
+
+    return a->last;
+}
+
+void *bth_arena_realloc(struct bth_arena *a, void *p, size_t old, size_t n)
+{
+    struct bth_arena_block *b = a->head;
+
+    if (!p)
+        return bth_arena_alloc(a, n);
+
+    if (p == a->last)
+    {
+        size_t off = (unsigned char *)p - b->data;
+
+        if (b->size - off >= bth_arena_round(n))
+        {
+            b->used = off + bth_arena_round(n);
+            return p;
+        }
+    }
+
+    void *q = bth_arena_alloc(a, n);
+
+    if (q)
+        memcpy(q, p, old < n ? old : n);
+
+    return q;
+}
+
+void bth_arena_fini(struct bth_arena *a)
+{
+    while (a->head)
+    {
+        struct bth_arena_block *prev = a->head->prev;
+
+        if (a->alloc.alloc)
+            bth_free(&a->alloc, a->head, sizeof(*a->head) + a->head->size);
+        else
+            BTH_ARENA_FREE(a->head);
+
+        a->head = prev;
+    }
+
+    a->last = NULL;
+}
+
+static void *bth_arena_vt_alloc(void *ctx, size_t n)
+{
+    return bth_arena_alloc(ctx, n);
+}
+
+static void *bth_arena_vt_realloc(void *ctx, void *p, size_t old, size_t n)
+{
+    return bth_arena_realloc(ctx, p, old, n);
+}
+
+static void bth_arena_vt_free(void *ctx, void *p, size_t n)
+{
+    (void)ctx;
+    (void)p;
+    (void)n;
+}
+
+// allocates from a, freeing does nothing until bth_arena_fini
+struct bth_allocator bth_arena_allocator(struct bth_arena *a)
+{
+    return (struct bth_allocator){
+        .alloc = bth_arena_vt_alloc,
+        .realloc = bth_arena_vt_realloc,
+        .free = bth_arena_vt_free,
+        .ctx = a,
+    };
+}
+#endif
+#endif
@@ -0,0 +1,142 @@
+// MIT No Attribution
+//
+// Copyright (c) 2025 bobthehuge
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// XXH64 over whole buffers, giving the same values as the reference
+// implementation. Fast enough to key caches by the content of their inputs
+// at a few GB/s.
+
+#ifndef BTH_HASH_H
+#define BTH_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint64_t bth_xxh64(const void *data, size_t len, uint64_t seed);
+
+#ifdef BTH_HASH_IMPLEMENTATION
+
+#define BTH_XXH_P1 0x9E3779B185EBCA87ULL
+#define BTH_XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define BTH_XXH_P3 0x165667B19E3779F9ULL
+#define BTH_XXH_P4 0x85EBCA77C2B2AE63ULL
+#define BTH_XXH_P5 0x27D4EB2F165667C5ULL
+
+static uint64_t bth_xxh_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+// little-endian loads whatever the host
+static uint64_t bth_xxh_read64(const unsigned char *p)
+{
+    uint64_t v = 0;
+
+    for (int i = 7; i >= 0; i--)
+        v = (v << 8) | p[i];
+
+    return v;
+}
+
+static uint32_t bth_xxh_read32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16
+        | (uint32_t)p[3] << 24;
+}
+
+static uint64_t bth_xxh_round(uint64_t acc, uint64_t v)
+{
+    acc += v * BTH_XXH_P2;
+    return bth_xxh_rotl(acc, 31) * BTH_XXH_P1;
+}
+
+static uint64_t bth_xxh_merge(uint64_t acc, uint64_t v)
+{
+    acc ^= bth_xxh_round(0, v);
+    return acc * BTH_XXH_P1 + BTH_XXH_P4;
+}
+
+uint64_t bth_xxh64(const void *data, size_t len, uint64_t seed)
+{
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+    uint64_t h;
+
+    if (len >= 32)
+    {
+        // four lanes over 32 byte stripes
+        uint64_t v1 = seed + BTH_XXH_P1 + BTH_XXH_P2;
+        uint64_t v2 = seed + BTH_XXH_P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - BTH_XXH_P1;
+
+        for (; p + 32 <= end; p += 32)
+        {
+            v1 = bth_xxh_round(v1, bth_xxh_read64(p));
+            v2 = bth_xxh_round(v2, bth_xxh_read64(p + 8));
+            v3 = bth_xxh_round(v3, bth_xxh_read64(p + 16));
+            v4 = bth_xxh_round(v4, bth_xxh_read64(p + 24));
+        }
+
+        h = bth_xxh_rotl(v1, 1) + bth_xxh_rotl(v2, 7) + bth_xxh_rotl(v3, 12)
+            + bth_xxh_rotl(v4, 18);
+        h = bth_xxh_merge(h, v1);
+        h = bth_xxh_merge(h, v2);
+        h = bth_xxh_merge(h, v3);
+        h = bth_xxh_merge(h, v4);
+    }
+    else
+        h = seed + BTH_XXH_P5;
+
+    h += len;
+
+    for (; p + 8 <= end; p += 8)
+    {
+        h ^= bth_xxh_round(0, bth_xxh_read64(p));
+        h = bth_xxh_rotl(h, 27) * BTH_XXH_P1 + BTH_XXH_P4;
+    }
+
+    if (p + 4 <= end)
+    {
+        h ^= bth_xxh_read32(p) * BTH_XXH_P1;
+        h = bth_xxh_rotl(h, 23) * BTH_XXH_P2 + BTH_XXH_P3;
+        p += 4;
+    }
+
+    for (; p < end; p++)
+    {
+        h ^= *p * BTH_XXH_P5;
+        h = bth_xxh_rotl(h, 11) * BTH_XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= BTH_XXH_P2;
+    h ^= h >> 29;
+    h *= BTH_XXH_P3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+#undef BTH_XXH_P1
+#undef BTH_XXH_P2
+#undef BTH_XXH_P3
+#undef BTH_XXH_P4
+#undef BTH_XXH_P5
+#endif
+#endif
@@ -23,6 +23,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "bth_alloc.h"
+
 #ifndef BTH_IO_ALLOC
 #define BTH_IO_ALLOC(t) malloc(t)
 #endif
@@ -31,9 +33,36 @@
 #define OPTION(t) t
 #endif
 
+// zero bytes guaranteed after the data of a mapfn input
+#ifndef BTH_IO_PADDING
+#define BTH_IO_PADDING 64
+#endif
+
+#define BTH_IO_POPULATE 0x1 // prefault the whole mapping
+
+struct bth_io_map
+{
+    char *data;
+    size_t size;
+    size_t maplen; // length of the mapping, 0 if data was read to the heap
+    size_t heaplen; // of data when read instead
+
+    // of what is read instead of mapped, kept by mapfn. Zeroed for malloc
+    struct bth_allocator alloc;
+};
+
 OPTION(size_t) readfn(char **buf, size_t n, const char *path);
+size_t readfile(void *f, char *dst, size_t n);
+int mapfn(struct bth_io_map *m, const char *path, int flags);
+void unmapfn(struct bth_io_map *m);
 
 #ifdef BTH_IO_IMPLEMENTATION
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 OPTION(size_t) readfn(char **buf, size_t n, const char *path)
 {
     FILE *f = fopen(path, "r");
@@ -58,5 +87,135 @@ OPTION(size_t) readfn(char **buf, size_t n, const char *path)
 
     return SOME(size_t, count);
 }
+
+// reads up to n bytes of the FILE f, for streaming readers: works on pipes
+// and terminals where readfn cannot size the input
+size_t readfile(void *f, char *dst, size_t n)
+{
+    return fread(dst, 1, n, (FILE *)f);
+}
+
+static void *bth_io_realloc(const struct bth_allocator *a, void *p,
+                            size_t old, size_t n)
+{
+    return a->realloc ? bth_realloc(a, p, old, n) : realloc(p, n);
+}
+
+static void bth_io_free(const struct bth_allocator *a, void *p, size_t n)
+{
+    if (a->free)
+        bth_free(a, p, n);
+    else
+        free(p);
+}
+
+// reads f to its end on the heap, for what cannot be mapped
+static int bth_io_slurp(struct bth_io_map *m, FILE *f)
+{
+    struct bth_allocator a = m->alloc;
+    size_t cap = 64 * 1024;
+    size_t old = 0;
+    size_t len = 0;
+    char *d = NULL;
+
+    for (;;)
+    {
+        char *nd = bth_io_realloc(&a, d, old, cap + BTH_IO_PADDING);
+
+        if (!nd)
+        {
+            bth_io_free(&a, d, old);
+            return 0;
+        }
+
+        d = nd;
+        old = cap + BTH_IO_PADDING;
+        len += fread(d + len, 1, cap - len, f);
+
+        if (len < cap)
+            break;
+
+        cap *= 2;
+    }
+
+    if (ferror(f))
+    {
+        bth_io_free(&a, d, old);
+        return 0;
+    }
+
+    memset(d + len, 0, BTH_IO_PADDING);
+    *m = (struct bth_io_map){.data = d, .size = len, .heaplen = old,
+                             .alloc = a};
+    return 1;
+}
+
+// maps the file at path read-only, followed by at least BTH_IO_PADDING
+// zero bytes. Anything else than a non-empty regular file is read instead
+int mapfn(struct bth_io_map *m, const char *path, int flags)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0)
+        return 0;
+
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size)
+    {
+        FILE *f = fdopen(fd, "r");
+        int ok = f && bth_io_slurp(m, f);
+
+        if (f)
+            fclose(f);
+        else
+            close(fd);
+
+        return ok;
+    }
+
+    size_t size = st.st_size;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len = (size + BTH_IO_PADDING + page - 1) / page * page;
+
+    // zero pages first, the file then goes over their start: past its last
+    // page, reads hit the zero pages instead of faulting
+    char *p = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    int mflags = MAP_PRIVATE | MAP_FIXED;
+
+#ifdef MAP_POPULATE
+    if (flags & BTH_IO_POPULATE)
+        mflags |= MAP_POPULATE;
+#else
+    (void)flags;
+#endif
+
+    if (p == MAP_FAILED || mmap(p, size, PROT_READ, mflags, fd, 0) != p)
+    {
+        if (p != MAP_FAILED)
+            munmap(p, len);
+        close(fd);
+        return 0;
+    }
+
+    close(fd);
+    posix_madvise(p, size, POSIX_MADV_SEQUENTIAL);
+
+    *m = (struct bth_io_map){.data = p, .size = size, .maplen = len,
+                             .alloc = m->alloc};
+    return 1;
+}
+
+// keeps the allocator for the next mapfn
+void unmapfn(struct bth_io_map *m)
+{
+    struct bth_allocator a = m->alloc;
+
+    if (m->maplen)
+        munmap(m->data, m->maplen);
+    else
+        bth_io_free(&a, m->data, m->heaplen);
+
+    *m = (struct bth_io_map){.alloc = a};
+}
 #endif
 #endif
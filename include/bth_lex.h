@@ -20,13 +20,19 @@
 #ifndef BTH_LEX_H
 #define BTH_LEX_H
 
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "bth_alloc.h"
 
 enum BTH_LEX_KIND
 {
     INVALID,
     LK_END,
     LK_IDENT,
+    LK_KEYWORD,
+    LK_NUMBER,
     LK_SYMBOL,
     LK_DELIMITED,
     BTH_LEX_KIND_COUNT
@@ -34,15 +40,57 @@ enum BTH_LEX_KIND
 
 struct bth_lex_token
 {
-    size_t kind;
-    size_t idx; // index if SYMBOL or DELIM else 0
-    const char *name;
+    unsigned short kind; // one of BTH_LEX_KIND
+    unsigned short id;   // user kind, from the tables or the lexer ids
+    unsigned flags;
     const char *filename;
-    size_t row;
-    size_t col;
     size_t repeat;
+    const char *trivia; // start of the folded leading trivia, else begin
     const char *begin;
     const char *end;
+    union
+    {
+        unsigned long long u;
+        double d;
+    } value; // filled by the number hook for NUMBER tokens
+};
+
+// set on tokens preceded by a newline in folded trivia
+#define BTH_LEX_NEWLINE_BEFORE 0x1
+// first flag bit left to the hooks
+#define BTH_LEX_USER_FLAGS 0x100
+
+// symbols and delimiters tables are arrays of entries, the lengths are
+// expected to be filled, see BTH_LEX_SYMBOL and BTH_LEX_DELIM
+struct bth_lex_entry
+{
+    unsigned short id;        // user kind given to the tokens
+    unsigned short len;       // strlen(str)
+    unsigned short close_len; // strlen(close)
+    const char *str;          // symbol or delimiter opener
+    const char *close;        // delimiter closer, NULL for symbols
+};
+
+#define BTH_LEX_SYMBOL(id, s) {(id), sizeof(s) - 1, 0, (s), NULL}
+#define BTH_LEX_DELIM(id, o, c) \
+    {(id), sizeof(o) - 1, sizeof(c) - 1, (o), (c)}
+
+#define BTH_LEX_NOMATCH ((size_t)-1)
+
+struct bth_lex_trie_node
+{
+    size_t child; // first child node, 0 if none
+    size_t next;  // next sibling node, 0 if none
+    size_t idx;   // lowest table entry ending here or BTH_LEX_NOMATCH
+    unsigned char byte;
+};
+
+struct bth_lex_trie
+{
+    size_t first[256]; // first byte dispatch, 0 if no entry starts with it
+    struct bth_lex_trie_node *nodes;
+    size_t nodes_count;
+    size_t nodes_cap;
 };
 
 struct bth_lexer
@@ -50,19 +98,153 @@ struct bth_lexer
     const char *buffer;
     const char *filename;
     size_t size;
+    size_t padding; // zero bytes readable past size, see BTH_LEX_OVERREAD
 
     size_t cur;
-    size_t col;
-    size_t row;
 
-    const char **symbols;
+    // line starts, built by the first bth_lex_position call since tokens
+    // only know where they are in the buffer
+    size_t *lines;
+    size_t lines_count;
+
+    // optional, streams the input through a sliding window instead of
+    // taking it whole: reads up to n more bytes of input to dst, 0 at its
+    // end. See bth_lex_window_init
+    size_t (*refill)(void *input, char *dst, size_t n);
+    void *input;
+    char *window;      // buffer, owned by the lexer in window mode
+    size_t window_cap;
+    size_t base;       // input offset of buffer[0]
+    size_t base_row;   // lines before buffer[0]
+    size_t base_col;   // bytes between the last of them and buffer[0]
+    size_t keep;       // first input offset tokens still held point to
+    int starved;       // a delimiter ran past the window
+    int eof;           // refill has returned 0
+
+    const struct bth_lex_entry *symbols;
     size_t symbols_count;
-    const char **delims;
+    const struct bth_lex_entry *delims;
     size_t delims_count;
 
+    // user kinds of the tokens not coming from a table: the ones of
+    // INVALID, LK_END and LK_IDENT are used
+    unsigned short ids[BTH_LEX_KIND_COUNT];
+
+    // built by bth_lex_init from symbols and delims
+    struct bth_lex_trie *symbols_trie;
+    struct bth_lex_trie *delims_trie;
+    int forked; // the tries are borrowed, see bth_lex_fork
+
+    // of the tries, the line starts and the window, zeroed for
+    // BTH_LEX_ALLOC and co
+    struct bth_allocator alloc;
+
+    // optional, classifies a whole identifier run: returns 1 and sets id
+    // for keywords, 0 for plain identifiers
+    int (*keyword)(const char *s, size_t len, unsigned short *id);
+
+    // optional, lexes a numeric literal at s, which starts with a digit or
+    // a dot and a digit: returns its length and fills id, flags and value
+    size_t (*number)(const char *s, const char *end, struct bth_lex_token *t);
+
+    // optional, tells blanks and comments apart. When set the lexer only
+    // returns significant tokens and trivia is folded into the next one
+    int (*trivia)(const struct bth_lex_token *t);
+
     void *usrdata;
 };
 
+typedef struct bth_lex_token (*bth_lex_fn)(struct bth_lexer *lex);
+
+// lookahead of bth_lex_peek, a power of two
+#ifndef BTH_LEX_LOOKAHEAD
+#  define BTH_LEX_LOOKAHEAD 16
+#endif
+
+// pulls tokens as they are lexed, holding at most BTH_LEX_LOOKAHEAD of
+// them: next consumes one, peek looks ahead without consuming
+struct bth_lex_stream
+{
+    struct bth_lexer *lex;
+    bth_lex_fn next;
+    size_t head;  // ring slot of the next token
+    size_t count; // tokens lexed but not consumed yet
+    struct bth_lex_token ring[BTH_LEX_LOOKAHEAD];
+};
+
+struct bth_lex_repeat
+{
+    uint32_t idx;
+    uint32_t count;
+    uint32_t end; // offset of the end of the last occurrence
+};
+
+// tokens of one buffer as parallel arrays, 11 bytes a token. Everything
+// else a token holds is recomputed by bth_lex_store_get: trivia is the gap
+// since the last occurrence of the previous stored token, numbers are lexed
+// again
+struct bth_lex_store
+{
+    const char *buffer;
+    const char *filename;
+    int folded; // lexed with trivia folding
+    size_t (*number)(const char *s, const char *end, struct bth_lex_token *t);
+    struct bth_allocator alloc; // of the arrays, zeroed for BTH_LEX_ALLOC
+
+    unsigned char *kinds;
+    unsigned short *ids;
+    uint32_t *offsets;
+    uint32_t *lens;
+    size_t count;
+    size_t cap;
+
+    // sorted by idx, only for tokens repeated more than once
+    struct bth_lex_repeat *repeats;
+    size_t repeats_count;
+    size_t repeats_cap;
+};
+
+#ifndef BTH_LEX_ALLOC
+#  define BTH_LEX_ALLOC(n) malloc(n)
+#endif
+
+#ifndef BTH_LEX_REALLOC
+#  define BTH_LEX_REALLOC(p, n) realloc(p, n)
+#endif
+
+#ifndef BTH_LEX_FREE
+#  define BTH_LEX_FREE(p) free(p)
+#endif
+
+// a zeroed allocator goes to the macros above
+static inline void *bth_lex_mem_alloc(const struct bth_allocator *a, size_t n)
+{
+    return a && a->alloc ? bth_alloc(a, n) : BTH_LEX_ALLOC(n);
+}
+
+static inline void *bth_lex_mem_realloc(const struct bth_allocator *a,
+                                        void *p, size_t old, size_t n)
+{
+    return a && a->alloc ? bth_realloc(a, p, old, n) : BTH_LEX_REALLOC(p, n);
+}
+
+static inline void bth_lex_mem_free(const struct bth_allocator *a, void *p,
+                                    size_t n)
+{
+    if (a && a->alloc)
+        bth_free(a, p, n);
+    else
+        BTH_LEX_FREE(p);
+}
+
+// zero padding an input needs for the kernels to over-read it
+#define BTH_LEX_OVERREAD 32
+
+// initial size of the input window, doubled for tokens longer than it
+#ifndef BTH_LEX_WINDOW
+#  define BTH_LEX_WINDOW (64 * 1024)
+#endif
+
 #ifndef BTH_LEX_STRNCMP
 #  define BTH_LEX_STRNCMP(s1, s2, n) (strncmp(s1, s2, (n)))
 #endif
@@ -78,6 +260,10 @@ struct bth_lexer
 #    define BTH_LEX_ERRX(code, fmt, ...) errx((code), fmt, __VA_ARGS__)
 #  endif
 
+#  ifndef BTH_LEX_ESCAPE
+#    define BTH_LEX_ESCAPE '\\'
+#  endif
+
 #  define BTH_LEX_DEFAULT_GET_DELIM
 #  define BTH_LEX_GET_DELIM(l, t) bth_lex_get_delim(l, t)
 #endif
@@ -87,11 +273,24 @@ struct bth_lexer
 #  define BTH_LEX_GET_SYMBOL(l, t) bth_lex_get_symbol(l, t)
 #endif
 
+#define BTH_LEX_CLASS_IDENT 0x1
+#define BTH_LEX_CLASS_BLANK 0x2
+#define BTH_LEX_CLASS_DIGIT 0x4
+
+extern const unsigned char bth_lex_class[256];
+
+#define BTH_LEX_ISCLASS(c, k) (bth_lex_class[(unsigned char)(c)] & (k))
+
+#if !defined(BTH_LEX_NO_SIMD) && defined(__SSE2__) \
+    && (defined(__x86_64__) || defined(__i386__))
+#  include <immintrin.h>
+#  define BTH_LEX_SIMD
+#endif
+
 #ifndef BTH_LEX_GET_IDENT
 #  ifndef BTH_LEX_ISVALID
-#    include <ctype.h>
 #    define BTH_LEX_DEFAULT_ISVALID
-#    define BTH_LEX_ISVALID(c) bth_lex_isvalid((c))
+#    define BTH_LEX_ISVALID(c) BTH_LEX_ISCLASS((c), BTH_LEX_CLASS_IDENT)
 #  endif
 
 #  define BTH_LEX_DEFAULT_GET_IDENT
@@ -99,10 +298,77 @@ struct bth_lexer
 #endif
 
 const char *bth_lex_kind2str(size_t id);
+int bth_lex_init(struct bth_lexer *lex);
+void bth_lex_fini(struct bth_lexer *lex);
+void bth_lex_reset(struct bth_lexer *lex, const char *buffer, size_t size);
+void bth_lex_fork(struct bth_lexer *dst, const struct bth_lexer *src);
+int bth_lex_close_delim(struct bth_lexer *lex, struct bth_lex_token *t,
+                        size_t idx, size_t clen, size_t lend);
+int bth_lex_take_symbol(struct bth_lexer *lex, struct bth_lex_token *t,
+                        size_t idx, size_t slen);
+int bth_lex_get_ident(struct bth_lexer *lex, struct bth_lex_token *t);
+int bth_lex_get_number(struct bth_lexer *lex, struct bth_lex_token *t);
+int bth_lex_trie_build(struct bth_lex_trie *trie,
+                       const struct bth_lex_entry *table, size_t count,
+                       const struct bth_allocator *alloc);
+void bth_lex_trie_free(struct bth_lex_trie *trie,
+                       const struct bth_allocator *alloc);
+struct bth_lex_token bth_lex_pull(struct bth_lexer *lex, bth_lex_fn raw);
+struct bth_lex_token bth_lex_fold_trivia(struct bth_lexer *lex, bth_lex_fn raw);
+struct bth_lex_token bth_lex_get_raw_token(struct bth_lexer *lex);
 struct bth_lex_token bth_lex_get_token(struct bth_lexer *lex);
+int bth_lex_window_init(struct bth_lexer *lex, size_t cap,
+                        size_t (*refill)(void *input, char *dst, size_t n),
+                        void *input);
+int bth_lex_window_fill(struct bth_lexer *lex, size_t keep);
+struct bth_lex_token bth_lex_window_token(struct bth_lexer *lex,
+                                          bth_lex_fn raw);
+void bth_lex_rebase(const struct bth_lexer *lex, const char *buffer,
+                    size_t base, struct bth_lex_token *t, size_t n);
+int bth_lex_lines_build(struct bth_lexer *lex);
+int bth_lex_position(struct bth_lexer *lex, size_t off, size_t *row,
+                     size_t *col);
+size_t bth_lex_get_tokens(struct bth_lexer *lex, bth_lex_fn next,
+                          struct bth_lex_token *out, size_t n);
+void bth_lex_stream_init(struct bth_lex_stream *s, struct bth_lexer *lex,
+                         bth_lex_fn next);
+const struct bth_lex_token *bth_lex_peek(struct bth_lex_stream *s, size_t k);
+struct bth_lex_token bth_lex_next(struct bth_lex_stream *s);
+void bth_lex_store_init(struct bth_lex_store *s, const struct bth_lexer *lex,
+                        const struct bth_allocator *alloc);
+void bth_lex_store_fini(struct bth_lex_store *s);
+int bth_lex_store_reserve(struct bth_lex_store *s, size_t cap);
+int bth_lex_store_reserve_repeats(struct bth_lex_store *s, size_t cap);
+int bth_lex_store_push(struct bth_lex_store *s, const struct bth_lex_token *t);
+int bth_lex_store_repeat(struct bth_lex_store *s, size_t end);
+const struct bth_lex_repeat *bth_lex_store_find_repeat(
+    const struct bth_lex_store *s, size_t i);
+size_t bth_lex_store_repeats(const struct bth_lex_store *s, size_t i);
+int bth_lex_store_append(struct bth_lex_store *dst,
+                         const struct bth_lex_store *src, size_t from,
+                         int merge);
+int bth_lex_store_append_range(struct bth_lex_store *dst,
+                               const struct bth_lex_store *src, size_t from,
+                               size_t to, int merge);
+struct bth_lex_token bth_lex_store_get(const struct bth_lex_store *s,
+                                       size_t i);
+
+static inline const char *bth_lex_store_begin(const struct bth_lex_store *s,
+                                              size_t i)
+{
+    return s->buffer + s->offsets[i];
+}
+
+static inline const char *bth_lex_store_end(const struct bth_lex_store *s,
+                                            size_t i)
+{
+    return s->buffer + s->offsets[i] + s->lens[i];
+}
 
 #ifdef BTH_LEX_IMPLEMENTATION
 
+#include <pthread.h>
+
 // TODO: investigate alternatives to this
 const char *bth_lex_kind2str(size_t id)
 {
@@ -111,201 +377,1408 @@ const char *bth_lex_kind2str(size_t id)
     case INVALID: return "INVALID";
     case LK_END: return "END";
     case LK_IDENT: return "IDENT";
+    case LK_KEYWORD: return "KEYWORD";
+    case LK_NUMBER: return "NUMBER";
     case LK_SYMBOL: return "SYMBOL";
     case LK_DELIMITED: return "DELIMITED";
     default: return "UNKNOWN";
     }
 }
 
-#ifdef BTH_LEX_DEFAULT_GET_DELIM
-int bth_lex_find_delim(struct bth_lexer *lex, const char *s2, size_t *idx)
+// builds a trie over the str of every table entry, alloc may be NULL
+int bth_lex_trie_build(struct bth_lex_trie *trie,
+                       const struct bth_lex_entry *table, size_t count,
+                       const struct bth_allocator *alloc)
 {
-    for (size_t i = 0; i < lex->delims_count; i++)
+    size_t total = 1; // node 0 is the null node
+
+    for (size_t i = 0; i < count; i++)
+        total += table[i].len;
+
+    memset(trie->first, 0, sizeof(trie->first));
+    trie->nodes = bth_lex_mem_alloc(alloc,
+                                    total * sizeof(struct bth_lex_trie_node));
+    trie->nodes_count = 1;
+    trie->nodes_cap = total;
+
+    if (!trie->nodes)
+        return 0;
+
+    for (size_t i = 0; i < count; i++)
     {
-        const char *s1 = lex->delims[i * 3 + 1];
-        if (!BTH_LEX_STRNCMP(s1, s2, BTH_LEX_STRLEN(s1)))
+        const unsigned char *s = (const unsigned char *)table[i].str;
+        size_t *link = &trie->first[*s];
+        size_t node = 0;
+
+        if (!*s)
+            continue;
+
+        for (; *s; s++)
         {
-            *idx = i * 3;
-            return 1;
+            while (*link && trie->nodes[*link].byte != *s)
+                link = &trie->nodes[*link].next;
+
+            if (!*link)
+            {
+                *link = trie->nodes_count++;
+                trie->nodes[*link] = (struct bth_lex_trie_node){
+                    .idx = BTH_LEX_NOMATCH,
+                    .byte = *s,
+                };
+            }
+
+            node = *link;
+            link = &trie->nodes[node].child;
         }
+
+        // earlier entries win, like the linear scan over the table did
+        if (trie->nodes[node].idx == BTH_LEX_NOMATCH)
+            trie->nodes[node].idx = i;
     }
 
-    return 0;
+    return 1;
 }
 
-int bth_lex_get_delim(struct bth_lexer *lex, struct bth_lex_token *t)
+void bth_lex_trie_free(struct bth_lex_trie *trie,
+                       const struct bth_allocator *alloc)
 {
-    const char *curptr = lex->buffer + lex->cur;
-    size_t idx = 0;
+    bth_lex_mem_free(alloc, trie->nodes,
+                     trie->nodes_cap * sizeof(struct bth_lex_trie_node));
+}
 
-    if (!bth_lex_find_delim(lex, curptr, &idx))
-        return 0;
-    
-    const char **delim = lex->delims + idx;
+// returns the lowest table entry whose key prefixes s, which is the one a
+// linear scan in table order would have found
+size_t bth_lex_trie_match(const struct bth_lex_trie *trie, const char *s,
+                          const char *end)
+{
+    size_t best = BTH_LEX_NOMATCH;
+    size_t node = trie->first[(unsigned char)*s];
 
-    // size_t clen = 0;
-    size_t clen = BTH_LEX_STRLEN(delim[1]);
-    size_t lend = BTH_LEX_STRLEN(delim[2]);
+    while (node)
+    {
+        const struct bth_lex_trie_node *n = trie->nodes + node;
 
-    t->kind = LK_DELIMITED;
-    t->idx = idx;
-    t->begin = curptr;
-    t->row = lex->row;
-    t->col = lex->col;
+        if (n->idx < best)
+            best = n->idx;
 
-    while (BTH_LEX_STRNCMP(delim[2], curptr + clen, lend))
-    {
-        if (lex->cur + clen >= lex->size - lend)
-            // BTH_LEX_ERRX(1, "Unclosed delimiter %s at l:%zu c:%zu", 
-            //         delim[0], lex->row, lex->col);
-            return 0;
+        if (++s >= end)
+            break;
+
+        node = n->child;
+        while (node && trie->nodes[node].byte != (unsigned char)*s)
+            node = trie->nodes[node].next;
+    }
+
+    return best;
+}
+
+#define I_ BTH_LEX_CLASS_IDENT
+#define B_ BTH_LEX_CLASS_BLANK
+#define D_ (BTH_LEX_CLASS_IDENT | BTH_LEX_CLASS_DIGIT)
+const unsigned char bth_lex_class[256] = {
+    0,  0,  0,  0,  0,  0,  0,  0,  0,  B_, 0,  0,  0,  0,  0,  0,
+    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    B_, 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    D_, D_, D_, D_, D_, D_, D_, D_, D_, D_, 0,  0,  0,  0,  0,  0,
+    0,  I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_,
+    I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, 0,  0,  0,  0,  I_,
+    0,  I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_,
+    I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, 0,  0,  0,  0,  0,
+};
+#undef I_
+#undef B_
+#undef D_
+
+// Run scanners return how many bytes from s on belong to the run. The
+// scalar versions are the reference, the SSE2/AVX2 ones test 16 or 32 bytes
+// per step and are picked at runtime by bth_lex_init.
+size_t bth_lex_scan_ident_scalar(const char *s, const char *end)
+{
+    const char *p = s;
+
+    while (p < end && BTH_LEX_ISCLASS(*p, BTH_LEX_CLASS_IDENT))
+        p++;
+
+    return p - s;
+}
+
+size_t bth_lex_scan_byte_scalar(const char *s, const char *end, char c)
+{
+    const char *p = s;
+
+    while (p < end && *p == c)
+        p++;
 
-        if (*(curptr + clen) == '\n')
+    return p - s;
+}
+
+// counts occurrences of c in [s, end) and points last at the final one
+size_t bth_lex_count_byte_scalar(const char *s, const char *end, char c,
+                                 const char **last)
+{
+    size_t n = 0;
+
+    for (const char *p = s; p < end; p++)
+    {
+        if (*p == c)
         {
-            lex->row++;
-            lex->col = 0;
+            *last = p;
+            n++;
         }
-
-        clen++;
     }
 
-    t->name = delim[0];
-    t->end = curptr + clen + lend;
-    lex->col += clen + lend;
-    lex->cur += clen + lend;
+    return n;
+}
+
+// stores the offsets from s of every c in [s, end) to out, returns how
+// many were stored
+size_t bth_lex_index_byte_scalar(const char *s, const char *end, char c,
+                                 size_t *out)
+{
+    size_t n = 0;
+
+    for (const char *p = s; p < end; p++)
+        if (*p == c)
+            out[n++] = p - s;
+
+    return n;
+}
 
-    if (*(curptr + clen) == '\n')
+#ifdef BTH_LEX_SIMD
+size_t bth_lex_count_byte_sse2(const char *s, const char *end, char c,
+                               const char **last)
+{
+    const char *p = s;
+    const __m128i b = _mm_set1_epi8(c);
+    size_t n = 0;
+
+    for (; p + 16 <= end; p += 16)
     {
-        lex->row++;
-        lex->col = 0;
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, b));
+
+        if (mask)
+        {
+            n += __builtin_popcount(mask);
+            *last = p + 31 - __builtin_clz(mask);
+        }
     }
 
-    return 1;
+    return n + bth_lex_count_byte_scalar(p, end, c, last);
 }
-#endif
 
-#ifdef BTH_LEX_DEFAULT_GET_SYMBOL
-int bth_lex_find_symbol(struct bth_lexer *lex, const char *s2, size_t *idx)
+__attribute__((target("avx2,popcnt")))
+size_t bth_lex_count_byte_avx2(const char *s, const char *end, char c,
+                               const char **last)
 {
-    for (size_t i = 0; i < lex->symbols_count; i++)
+    const char *p = s;
+    const __m256i b = _mm256_set1_epi8(c);
+    size_t n = 0;
+
+    for (; p + 32 <= end; p += 32)
     {
-        const char *s1 = lex->symbols[i * 2 + 1];
-        if (!BTH_LEX_STRNCMP(s1, s2, BTH_LEX_STRLEN(s1)))
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, b));
+
+        if (mask)
         {
-            *idx = i * 2;
-            return 1;
+            n += __builtin_popcount(mask);
+            *last = p + 31 - __builtin_clz(mask);
         }
     }
 
-    return 0;
+    return n + bth_lex_count_byte_sse2(p, end, c, last);
 }
 
-int bth_lex_get_symbol(struct bth_lexer *lex, struct bth_lex_token *t)
+size_t bth_lex_index_byte_sse2(const char *s, const char *end, char c,
+                               size_t *out)
 {
-    const char *curptr = lex->buffer + lex->cur;
-    size_t idx = 0;
+    const char *p = s;
+    const __m128i b = _mm_set1_epi8(c);
+    size_t n = 0;
 
-    if (!bth_lex_find_symbol(lex, curptr, &idx))
-        return 0;
-    
-    const char **symbol = lex->symbols + idx;
-    size_t slen = BTH_LEX_STRLEN(symbol[1]);
+    for (; p + 16 <= end; p += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, b));
 
-    t->kind = LK_SYMBOL;
-    t->idx = idx;
-    t->name = symbol[0];
-    t->row = lex->row;
-    t->col = lex->col;
-    t->begin = curptr;
-    t->end = curptr + slen;
+        for (; mask; mask &= mask - 1)
+            out[n++] = p - s + __builtin_ctz(mask);
+    }
+
+    for (; p < end; p++)
+        if (*p == c)
+            out[n++] = p - s;
 
-    lex->col += slen;
+    return n;
+}
+
+__attribute__((target("avx2")))
+size_t bth_lex_index_byte_avx2(const char *s, const char *end, char c,
+                               size_t *out)
+{
+    const char *p = s;
+    const __m256i b = _mm256_set1_epi8(c);
+    size_t n = 0;
 
-    if (!BTH_LEX_STRNCMP("\n", symbol[1], slen))
+    for (; p + 32 <= end; p += 32)
     {
-        lex->row++;
-        lex->col = 0;
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, b));
+
+        for (; mask; mask &= mask - 1)
+            out[n++] = p - s + __builtin_ctz(mask);
     }
 
-    lex->cur += slen;
-    
-    return 1;
+    for (; p < end; p++)
+        if (*p == c)
+            out[n++] = p - s;
+
+    return n;
 }
-#endif
 
+// bits set for the bytes of v that are not identifier characters
+static inline unsigned bth_lex_nonident_sse2(__m128i v)
+{
+    const __m128i bit = _mm_set1_epi8(0x20);
+    const __m128i a = _mm_set1_epi8('a' - 1);
+    const __m128i z = _mm_set1_epi8('z' + 1);
+    const __m128i d0 = _mm_set1_epi8('0' - 1);
+    const __m128i d9 = _mm_set1_epi8('9' + 1);
+    const __m128i us = _mm_set1_epi8('_');
 
-#ifdef BTH_LEX_DEFAULT_GET_IDENT
+    __m128i l = _mm_or_si128(v, bit);
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(l, a),
+                                  _mm_cmplt_epi8(l, z));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, d0),
+                                  _mm_cmplt_epi8(v, d9));
+    __m128i ok = _mm_or_si128(_mm_or_si128(alpha, digit),
+                              _mm_cmpeq_epi8(v, us));
 
-#ifdef BTH_LEX_DEFAULT_ISVALID
-int bth_lex_isvalid(char c)
+    return ~(unsigned)_mm_movemask_epi8(ok) & 0xFFFF;
+}
+
+size_t bth_lex_scan_ident_sse2(const char *s, const char *end)
 {
-    return isalnum(c) || c == '_';
+    const char *p = s;
+
+    for (; p + 16 <= end; p += 16)
+    {
+        unsigned mask = bth_lex_nonident_sse2(
+            _mm_loadu_si128((const __m128i *)p));
+
+        if (mask)
+            return p - s + __builtin_ctz(mask);
+    }
+
+    return p - s + bth_lex_scan_ident_scalar(p, end);
 }
-#endif
 
-int bth_lex_get_ident(struct bth_lexer *lex, struct bth_lex_token *t)
+size_t bth_lex_scan_byte_sse2(const char *s, const char *end, char c)
 {
-    const char *curptr = lex->buffer + lex->cur;
-    const char *lastptr = lex->buffer + lex->size;
-    size_t off = 0;
+    const char *p = s;
+    const __m128i b = _mm_set1_epi8(c);
 
-    while (curptr + off < lastptr && BTH_LEX_ISVALID(*(curptr + off)))
-        off++;
+    for (; p + 16 <= end; p += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned mask = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, b))
+            & 0xFFFF;
 
-    if (off == 0)
-        return 0;
-    
-    t->kind = LK_IDENT;
-    t->idx = 0;
-    t->name = "IDENT";
-    t->row = lex->row;
-    t->col = lex->col;
-    t->begin = curptr;
-    t->end = curptr + off;
+        if (mask)
+            return p - s + __builtin_ctz(mask);
+    }
 
-    lex->cur += off;
-    lex->col += off;
+    return p - s + bth_lex_scan_byte_scalar(p, end, c);
+}
 
-    return 1;
+__attribute__((target("avx2")))
+static inline unsigned bth_lex_nonident_avx2(__m256i v)
+{
+    const __m256i bit = _mm256_set1_epi8(0x20);
+    const __m256i a = _mm256_set1_epi8('a' - 1);
+    const __m256i z = _mm256_set1_epi8('z' + 1);
+    const __m256i d0 = _mm256_set1_epi8('0' - 1);
+    const __m256i d9 = _mm256_set1_epi8('9' + 1);
+    const __m256i us = _mm256_set1_epi8('_');
+
+    __m256i l = _mm256_or_si256(v, bit);
+    __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(l, a),
+                                     _mm256_cmpgt_epi8(z, l));
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, d0),
+                                     _mm256_cmpgt_epi8(d9, v));
+    __m256i ok = _mm256_or_si256(_mm256_or_si256(alpha, digit),
+                                 _mm256_cmpeq_epi8(v, us));
+
+    return ~(unsigned)_mm256_movemask_epi8(ok);
+}
+
+__attribute__((target("avx2")))
+size_t bth_lex_scan_ident_avx2(const char *s, const char *end)
+{
+    const char *p = s;
+
+    for (; p + 32 <= end; p += 32)
+    {
+        unsigned mask = bth_lex_nonident_avx2(
+            _mm256_loadu_si256((const __m256i *)p));
+
+        if (mask)
+            return p - s + __builtin_ctz(mask);
+    }
+
+    return p - s + bth_lex_scan_ident_sse2(p, end);
+}
+
+__attribute__((target("avx2")))
+size_t bth_lex_scan_byte_avx2(const char *s, const char *end, char c)
+{
+    const char *p = s;
+    const __m256i b = _mm256_set1_epi8(c);
+
+    for (; p + 32 <= end; p += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(v, b));
+
+        if (mask)
+            return p - s + __builtin_ctz(mask);
+    }
+
+    return p - s + bth_lex_scan_byte_sse2(p, end, c);
+}
+
+// over-reading variants, for inputs followed by BTH_LEX_OVERREAD zero
+// bytes: a zero ends any run, so the loads need no bound and there is no
+// scalar tail. c must not be 0
+static inline size_t bth_lex_clamp(const char *s, const char *end, size_t n)
+{
+    return n < (size_t)(end - s) ? n : (size_t)(end - s);
+}
+
+size_t bth_lex_scan_ident_padded_sse2(const char *s, const char *end)
+{
+    const char *p = s;
+    unsigned mask;
+
+    while (!(mask = bth_lex_nonident_sse2(
+                 _mm_loadu_si128((const __m128i *)p))))
+        p += 16;
+
+    return bth_lex_clamp(s, end, p - s + __builtin_ctz(mask));
+}
+
+size_t bth_lex_scan_byte_padded_sse2(const char *s, const char *end, char c)
+{
+    const char *p = s;
+    const __m128i b = _mm_set1_epi8(c);
+    unsigned mask;
+
+    while (!(mask = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(
+                 _mm_loadu_si128((const __m128i *)p), b)) & 0xFFFF))
+        p += 16;
+
+    return bth_lex_clamp(s, end, p - s + __builtin_ctz(mask));
+}
+
+__attribute__((target("avx2")))
+size_t bth_lex_scan_ident_padded_avx2(const char *s, const char *end)
+{
+    const char *p = s;
+    unsigned mask;
+
+    while (!(mask = bth_lex_nonident_avx2(
+                 _mm256_loadu_si256((const __m256i *)p))))
+        p += 32;
+
+    return bth_lex_clamp(s, end, p - s + __builtin_ctz(mask));
+}
+
+__attribute__((target("avx2")))
+size_t bth_lex_scan_byte_padded_avx2(const char *s, const char *end, char c)
+{
+    const char *p = s;
+    const __m256i b = _mm256_set1_epi8(c);
+    unsigned mask;
+
+    while (!(mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                 _mm256_loadu_si256((const __m256i *)p), b))))
+        p += 32;
+
+    return bth_lex_clamp(s, end, p - s + __builtin_ctz(mask));
 }
 #endif
 
-// is in bounds ?
-// is delim ?
-// is symbol ?
-// is valid ident ?
+size_t (*bth_lex_scan_ident)(const char *s, const char *end)
+    = bth_lex_scan_ident_scalar;
+size_t (*bth_lex_scan_byte)(const char *s, const char *end, char c)
+    = bth_lex_scan_byte_scalar;
+size_t (*bth_lex_count_byte)(const char *s, const char *end, char c,
+                             const char **last) = bth_lex_count_byte_scalar;
+size_t (*bth_lex_index_byte)(const char *s, const char *end, char c,
+                             size_t *out) = bth_lex_index_byte_scalar;
+size_t (*bth_lex_scan_ident_padded)(const char *s, const char *end)
+    = bth_lex_scan_ident_scalar;
+size_t (*bth_lex_scan_byte_padded)(const char *s, const char *end, char c)
+    = bth_lex_scan_byte_scalar;
 
-struct bth_lex_token bth_lex_get_token(struct bth_lexer *lex)
+static pthread_once_t bth_lex_kernels_once = PTHREAD_ONCE_INIT;
+
+// the kernels are picked once a process, by the first bth_lex_init: lexers
+// made later on other threads may already be calling them
+static void bth_lex_select_kernels(void)
 {
-    struct bth_lex_token tok = {
-        .kind = INVALID,
-        .row = lex->row,
-        .col = lex->col,
-        .begin = lex->buffer + lex->cur,
-    };
+#ifdef BTH_LEX_SIMD
+    bth_lex_scan_ident = bth_lex_scan_ident_sse2;
+    bth_lex_scan_byte = bth_lex_scan_byte_sse2;
+    bth_lex_count_byte = bth_lex_count_byte_sse2;
+    bth_lex_index_byte = bth_lex_index_byte_sse2;
+    bth_lex_scan_ident_padded = bth_lex_scan_ident_padded_sse2;
+    bth_lex_scan_byte_padded = bth_lex_scan_byte_padded_sse2;
 
-    if (lex->cur >= lex->size)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
     {
-        tok.kind = LK_END;
-        tok.idx = 0;
-        tok.name = "END";
-        tok.row = lex->row;
-        tok.col = lex->col;
-        tok.begin = lex->buffer + lex->size;
-        tok.end = tok.begin;
-        return tok;
+        bth_lex_scan_ident = bth_lex_scan_ident_avx2;
+        bth_lex_scan_byte = bth_lex_scan_byte_avx2;
+        bth_lex_count_byte = bth_lex_count_byte_avx2;
+        bth_lex_index_byte = bth_lex_index_byte_avx2;
+        bth_lex_scan_ident_padded = bth_lex_scan_ident_padded_avx2;
+        bth_lex_scan_byte_padded = bth_lex_scan_byte_padded_avx2;
     }
+#endif
+}
 
-    if (BTH_LEX_GET_DELIM(lex, &tok))
-        return tok;
+int bth_lex_init(struct bth_lexer *lex)
+{
+    pthread_once(&bth_lex_kernels_once, bth_lex_select_kernels);
 
-    if (BTH_LEX_GET_SYMBOL(lex, &tok))
-        return tok;
+    const struct bth_allocator *a = &lex->alloc;
 
-    if (BTH_LEX_GET_IDENT(lex, &tok))
-        return tok;
+    lex->symbols_trie = bth_lex_mem_alloc(a, sizeof(struct bth_lex_trie));
+    lex->delims_trie = bth_lex_mem_alloc(a, sizeof(struct bth_lex_trie));
 
-    return tok;
+    if (lex->symbols_trie && lex->delims_trie
+        && bth_lex_trie_build(lex->symbols_trie, lex->symbols,
+                              lex->symbols_count, a))
+    {
+        if (bth_lex_trie_build(lex->delims_trie, lex->delims,
+                               lex->delims_count, a))
+            return 1;
+
+        bth_lex_trie_free(lex->symbols_trie, a);
+    }
+
+    if (lex->symbols_trie)
+        bth_lex_mem_free(a, lex->symbols_trie, sizeof(struct bth_lex_trie));
+    if (lex->delims_trie)
+        bth_lex_mem_free(a, lex->delims_trie, sizeof(struct bth_lex_trie));
+    lex->symbols_trie = NULL;
+    lex->delims_trie = NULL;
+
+    return 0;
+}
+
+void bth_lex_fini(struct bth_lexer *lex)
+{
+    const struct bth_allocator *a = &lex->alloc;
+
+    if (!lex->forked && lex->symbols_trie)
+    {
+        bth_lex_trie_free(lex->symbols_trie, a);
+        bth_lex_mem_free(a, lex->symbols_trie, sizeof(struct bth_lex_trie));
+    }
+
+    if (!lex->forked && lex->delims_trie)
+    {
+        bth_lex_trie_free(lex->delims_trie, a);
+        bth_lex_mem_free(a, lex->delims_trie, sizeof(struct bth_lex_trie));
+    }
+
+    if (lex->lines)
+        bth_lex_mem_free(a, lex->lines, lex->lines_count * sizeof(size_t));
+    if (lex->window)
+        bth_lex_mem_free(a, lex->window, lex->window_cap);
+    lex->symbols_trie = NULL;
+    lex->delims_trie = NULL;
+    lex->lines = NULL;
+    lex->lines_count = 0;
+    lex->window = NULL;
+}
+
+// points an initialized lexer at a new buffer, keeping its tables, so that
+// many inputs only build the tries once
+void bth_lex_reset(struct bth_lexer *lex, const char *buffer, size_t size)
+{
+    if (lex->lines)
+        bth_lex_mem_free(&lex->alloc, lex->lines,
+                         lex->lines_count * sizeof(size_t));
+    lex->lines = NULL;
+    lex->lines_count = 0;
+    lex->buffer = buffer;
+    lex->size = size;
+    lex->cur = 0;
+    lex->base = 0;
+    lex->base_row = 0;
+    lex->base_col = 0;
+    lex->keep = BTH_LEX_NOMATCH;
+    lex->starved = 0;
+    lex->eof = 0;
+}
+
+// makes dst a lexer of its own over the tables of src, which only reads
+// them once built: each thread can lex with a fork while src outlives them
+// all. dst is bth_lex_reset to an empty buffer and bth_lex_fini leaves the
+// tables to src
+void bth_lex_fork(struct bth_lexer *dst, const struct bth_lexer *src)
+{
+    *dst = *src;
+    dst->lines = NULL;
+    dst->window = NULL;
+    dst->refill = NULL;
+    dst->input = NULL;
+    dst->window_cap = 0;
+    dst->forked = 1;
+    bth_lex_reset(dst, NULL, 0);
+}
+
+// indexes the start of every line of the buffer, sized by a first counting
+// pass so that the newlines are only stored once
+int bth_lex_lines_build(struct bth_lexer *lex)
+{
+    const char *end = lex->buffer + lex->size;
+    const char *last;
+    size_t n = bth_lex_count_byte(lex->buffer, end, '\n', &last);
+
+    if (lex->lines)
+        bth_lex_mem_free(&lex->alloc, lex->lines,
+                         lex->lines_count * sizeof(size_t));
+    lex->lines = bth_lex_mem_alloc(&lex->alloc, (n + 1) * sizeof(size_t));
+    lex->lines_count = 0;
+
+    if (!lex->lines)
+        return 0;
+
+    lex->lines[0] = 0;
+    bth_lex_index_byte(lex->buffer, end, '\n', lex->lines + 1);
+
+    for (size_t i = 1; i <= n; i++)
+        lex->lines[i]++;
+
+    lex->lines_count = n + 1;
+    return 1;
+}
+
+// 1-based row and column of the byte at buffer offset off, which in window
+// mode must still be in the window
+int bth_lex_position(struct bth_lexer *lex, size_t off, size_t *row,
+                     size_t *col)
+{
+    if (!lex->lines && !bth_lex_lines_build(lex))
+        return 0;
+
+    size_t lo = 0;
+    size_t hi = lex->lines_count;
+
+    // last line starting at or before off
+    while (hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (lex->lines[mid] <= off)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    *row = lex->base_row + lo + 1;
+    *col = off - lex->lines[lo] + 1 + (lo ? 0 : lex->base_col);
+    return 1;
+}
+
+// a closer preceded by an odd run of escape bytes is escaped
+int bth_lex_is_escaped(const char *begin, const char *p)
+{
+    const char *q = p;
+
+    while (q > begin && *(q - 1) == BTH_LEX_ESCAPE)
+        q--;
+
+    return (p - q) & 1;
+}
+
+// consumes the delimited token opened by delims[idx] at the cursor, clen
+// and lend being the lengths of its opener and closer
+int bth_lex_close_delim(struct bth_lexer *lex, struct bth_lex_token *t,
+                        size_t idx, size_t clen, size_t lend)
+{
+    const char *curptr = lex->buffer + lex->cur;
+    const char *lastptr = lex->buffer + lex->size;
+    const struct bth_lex_entry *delim = lex->delims + idx;
+
+    // quote-like delimiters (same opener and closer) honor escapes
+    int escapes = clen == lend && !BTH_LEX_STRNCMP(delim->str, delim->close,
+                                                   lend);
+    const char *body = curptr + clen;
+    const char *p = body;
+
+    for (;;)
+    {
+        p = memchr(p, delim->close[0], lastptr - p);
+
+        if (!p || (size_t)(lastptr - p) < lend)
+        {
+            // BTH_LEX_ERRX(1, "Unclosed delimiter %s at l:%zu c:%zu", 
+            //         delim->str, row, col);
+            // the closer may still be in the input past the window
+            lex->starved = 1;
+            return 0;
+        }
+
+        if (!BTH_LEX_STRNCMP(delim->close, p, lend)
+            && !(escapes && bth_lex_is_escaped(body, p)))
+            break;
+
+        p++;
+    }
+
+    t->kind = LK_DELIMITED;
+    t->id = delim->id;
+    t->begin = curptr;
+    t->end = p + lend;
+
+    lex->cur = t->end - lex->buffer;
+
+    return 1;
+}
+
+// consumes the symbols[idx] token of length slen at the cursor
+int bth_lex_take_symbol(struct bth_lexer *lex, struct bth_lex_token *t,
+                        size_t idx, size_t slen)
+{
+    const char *curptr = lex->buffer + lex->cur;
+
+    // blanks come in runs, take the whole run as a single token
+    if (slen == 1 && BTH_LEX_ISCLASS(*curptr, BTH_LEX_CLASS_BLANK))
+        slen += (lex->padding >= BTH_LEX_OVERREAD ? bth_lex_scan_byte_padded
+                                                  : bth_lex_scan_byte)(
+            curptr + 1, lex->buffer + lex->size, *curptr);
+
+    t->kind = LK_SYMBOL;
+    t->id = lex->symbols[idx].id;
+    t->begin = curptr;
+    t->end = curptr + slen;
+
+    lex->cur += slen;
+    
+    return 1;
+}
+
+int bth_lex_get_number(struct bth_lexer *lex, struct bth_lex_token *t)
+{
+    const char *curptr = lex->buffer + lex->cur;
+    const char *lastptr = lex->buffer + lex->size;
+
+    if (!lex->number)
+        return 0;
+
+    if (!BTH_LEX_ISCLASS(*curptr, BTH_LEX_CLASS_DIGIT)
+        && !(*curptr == '.' && curptr + 1 < lastptr
+             && BTH_LEX_ISCLASS(curptr[1], BTH_LEX_CLASS_DIGIT)))
+        return 0;
+
+    size_t len = lex->number(curptr, lastptr, t);
+
+    if (!len)
+        return 0;
+
+    t->kind = LK_NUMBER;
+    t->begin = curptr;
+    t->end = curptr + len;
+
+    lex->cur += len;
+
+    return 1;
+}
+
+#ifdef BTH_LEX_DEFAULT_GET_DELIM
+int bth_lex_find_delim(struct bth_lexer *lex, const char *s2, size_t *idx)
+{
+    size_t i = bth_lex_trie_match(lex->delims_trie, s2,
+                                  lex->buffer + lex->size);
+
+    if (i == BTH_LEX_NOMATCH)
+        return 0;
+
+    *idx = i;
+    return 1;
+}
+
+int bth_lex_get_delim(struct bth_lexer *lex, struct bth_lex_token *t)
+{
+    size_t idx = 0;
+
+    if (!bth_lex_find_delim(lex, lex->buffer + lex->cur, &idx))
+        return 0;
+
+    return bth_lex_close_delim(lex, t, idx, lex->delims[idx].len,
+                               lex->delims[idx].close_len);
+}
+#endif
+
+#ifdef BTH_LEX_DEFAULT_GET_SYMBOL
+int bth_lex_find_symbol(struct bth_lexer *lex, const char *s2, size_t *idx)
+{
+    size_t i = bth_lex_trie_match(lex->symbols_trie, s2,
+                                  lex->buffer + lex->size);
+
+    if (i == BTH_LEX_NOMATCH)
+        return 0;
+
+    *idx = i;
+    return 1;
+}
+
+int bth_lex_get_symbol(struct bth_lexer *lex, struct bth_lex_token *t)
+{
+    size_t idx = 0;
+
+    if (!bth_lex_find_symbol(lex, lex->buffer + lex->cur, &idx))
+        return 0;
+
+    return bth_lex_take_symbol(lex, t, idx, lex->symbols[idx].len);
+}
+#endif
+
+
+#ifdef BTH_LEX_DEFAULT_GET_IDENT
+
+int bth_lex_get_ident(struct bth_lexer *lex, struct bth_lex_token *t)
+{
+    const char *curptr = lex->buffer + lex->cur;
+    const char *lastptr = lex->buffer + lex->size;
+    size_t off = 0;
+
+#ifdef BTH_LEX_DEFAULT_ISVALID
+    off = lex->padding >= BTH_LEX_OVERREAD
+        ? bth_lex_scan_ident_padded(curptr, lastptr)
+        : bth_lex_scan_ident(curptr, lastptr);
+#else
+    while (curptr + off < lastptr && BTH_LEX_ISVALID(*(curptr + off)))
+        off++;
+#endif
+
+    if (off == 0)
+        return 0;
+    
+    t->kind = LK_IDENT;
+    t->id = lex->ids[LK_IDENT];
+
+    if (lex->keyword && lex->keyword(curptr, off, &t->id))
+        t->kind = LK_KEYWORD;
+
+    t->begin = curptr;
+    t->end = curptr + off;
+
+    lex->cur += off;
+
+    return 1;
+}
+#endif
+
+// is in bounds ?
+// is delim ?
+// is number ?
+// is valid ident (then keyword) ?
+// is symbol ?
+
+struct bth_lex_token bth_lex_get_raw_token(struct bth_lexer *lex)
+{
+    struct bth_lex_token tok = {
+        .kind = INVALID,
+        .id = lex->ids[INVALID],
+        .trivia = lex->buffer + lex->cur,
+        .begin = lex->buffer + lex->cur,
+    };
+
+    if (lex->cur >= lex->size)
+    {
+        tok.kind = LK_END;
+        tok.id = lex->ids[LK_END];
+        tok.begin = lex->buffer + lex->size;
+        tok.end = tok.begin;
+        return tok;
+    }
+
+    if (BTH_LEX_GET_DELIM(lex, &tok))
+        return tok;
+
+    if (bth_lex_get_number(lex, &tok))
+        return tok;
+
+    if (BTH_LEX_GET_IDENT(lex, &tok))
+        return tok;
+
+    if (BTH_LEX_GET_SYMBOL(lex, &tok))
+        return tok;
+
+    return tok;
+}
+
+// points the n tokens of t, lexed while the window held the input from
+// offset base at buffer, back at their bytes after the window slid or
+// grew. Their offsets in the input do not change
+void bth_lex_rebase(const struct bth_lexer *lex, const char *buffer,
+                    size_t base, struct bth_lex_token *t, size_t n)
+{
+    if (buffer == lex->buffer && base == lex->base)
+        return;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        // through integers, the old buffer may have been freed
+        uintptr_t old = (uintptr_t)buffer;
+        const char *now = lex->buffer - (lex->base - base);
+
+        t[i].trivia = now + ((uintptr_t)t[i].trivia - old);
+        t[i].begin = now + ((uintptr_t)t[i].begin - old);
+        t[i].end = now + ((uintptr_t)t[i].end - old);
+    }
+}
+
+// sets up lex to read its input through refill, in a window of cap bytes
+int bth_lex_window_init(struct bth_lexer *lex, size_t cap,
+                        size_t (*refill)(void *input, char *dst, size_t n),
+                        void *input)
+{
+    lex->window = bth_lex_mem_alloc(&lex->alloc, cap);
+
+    if (!lex->window)
+        return 0;
+
+    lex->refill = refill;
+    lex->input = input;
+    lex->window_cap = cap;
+    lex->buffer = lex->window;
+    lex->size = 0;
+    lex->cur = 0;
+    lex->base = 0;
+    lex->base_row = 0;
+    lex->base_col = 0;
+    lex->keep = BTH_LEX_NOMATCH;
+    lex->eof = 0;
+
+    return 1;
+}
+
+// drops the window bytes before keep, or doubles the window when there are
+// none, then reads more input after the rest. Returns 0 when out of memory
+int bth_lex_window_fill(struct bth_lexer *lex, size_t keep)
+{
+    if (keep == 0 && lex->size == lex->window_cap)
+    {
+        char *w = bth_lex_mem_realloc(&lex->alloc, lex->window,
+                                      lex->window_cap,
+                                      lex->window_cap * 2);
+
+        if (!w)
+            return 0;
+
+        lex->window = w;
+        lex->window_cap *= 2;
+    }
+    else if (keep)
+    {
+        const char *last = NULL;
+        size_t lines = bth_lex_count_byte(lex->window, lex->window + keep,
+                                          '\n', &last);
+
+        lex->base_row += lines;
+        lex->base_col = lines ? (size_t)(lex->window + keep - last - 1)
+                              : lex->base_col + keep;
+
+        memmove(lex->window, lex->window + keep, lex->size - keep);
+        lex->base += keep;
+        lex->cur -= keep;
+        lex->size -= keep;
+    }
+
+    // the line index was for the old window
+    if (lex->lines)
+        bth_lex_mem_free(&lex->alloc, lex->lines,
+                         lex->lines_count * sizeof(size_t));
+    lex->lines = NULL;
+    lex->lines_count = 0;
+    lex->buffer = lex->window;
+
+    size_t n = lex->refill(lex->input, lex->window + lex->size,
+                           lex->window_cap - lex->size);
+
+    lex->size += n;
+    lex->eof = !n;
+
+    return 1;
+}
+
+// raw token at the cursor of a window mode lexer. A token reaching the end
+// of the window, or a delimiter not closed in it, may go on in the input:
+// it is lexed again once more input is in
+struct bth_lex_token bth_lex_window_token(struct bth_lexer *lex,
+                                          bth_lex_fn raw)
+{
+    for (;;)
+    {
+        size_t cur = lex->cur;
+        struct bth_lex_token tok;
+
+        lex->starved = 0;
+        tok = raw(lex);
+
+        if (lex->eof
+            || (!lex->starved && tok.end < lex->buffer + lex->size))
+            return tok;
+
+        size_t keep = cur;
+
+        if (lex->keep < lex->base + keep)
+            keep = lex->keep - lex->base;
+
+        lex->cur = cur;
+
+        if (!bth_lex_window_fill(lex, keep))
+        {
+            tok.kind = INVALID;
+            tok.id = lex->ids[INVALID];
+            return tok;
+        }
+    }
+}
+
+// raw token at the cursor, through the window in window mode
+struct bth_lex_token bth_lex_pull(struct bth_lexer *lex, bth_lex_fn raw)
+{
+    return lex->refill ? bth_lex_window_token(lex, raw) : raw(lex);
+}
+
+// pulls raw tokens until a significant one, which gets the skipped span as
+// its leading trivia
+struct bth_lex_token bth_lex_fold_trivia(struct bth_lexer *lex, bth_lex_fn raw)
+{
+    // the span is pinned in the window, which may slide meanwhile
+    size_t start = lex->base + lex->cur;
+    size_t keep = lex->keep;
+    struct bth_lex_token tok;
+
+    if (start < lex->keep)
+        lex->keep = start;
+
+    do
+        tok = bth_lex_pull(lex, raw);
+    while (tok.kind != LK_END && tok.kind != INVALID && lex->trivia(&tok));
+
+    lex->keep = keep;
+    tok.trivia = lex->buffer + (start - lex->base);
+
+    if (memchr(tok.trivia, '\n', tok.begin - tok.trivia))
+        tok.flags |= BTH_LEX_NEWLINE_BEFORE;
+
+    return tok;
+}
+
+struct bth_lex_token bth_lex_get_token(struct bth_lexer *lex)
+{
+    if (lex->trivia)
+        return bth_lex_fold_trivia(lex, bth_lex_get_raw_token);
+
+    return bth_lex_pull(lex, bth_lex_get_raw_token);
+}
+
+// pulls a token while the ones in held, from the oldest, stay pinned in
+// the window and are moved along if it slides
+static struct bth_lex_token bth_lex_next_held(struct bth_lexer *lex,
+                                              bth_lex_fn next,
+                                              struct bth_lex_token *held,
+                                              size_t n)
+{
+    if (!lex->refill || !n)
+        return next(lex);
+
+    const char *buffer = lex->buffer;
+    size_t base = lex->base;
+    size_t keep = lex->keep;
+    size_t pin = base + (held->trivia - buffer);
+
+    if (pin < keep)
+        lex->keep = pin;
+
+    struct bth_lex_token tok = next(lex);
+
+    lex->keep = keep;
+    bth_lex_rebase(lex, buffer, base, held, n);
+
+    return tok;
+}
+
+// lexes up to n tokens into out in one go, stopping after LK_END or
+// INVALID; returns how many were written
+size_t bth_lex_get_tokens(struct bth_lexer *lex, bth_lex_fn next,
+                          struct bth_lex_token *out, size_t n)
+{
+    size_t i = 0;
+
+    while (i < n)
+    {
+        out[i] = bth_lex_next_held(lex, next, out, i);
+
+        if (out[i++].kind <= LK_END)
+            break;
+    }
+
+    return i;
+}
+
+typedef char bth_lex_lookahead_pow2[
+    BTH_LEX_LOOKAHEAD & (BTH_LEX_LOOKAHEAD - 1) ? -1 : 1];
+
+#define BTH_LEX_RING(i) ((i) & (BTH_LEX_LOOKAHEAD - 1))
+
+void bth_lex_stream_init(struct bth_lex_stream *s, struct bth_lexer *lex,
+                         bth_lex_fn next)
+{
+    s->lex = lex;
+    s->next = next;
+    s->head = 0;
+    s->count = 0;
+}
+
+// token k places ahead, 0 being the one next returns. NULL when k is past
+// the lookahead; past the end, the LK_END token is repeated
+const struct bth_lex_token *bth_lex_peek(struct bth_lex_stream *s, size_t k)
+{
+    if (k >= BTH_LEX_LOOKAHEAD)
+        return NULL;
+
+    // an empty ring is refilled in one batch
+    if (!s->count)
+    {
+        s->head = 0;
+        s->count = bth_lex_get_tokens(s->lex, s->next, s->ring,
+                                      BTH_LEX_LOOKAHEAD);
+    }
+
+    while (s->count <= k)
+    {
+        struct bth_lex_token *last = s->ring + BTH_LEX_RING(s->head
+                                                            + s->count - 1);
+        struct bth_lex_token tok = *last;
+
+        // held tokens must be in order to be pinned, so unwrap the ring
+        if (s->lex->refill && s->head + s->count > BTH_LEX_LOOKAHEAD)
+        {
+            struct bth_lex_token tmp[BTH_LEX_LOOKAHEAD];
+
+            for (size_t i = 0; i < s->count; i++)
+                tmp[i] = s->ring[BTH_LEX_RING(s->head + i)];
+
+            memcpy(s->ring, tmp, s->count * sizeof(*tmp));
+            s->head = 0;
+        }
+
+        if (tok.kind > LK_END)
+            tok = bth_lex_next_held(s->lex, s->next, s->ring + s->head,
+                                    s->count);
+
+        s->ring[BTH_LEX_RING(s->head + s->count)] = tok;
+        s->count++;
+    }
+
+    return s->ring + BTH_LEX_RING(s->head + k);
+}
+
+struct bth_lex_token bth_lex_next(struct bth_lex_stream *s)
+{
+    struct bth_lex_token tok = *bth_lex_peek(s, 0);
+
+    // the final token stays so that reading on keeps returning it
+    if (s->count > 1 || tok.kind > LK_END)
+    {
+        s->head = BTH_LEX_RING(s->head + 1);
+        s->count--;
+    }
+
+    return tok;
+}
+
+#undef BTH_LEX_RING
+
+// alloc may be NULL for BTH_LEX_ALLOC and co, else it is copied
+void bth_lex_store_init(struct bth_lex_store *s, const struct bth_lexer *lex,
+                        const struct bth_allocator *alloc)
+{
+    *s = (struct bth_lex_store){
+        .buffer = lex->buffer,
+        .filename = lex->filename,
+        .folded = lex->trivia != NULL,
+        .number = lex->number,
+    };
+
+    if (alloc)
+        s->alloc = *alloc;
+}
+
+void bth_lex_store_fini(struct bth_lex_store *s)
+{
+    const struct bth_allocator *a = &s->alloc;
+
+    if (s->cap)
+    {
+        bth_lex_mem_free(a, s->kinds, s->cap * sizeof(*s->kinds));
+        bth_lex_mem_free(a, s->ids, s->cap * sizeof(*s->ids));
+        bth_lex_mem_free(a, s->offsets, s->cap * sizeof(*s->offsets));
+        bth_lex_mem_free(a, s->lens, s->cap * sizeof(*s->lens));
+    }
+
+    if (s->repeats_cap)
+        bth_lex_mem_free(a, s->repeats, s->repeats_cap * sizeof(*s->repeats));
+
+    *s = (struct bth_lex_store){0};
+}
+
+static void *bth_lex_store_realloc(struct bth_lex_store *s, void *p,
+                                   size_t old, size_t n)
+{
+    return bth_lex_mem_realloc(&s->alloc, p, old, n);
+}
+
+// grows the arrays one by one to hold cap tokens, what was already moved
+// stays owned by the store if a later one fails
+int bth_lex_store_reserve(struct bth_lex_store *s, size_t cap)
+{
+    size_t old = s->cap;
+    void *p;
+
+    if (cap <= old)
+        return 1;
+
+#define BTH_LEX_STORE_GROW(a)                                       \
+    if (!(p = bth_lex_store_realloc(s, s->a, old * sizeof(*s->a),   \
+                                    cap * sizeof(*s->a))))          \
+        return 0;                                                   \
+    s->a = p
+
+    BTH_LEX_STORE_GROW(kinds);
+    BTH_LEX_STORE_GROW(ids);
+    BTH_LEX_STORE_GROW(offsets);
+    BTH_LEX_STORE_GROW(lens);
+
+#undef BTH_LEX_STORE_GROW
+
+    s->cap = cap;
+    return 1;
+}
+
+int bth_lex_store_reserve_repeats(struct bth_lex_store *s, size_t cap)
+{
+    if (cap <= s->repeats_cap)
+        return 1;
+
+    struct bth_lex_repeat *r = bth_lex_store_realloc(
+        s, s->repeats, s->repeats_cap * sizeof(*r), cap * sizeof(*r));
+
+    if (!r)
+        return 0;
+
+    s->repeats = r;
+    s->repeats_cap = cap;
+    return 1;
+}
+
+// returns 0 when out of memory or past the 4 GiB the offsets can address
+int bth_lex_store_push(struct bth_lex_store *s, const struct bth_lex_token *t)
+{
+    size_t off = t->begin - s->buffer;
+    size_t len = t->end - t->begin;
+
+    if (off + len > UINT32_MAX)
+        return 0;
+
+    if (s->count == s->cap
+        && !bth_lex_store_reserve(s, s->cap ? s->cap * 2 : 1024))
+        return 0;
+
+    s->kinds[s->count] = t->kind;
+    s->ids[s->count] = t->id;
+    s->offsets[s->count] = off;
+    s->lens[s->count] = len;
+    s->count++;
+
+    return 1;
+}
+
+// counts one more occurrence of the last token, ending at offset end
+int bth_lex_store_repeat(struct bth_lex_store *s, size_t end)
+{
+    uint32_t idx = s->count - 1;
+
+    if (end > UINT32_MAX)
+        return 0;
+
+    if (s->repeats_count && s->repeats[s->repeats_count - 1].idx == idx)
+    {
+        s->repeats[s->repeats_count - 1].count++;
+        s->repeats[s->repeats_count - 1].end = end;
+        return 1;
+    }
+
+    if (s->repeats_count == s->repeats_cap
+        && !bth_lex_store_reserve_repeats(s, s->repeats_cap
+                                                 ? s->repeats_cap * 2 : 64))
+        return 0;
+
+    s->repeats[s->repeats_count++] = (struct bth_lex_repeat){idx, 1, end};
+    return 1;
+}
+
+// the repeats of token i, NULL if it has none
+const struct bth_lex_repeat *bth_lex_store_find_repeat(
+    const struct bth_lex_store *s, size_t i)
+{
+    size_t lo = 0;
+    size_t hi = s->repeats_count;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (s->repeats[mid].idx < i)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo < s->repeats_count && s->repeats[lo].idx == i
+        ? &s->repeats[lo] : NULL;
+}
+
+// extra occurrences merged into token i
+size_t bth_lex_store_repeats(const struct bth_lex_store *s, size_t i)
+{
+    const struct bth_lex_repeat *r = bth_lex_store_find_repeat(s, i);
+
+    return r ? r->count : 0;
+}
+
+// appends the tokens of src from index from on, both stores indexing the
+// same buffer. If merge, the first of them is another occurrence of the
+// last token of dst and only adds to its repeats
+int bth_lex_store_append(struct bth_lex_store *dst,
+                         const struct bth_lex_store *src, size_t from,
+                         int merge)
+{
+    return bth_lex_store_append_range(dst, src, from, src->count, merge);
+}
+
+// same for the tokens of src from index from to index to excluded
+int bth_lex_store_append_range(struct bth_lex_store *dst,
+                               const struct bth_lex_store *src, size_t from,
+                               size_t to, int merge)
+{
+    if (to > src->count)
+        to = src->count;
+
+    if (from >= to)
+        return 1;
+
+    size_t n = to - from;
+    size_t r = 0;
+    size_t rend = src->repeats_count;
+
+    // repeats of src from the first appended token on, up to the last
+    while (r < src->repeats_count && src->repeats[r].idx < from)
+        r++;
+
+    while (rend > r && src->repeats[rend - 1].idx >= to)
+        rend--;
+
+    if (merge)
+    {
+        size_t extra = 1;
+        size_t end = bth_lex_store_end(src, from) - src->buffer;
+
+        if (r < src->repeats_count && src->repeats[r].idx == from)
+        {
+            end = src->repeats[r].end;
+            extra += src->repeats[r++].count;
+        }
+
+        for (; extra; extra--)
+            if (!bth_lex_store_repeat(dst, end))
+                return 0;
+
+        from++;
+        n--;
+    }
+
+    if (dst->count + n > dst->cap
+        && !bth_lex_store_reserve(dst, dst->count + n))
+        return 0;
+
+    memcpy(dst->kinds + dst->count, src->kinds + from, n);
+    memcpy(dst->ids + dst->count, src->ids + from, n * sizeof(*dst->ids));
+    memcpy(dst->offsets + dst->count, src->offsets + from,
+           n * sizeof(*dst->offsets));
+    memcpy(dst->lens + dst->count, src->lens + from, n * sizeof(*dst->lens));
+
+    size_t rn = rend - r;
+
+    if (!bth_lex_store_reserve_repeats(dst, dst->repeats_count + rn))
+        return 0;
+
+    for (size_t i = 0; i < rn; i++)
+        dst->repeats[dst->repeats_count++] = (struct bth_lex_repeat){
+            src->repeats[r + i].idx - from + dst->count,
+            src->repeats[r + i].count,
+            src->repeats[r + i].end,
+        };
+
+    dst->count += n;
+    return 1;
+}
+
+struct bth_lex_token bth_lex_store_get(const struct bth_lex_store *s,
+                                       size_t i)
+{
+    const char *begin = bth_lex_store_begin(s, i);
+    const char *trivia = begin;
+
+    // past the repeats of the previous token, folded between them
+    if (s->folded && i)
+    {
+        const struct bth_lex_repeat *r = bth_lex_store_find_repeat(s, i - 1);
+
+        trivia = r ? s->buffer + r->end : bth_lex_store_end(s, i - 1);
+    }
+    else if (s->folded)
+        trivia = s->buffer;
+
+    struct bth_lex_token t = {
+        .kind = s->kinds[i],
+        .id = s->ids[i],
+        .filename = s->filename,
+        .repeat = bth_lex_store_repeats(s, i),
+        .trivia = trivia,
+        .begin = begin,
+        .end = begin + s->lens[i],
+    };
+
+    if (memchr(trivia, '\n', begin - trivia))
+        t.flags |= BTH_LEX_NEWLINE_BEFORE;
+
+    if (t.kind == LK_NUMBER && s->number)
+        s->number(t.begin, t.end, &t);
+
+    return t;
 }
 #endif
 
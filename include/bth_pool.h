@@ -0,0 +1,209 @@
+// MIT No Attribution
+//
+// Copyright (c) 2025 bobthehuge
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// Runs tasks 0 to count - 1 over a fixed set of worker threads. Every worker
+// starts with a contiguous share of the tasks and takes them in order from
+// the front; once out of work it steals from the back of another share, so
+// uneven task costs still keep every worker busy.
+
+#ifndef BTH_POOL_H
+#define BTH_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef BTH_POOL_ALLOC
+#define BTH_POOL_ALLOC(n) malloc(n)
+#endif
+
+#ifndef BTH_POOL_FREE
+#define BTH_POOL_FREE(p) free(p)
+#endif
+
+// keeps the shares of two workers out of a common cache line
+#define BTH_POOL_LINE 64
+
+// runs task on worker, a number below the pool's workers
+typedef void (*bth_pool_fn)(void *ctx, unsigned worker, size_t task);
+
+struct bth_pool_share
+{
+    // first task left in the high half, end of the share in the low one, so
+    // that both ends move with a single compare and swap
+    uint64_t range;
+    size_t steals; // tasks this worker took from others
+    char pad[BTH_POOL_LINE - sizeof(uint64_t) - sizeof(size_t)];
+};
+
+struct bth_pool_worker
+{
+    struct bth_pool *pool;
+    unsigned id;
+    pthread_t thread;
+};
+
+struct bth_pool
+{
+    bth_pool_fn run;
+    void *ctx;
+    unsigned workers;
+    unsigned started; // threads running, the others' shares get stolen
+    struct bth_pool_share *shares;
+    struct bth_pool_worker *threads;
+};
+
+int bth_pool_start(struct bth_pool *p, unsigned workers, size_t count,
+                   bth_pool_fn run, void *ctx);
+size_t bth_pool_join(struct bth_pool *p);
+
+#ifdef BTH_POOL_IMPLEMENTATION
+#include <stdlib.h>
+#include <string.h>
+
+#define BTH_POOL_RANGE(first, end) (((uint64_t)(first) << 32) | (end))
+#define BTH_POOL_FIRST(r) ((uint32_t)((r) >> 32))
+#define BTH_POOL_END(r) ((uint32_t)(r))
+
+// takes the first task of s, or its last one if steal
+static int bth_pool_take(struct bth_pool_share *s, int steal, size_t *task)
+{
+    uint64_t r = __atomic_load_n(&s->range, __ATOMIC_ACQUIRE);
+
+    for (;;)
+    {
+        uint32_t first = BTH_POOL_FIRST(r);
+        uint32_t end = BTH_POOL_END(r);
+
+        if (first >= end)
+            return 0;
+
+        uint64_t next = steal ? BTH_POOL_RANGE(first, end - 1)
+                              : BTH_POOL_RANGE(first + 1, end);
+
+        if (__atomic_compare_exchange_n(&s->range, &r, next, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            *task = steal ? end - 1 : first;
+            return 1;
+        }
+    }
+}
+
+static void *bth_pool_work(void *arg)
+{
+    struct bth_pool_worker *w = arg;
+    struct bth_pool *p = w->pool;
+    struct bth_pool_share *own = p->shares + w->id;
+    size_t task;
+
+    for (;;)
+    {
+        while (bth_pool_take(own, 0, &task))
+            p->run(p->ctx, w->id, task);
+
+        // shares never grow back, so one empty round means all is done
+        unsigned i = 1;
+
+        for (; i < p->workers; i++)
+        {
+            struct bth_pool_share *victim = p->shares
+                + (w->id + i) % p->workers;
+
+            if (bth_pool_take(victim, 1, &task))
+            {
+                own->steals++;
+                p->run(p->ctx, w->id, task);
+                break;
+            }
+        }
+
+        if (i == p->workers)
+            return NULL;
+    }
+}
+
+// starts workers threads running the count tasks. ctx and run are shared
+// by all of them, run must only touch what its task owns
+int bth_pool_start(struct bth_pool *p, unsigned workers, size_t count,
+                   bth_pool_fn run, void *ctx)
+{
+    if (!workers || count > UINT32_MAX)
+        return 0;
+
+    memset(p, 0, sizeof(*p));
+    p->run = run;
+    p->ctx = ctx;
+    p->workers = workers;
+    p->shares = BTH_POOL_ALLOC(workers * sizeof(*p->shares));
+    p->threads = BTH_POOL_ALLOC(workers * sizeof(*p->threads));
+
+    if (!p->shares || !p->threads)
+    {
+        BTH_POOL_FREE(p->shares);
+        BTH_POOL_FREE(p->threads);
+        return 0;
+    }
+
+    memset(p->shares, 0, workers * sizeof(*p->shares));
+
+    for (unsigned i = 0; i < workers; i++)
+        p->shares[i].range = BTH_POOL_RANGE(count * i / workers,
+                                            count * (i + 1) / workers);
+
+    for (; p->started < workers; p->started++)
+    {
+        struct bth_pool_worker *w = p->threads + p->started;
+
+        *w = (struct bth_pool_worker){.pool = p, .id = p->started};
+
+        if (pthread_create(&w->thread, NULL, bth_pool_work, w))
+            break;
+    }
+
+    if (!p->started)
+    {
+        BTH_POOL_FREE(p->shares);
+        BTH_POOL_FREE(p->threads);
+        return 0;
+    }
+
+    return 1;
+}
+
+// waits for every task to be run, returns how many were stolen
+size_t bth_pool_join(struct bth_pool *p)
+{
+    size_t steals = 0;
+
+    for (unsigned i = 0; i < p->started; i++)
+        pthread_join(p->threads[i].thread, NULL);
+
+    for (unsigned i = 0; i < p->workers; i++)
+        steals += p->shares[i].steals;
+
+    BTH_POOL_FREE(p->shares);
+    BTH_POOL_FREE(p->threads);
+    p->shares = NULL;
+    p->threads = NULL;
+
+    return steals;
+}
+#endif
+#endif
@@ -0,0 +1,265 @@
+// MIT No Attribution
+//
+// Copyright (c) 2025 bobthehuge
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// Bounded queue of pointers between threads, any number of them on both
+// ends. Every cell carries a sequence number telling whose turn it is, so
+// producers and consumers only race with their own kind on one index each
+// and never take a lock. A full queue makes producers wait, which is what
+// holds back a stage running ahead of the next one.
+
+#ifndef BTH_QUEUE_H
+#define BTH_QUEUE_H
+
+#include <stddef.h>
+
+#ifndef BTH_QUEUE_ALLOC
+#define BTH_QUEUE_ALLOC(n) malloc(n)
+#endif
+
+#ifndef BTH_QUEUE_FREE
+#define BTH_QUEUE_FREE(p) free(p)
+#endif
+
+#define BTH_QUEUE_LINE 64
+
+struct bth_queue_cell
+{
+    size_t seq;
+    void *data;
+};
+
+// the counters tell which side of the queue is waiting on the other: long
+// put waits mean the consumers are the bottleneck, long take waits the
+// producers
+struct bth_queue_stats
+{
+    size_t puts;
+    size_t takes;
+    size_t full;     // puts that found the queue full
+    size_t empty;    // takes that found it empty
+    size_t occupied; // items found queued, summed over the takes
+    unsigned long long put_wait_ns;
+    unsigned long long take_wait_ns;
+};
+
+struct bth_queue
+{
+    struct bth_queue_cell *cells;
+    size_t mask;
+    char pad0[BTH_QUEUE_LINE];
+    size_t head; // next cell to fill
+    char pad1[BTH_QUEUE_LINE];
+    size_t tail; // next cell to empty
+    char pad2[BTH_QUEUE_LINE];
+    unsigned producers; // not done yet, see bth_queue_done
+    struct bth_queue_stats stats;
+};
+
+int bth_queue_init(struct bth_queue *q, size_t cap, unsigned producers);
+void bth_queue_fini(struct bth_queue *q);
+int bth_queue_try_put(struct bth_queue *q, void *data);
+int bth_queue_try_take(struct bth_queue *q, void **data);
+void bth_queue_put(struct bth_queue *q, void *data);
+int bth_queue_take(struct bth_queue *q, void **data);
+void bth_queue_done(struct bth_queue *q);
+void bth_queue_pause(unsigned *spins);
+
+#ifdef BTH_QUEUE_IMPLEMENTATION
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BTH_QUEUE_ADD(p, n) __atomic_fetch_add(p, n, __ATOMIC_RELAXED)
+
+static unsigned long long bth_queue_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// holds cap rounded up to a power of two, producers threads will put to it
+int bth_queue_init(struct bth_queue *q, size_t cap, unsigned producers)
+{
+    size_t n = 2;
+
+    while (n < cap)
+        n *= 2;
+
+    *q = (struct bth_queue){.mask = n - 1, .producers = producers};
+    q->cells = BTH_QUEUE_ALLOC(n * sizeof(*q->cells));
+
+    if (!q->cells)
+        return 0;
+
+    for (size_t i = 0; i < n; i++)
+        q->cells[i].seq = i;
+
+    return 1;
+}
+
+void bth_queue_fini(struct bth_queue *q)
+{
+    BTH_QUEUE_FREE(q->cells);
+    q->cells = NULL;
+}
+
+// a cell is free to fill at head when its seq is head, and full to empty at
+// tail when it is tail + 1
+int bth_queue_try_put(struct bth_queue *q, void *data)
+{
+    size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+    for (;;)
+    {
+        struct bth_queue_cell *c = q->cells + (pos & q->mask);
+        size_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+        long diff = (long)(seq - pos);
+
+        if (diff < 0)
+            return 0;
+
+        if (!diff && __atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                                                 __ATOMIC_RELAXED,
+                                                 __ATOMIC_RELAXED))
+        {
+            c->data = data;
+            __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+            return 1;
+        }
+
+        if (diff)
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    }
+}
+
+int bth_queue_try_take(struct bth_queue *q, void **data)
+{
+    size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+    for (;;)
+    {
+        struct bth_queue_cell *c = q->cells + (pos & q->mask);
+        size_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+        long diff = (long)(seq - (pos + 1));
+
+        if (diff < 0)
+            return 0;
+
+        if (!diff && __atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                                 __ATOMIC_RELAXED,
+                                                 __ATOMIC_RELAXED))
+        {
+            *data = c->data;
+            __atomic_store_n(&c->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+            return 1;
+        }
+
+        if (diff)
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+}
+
+// backs off a waiting thread: spins first, then gives the processor away,
+// then sleeps so that long waits do not eat the time of the busy stages
+void bth_queue_pause(unsigned *spins)
+{
+    unsigned n = (*spins)++;
+
+    if (n < 64)
+        return;
+
+    if (n < 128)
+    {
+        sched_yield();
+        return;
+    }
+
+    struct timespec ts = {0, 50000};
+
+    nanosleep(&ts, NULL);
+}
+
+// puts data, waiting for room
+void bth_queue_put(struct bth_queue *q, void *data)
+{
+    BTH_QUEUE_ADD(&q->stats.puts, 1);
+
+    if (bth_queue_try_put(q, data))
+        return;
+
+    unsigned long long t0 = bth_queue_now();
+    unsigned spins = 0;
+
+    BTH_QUEUE_ADD(&q->stats.full, 1);
+
+    while (!bth_queue_try_put(q, data))
+        bth_queue_pause(&spins);
+
+    BTH_QUEUE_ADD(&q->stats.put_wait_ns, bth_queue_now() - t0);
+}
+
+// takes the oldest item, waiting for one. Returns 0 once every producer is
+// done and the queue is drained
+int bth_queue_take(struct bth_queue *q, void **data)
+{
+    size_t head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+    if (bth_queue_try_take(q, data))
+    {
+        BTH_QUEUE_ADD(&q->stats.takes, 1);
+        BTH_QUEUE_ADD(&q->stats.occupied, head > tail ? head - tail : 0);
+        return 1;
+    }
+
+    unsigned long long t0 = bth_queue_now();
+    unsigned spins = 0;
+    int got;
+
+    BTH_QUEUE_ADD(&q->stats.empty, 1);
+
+    for (;;)
+    {
+        // producers finish their puts before saying they are done
+        int open = __atomic_load_n(&q->producers, __ATOMIC_ACQUIRE) > 0;
+
+        if ((got = bth_queue_try_take(q, data)) || !open)
+            break;
+
+        bth_queue_pause(&spins);
+    }
+
+    if (got)
+        BTH_QUEUE_ADD(&q->stats.takes, 1);
+
+    BTH_QUEUE_ADD(&q->stats.take_wait_ns, bth_queue_now() - t0);
+    return got;
+}
+
+// called once by each producer after its last put
+void bth_queue_done(struct bth_queue *q)
+{
+    __atomic_fetch_sub(&q->producers, 1, __ATOMIC_RELEASE);
+}
+
+#undef BTH_QUEUE_ADD
+#endif
+#endif
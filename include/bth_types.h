@@ -23,6 +23,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/types.h>
 
 typedef uint8_t  u8;
@@ -47,10 +48,42 @@ typedef void       *Any;
 typedef char       *str;
 typedef ptrdiff_t   udiff;
 
+// a view of len bytes at data, which it does not own: slicing, comparing
+// and printing one never copies nor scans for a terminator
 typedef struct
 {
-    usize    len;
-    char    *data;
+    usize       len;
+    const char *data;
 } String;
 
+// printf("%" STR_FMT, STR_ARG(s))
+#define STR_FMT ".*s"
+#define STR_ARG(s) (int)(s).len, (s).data
+
+static inline String str_view(const char *data, usize len)
+{
+    return (String){.len = len, .data = data};
+}
+
+static inline String str_slice(const char *begin, const char *end)
+{
+    return (String){.len = (usize)(end - begin), .data = begin};
+}
+
+static inline bool str_eq(String a, String b)
+{
+    return a.len == b.len && (!a.len || !memcmp(a.data, b.data, a.len));
+}
+
+// FNV-1a
+static inline u64 str_hash(String s)
+{
+    u64 h = 14695981039346656037ULL;
+
+    for (usize i = 0; i < s.len; i++)
+        h = (h ^ (u8)s.data[i]) * 1099511628211ULL;
+
+    return h;
+}
+
 #endif
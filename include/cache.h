@@ -0,0 +1,51 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bth_lex.h"
+
+// bytes the entries of a cache take at most by default
+#define TOKEN_CACHE_LIMIT ((size_t)512 << 20)
+
+// bumped whenever the entries change or the lexer may give other tokens
+// for the same tables
+#define TOKEN_CACHE_VERSION 2
+
+struct token_cache_stats
+{
+    size_t hits;
+    size_t misses;
+    size_t stored;
+    size_t stored_bytes;
+    size_t evicted;
+    size_t evicted_bytes;
+};
+
+// tokens of past runs in a directory, a file each named after the hash of
+// the input they were lexed from. Any thread may load and save entries
+struct token_cache
+{
+    char *dir;
+    size_t limit; // bytes of entries kept, the least recently used go first
+    uint64_t seed; // hash of the tables and settings tokens depend on
+    struct token_cache_stats stats;
+};
+
+int token_cache_open(struct token_cache *c, const char *dir, size_t limit,
+                     const struct bth_lexer *lexer);
+void token_cache_close(struct token_cache *c);
+uint64_t token_cache_key(const struct token_cache *c, const char *buffer,
+                         size_t size);
+int token_cache_load(struct token_cache *c, uint64_t key,
+                     const struct bth_lexer *lexer,
+                     const struct bth_allocator *alloc,
+                     struct bth_lex_store *s);
+void token_cache_save(struct token_cache *c, uint64_t key, size_t size,
+                      const struct bth_lex_store *s);
+int token_cache_lex(struct token_cache *c, struct bth_lexer *lexer,
+                    bth_lex_fn next, const struct bth_allocator *alloc,
+                    struct bth_lex_store *s);
+
+#endif
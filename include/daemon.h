@@ -0,0 +1,20 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "files.h"
+
+// longest request a daemon reads, in bytes
+#define DAEMON_REQUEST_MAX ((size_t)64 << 20)
+
+// seconds a connection may keep a worker waiting for its request
+#define DAEMON_TIMEOUT 10
+
+int daemon_serve(const char *path, struct file_set *files, unsigned jobs,
+                 bool timed);
+void daemon_request(const char *path, const char *const *args, size_t n,
+                    bool timed);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef DRIVER_H
+#define DRIVER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "bth_lex.h"
+#include "cache.h"
+#include "dump.h"
+#include "memory.h"
+
+// bytes a single file needs per worker to be split, see lex_chunked
+#ifndef LEX_CHUNK
+#define LEX_CHUNK (1 << 20)
+#endif
+
+// how the options tell to lex, the same for every driver
+struct driver_options
+{
+    bth_lex_fn next;
+    bool skip;      // fold trivia into the next significant token
+    bool timed;     // report the throughput on stderr
+    bool populate;  // prefault the mapped input
+    bool pipelined; // many files go through lex_pipeline
+    int flags;      // of bth_aio_init, for lex_files
+    unsigned jobs;
+    unsigned depth; // files read ahead, 0 for the default
+    const char *cache_dir; // NULL for no token cache
+    size_t cache_limit;
+    struct memory *mem;
+    struct dump *out; // NULL to only lex
+};
+
+struct bth_lexer driver_lexer(const struct driver_options *o);
+struct token_cache *driver_cache_open(const struct driver_options *o,
+                                      struct token_cache *c,
+                                      const struct bth_lexer *lexer);
+void driver_cache_close(const struct driver_options *o,
+                        struct token_cache *c);
+void driver_lex(const struct driver_options *o, const char *const *args,
+                size_t n);
+void driver_serve(const struct driver_options *o, const char *path);
+void driver_watch(const struct driver_options *o, const char *const *dirs,
+                  size_t n);
+void driver_request(const char *path, const char *dump_name,
+                    const char *query, const char *const *args, size_t n,
+                    bool timed);
+
+#endif
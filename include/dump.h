@@ -0,0 +1,42 @@
+#ifndef DUMP_H
+#define DUMP_H
+
+#include <stddef.h>
+
+#include "bth_lex.h"
+#include "bth_types.h"
+
+// bytes gathered before each write to the output
+#define DUMP_BUFFER (1 << 20)
+
+enum dump_format
+{
+    DUMP_TEXT,   // (bth_lex_token){name='TK_...', value='...'} lines
+    DUMP_JSONL,  // one JSON object a token
+    DUMP_BINARY, // packed little-endian records, see dump_begin
+};
+
+struct dump
+{
+    enum dump_format format;
+    int fd;
+    char *buf;
+    size_t len;
+    size_t written; // bytes flushed to fd so far
+    const char *filename; // of the tokens being dumped
+    int lenient; // write errors are kept in error instead of exiting
+    int error;   // errno of the first failed write, the rest is dropped
+};
+
+int dump_format_parse(const char *name, enum dump_format *format);
+int dump_init(struct dump *d, int fd, enum dump_format format);
+void dump_fini(struct dump *d);
+void dump_flush(struct dump *d);
+void dump_flush_at_exit(struct dump *d);
+void dump_begin(struct dump *d, const char *filename);
+void dump_token(struct dump *d, size_t offset, unsigned short id,
+                unsigned char kind, String text, size_t repeat);
+void dump_end(struct dump *d);
+void dump_store(struct dump *d, const struct bth_lex_store *s);
+
+#endif
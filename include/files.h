@@ -0,0 +1,116 @@
+#ifndef FILES_H
+#define FILES_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "bth_arena.h"
+#include "bth_lex.h"
+#include "bth_types.h"
+#include "cache.h"
+
+// bytes of contents, tokens and names a set keeps by default
+#define FILE_SET_LIMIT ((size_t)1 << 30)
+
+// a file kept in memory with its tokens, as of when it was last read
+struct file_entry
+{
+    char *path;
+    struct file_entry *next; // in its bucket
+    size_t refs;             // the set and the users, under the set lock
+    size_t used;             // when last got, under the set lock
+    size_t bytes;            // counted towards the limit of the set
+
+    // read-locked while used, write-locked while brought up to date
+    pthread_rwlock_t lock;
+    int loaded;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    uint64_t hash; // of the content, a key of the token cache if any
+    char *data;    // the content, BTH_IO_PADDING zero bytes after it
+    size_t cap;
+    struct bth_lexer lexer; // over data, indexing its lines for positions
+    struct bth_lex_store tokens;
+    uint32_t *names; // interned name of each identifier stored, 0 for the
+                     // other tokens. Only made once asked for
+};
+
+struct file_set_stats
+{
+    size_t hits;     // still as read
+    size_t touched;  // changed on disk, the same content
+    size_t relexed;  // changed, lexed again around the difference
+    size_t lexed;    // read and lexed or loaded from the cache
+    size_t evicted;
+    size_t names;    // interned
+};
+
+// files kept warm for many requests, from any thread: an entry is read and
+// lexed again once its size or modification time changed, unless its
+// content turns out the same
+struct file_set
+{
+    const struct bth_lexer *lexer; // the tables, forked for each entry
+    bth_lex_fn next;
+    struct token_cache *cache; // may be NULL
+    uint64_t seed;
+    size_t limit;
+
+    pthread_mutex_t lock; // of the table, the clock and the stats
+    struct file_entry **buckets;
+    size_t count;
+    size_t cap;
+    size_t clock;
+    size_t bytes;
+    struct file_set_stats stats;
+
+    // the identifiers of the files their names were asked of, the text in
+    // arena, the ids starting at 1
+    pthread_mutex_t names_lock;
+    struct bth_arena arena;
+    String *names;
+    size_t names_count;
+    size_t names_cap;
+    uint32_t *slots; // open addressing by str_hash, 0 for empty
+    size_t slots_cap;
+};
+
+int file_set_init(struct file_set *s, const struct bth_lexer *lexer,
+                  bth_lex_fn next, struct token_cache *cache, size_t limit);
+void file_set_fini(struct file_set *s);
+struct file_entry *file_set_get(struct file_set *s, const char *path,
+                                int names, char *error, size_t n);
+void file_set_put(struct file_set *s, struct file_entry *e);
+int file_set_drop(struct file_set *s, const char *path);
+uint32_t file_set_name(struct file_set *s, String name);
+
+// paths of input files, each a copy owned by the list
+struct file_list
+{
+    char **v;
+    size_t count;
+    size_t cap;
+};
+
+// called on each directory file_list_dir enters, before it is listed.
+// Returns 0 to skip it
+typedef int (*file_dir_fn)(void *ctx, const char *dir);
+
+void file_list_add(struct file_list *l, const char *path);
+void file_list_clear(struct file_list *l);
+void file_list_free(struct file_list *l);
+int file_list_dir(struct file_list *l, const char *dir, file_dir_fn enter,
+                  void *ctx);
+void file_list_arg(struct file_list *l, const char *arg);
+int file_is_source(const char *name);
+char *file_join(const char *dir, const char *name);
+
+// seconds from t0 to t1
+double elapsed(const struct timespec *t0, const struct timespec *t1);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stddef.h>
+
+#include "bth_alloc.h"
+#include "bth_arena.h"
+
+// where the tokens of a file are allocated, see -a
+enum alloc_mode
+{
+    ALLOC_ARENA, // a bump arena per file, its blocks from the worker
+    ALLOC_HEAP,  // straight from the base allocator
+    ALLOC_CACHE, // from the free lists of the lexing thread
+};
+
+struct memory
+{
+    enum alloc_mode mode;
+    struct bth_allocator base; // the heap, counted with -m
+    struct bth_alloc_counter counter;
+    size_t tokens; // stored so far, counted by the dumping thread
+};
+
+// what a worker allocates from. A cache belongs to the thread that made
+// it, so every worker sets its own up on its first file
+struct worker_memory
+{
+    struct bth_alloc_cache cache;
+    struct bth_allocator alloc;
+};
+
+int alloc_mode_parse(const char *name, enum alloc_mode *mode);
+const struct bth_allocator *worker_alloc(const struct memory *mem,
+                                         struct worker_memory *w);
+void worker_memory_fini(const struct memory *mem, struct worker_memory *w);
+struct bth_allocator tokens_alloc(const struct memory *mem,
+                                  const struct bth_allocator *a,
+                                  struct bth_arena *arena);
+void report_memory(const struct memory *mem);
+
+#endif
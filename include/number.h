@@ -0,0 +1,20 @@
+#ifndef NUMBER_H
+#define NUMBER_H
+
+#include <stddef.h>
+#include "bth_lex.h"
+#include "ast.h"
+
+// flags of NUMBER tokens, above the ones the lexer uses
+#define NUM_OCTAL     (BTH_LEX_USER_FLAGS << 0)
+#define NUM_HEX       (BTH_LEX_USER_FLAGS << 1)
+#define NUM_UNSIGNED  (BTH_LEX_USER_FLAGS << 2) // u suffix
+#define NUM_LONG      (BTH_LEX_USER_FLAGS << 3) // l suffix, long double
+#define NUM_LONG_LONG (BTH_LEX_USER_FLAGS << 4) // ll suffix
+#define NUM_OVERFLOW  (BTH_LEX_USER_FLAGS << 5) // too large for any type
+
+size_t number_lex(const char *s, const char *end, struct bth_lex_token *t);
+void token_value(struct bth_lexer *lex, const struct bth_lex_token *t,
+                 Value *v);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stddef.h>
+
+#include "bth_lex.h"
+#include "cache.h"
+#include "driver.h"
+
+void lex_pipeline(const struct driver_options *o, struct bth_lexer *lexer,
+                  const char *const *paths, size_t count, unsigned jobs,
+                  struct token_cache *cache);
+
+#endif
@@ -3,6 +3,8 @@
 
 #include <stddef.h>
 
+#include "bth_arena.h"
+
 typedef enum {
     // Keywords
     TK_AUTO,
@@ -117,16 +119,69 @@ typedef enum {
     TK_COMMENT,
     TK_CPP_COMMENT,
     TK_NEWLINE,
+    TK_SPACE,
+    TK_ANTISLASH,
     TK_EOF,
     TK_UNKNOWN
 } TokenKind;
 
-extern const char *KEYWORD_TABLE[];
+extern const struct bth_lex_entry KEYWORD_TABLE[];
 extern const size_t KEYWORD_COUNT;
-extern const char *DELIM_TABLE[];
+extern const struct bth_lex_entry DELIM_TABLE[];
 extern const size_t DELIM_COUNT;
 
+
+const char *token_kind2str(size_t kind);
+int keyword_lookup(const char *s, size_t len, unsigned short *kind);
+int token_is_trivia(const struct bth_lex_token *t);
+struct bth_lexer token_lexer(const char *buffer, size_t size);
 int check_prefix_collisions(size_t *h, size_t *s);
-struct bth_lex_token *collect_tokens(struct bth_lexer *lexer);
+int check_keywords(const char **word);
+uint64_t keyword_hash(uint64_t h,
+                      uint64_t (*hash)(const void *data, size_t len,
+                                       uint64_t seed));
+int lex_tokens(struct bth_lexer *lexer, bth_lex_fn next,
+               const struct bth_allocator *alloc, struct bth_lex_store *toks);
+struct bth_lex_store collect_tokens(struct bth_lexer *lexer, bth_lex_fn next,
+                                   const struct bth_allocator *alloc);
+void report_invalid(struct bth_lexer *lexer, size_t off);
+
+// a piece of a buffer lexed on its own by collect_chunk, betting that it
+// does not start inside a comment, a literal or folded trivia.
+// stitch_chunks checks the bet against the chunk before
+struct token_chunk
+{
+    size_t begin;
+    size_t end;
+    struct bth_arena arena; // owns tokens and starts, may get an alloc
+    struct bth_lex_store tokens;
+    uint32_t *starts; // offset each stored token was lexed from, ascending
+    size_t exit;      // offset lexing stopped at
+    int invalid;      // stopped on an INVALID token lexed from exit
+    int ended;        // the last token is LK_END
+};
+
+size_t split_chunks(const char *buffer, size_t size, size_t target,
+                    struct token_chunk *chunks, size_t n);
+void collect_chunk(struct bth_lexer *lexer, bth_lex_fn next,
+                   struct token_chunk *c);
+struct bth_lex_store stitch_chunks(struct bth_lexer *lexer, bth_lex_fn next,
+                                   struct token_chunk *chunks, size_t n,
+                                   const struct bth_allocator *alloc);
+
+// bytes begin to end of a buffer replaced by len others
+struct token_edit
+{
+    size_t begin;
+    size_t end;
+    size_t len;
+};
+
+int relex_tokens(struct bth_lexer *lexer, bth_lex_fn next,
+                 struct bth_lex_store *toks, const struct token_edit *e,
+                 size_t *lexed);
+
+// generated by tools/lexgen from the tables above
+struct bth_lex_token lex_gen_get_token(struct bth_lexer *lexer);
 
 #endif
@@ -1,9 +0,0 @@
-#ifndef UTILS_H
-#define UTILS_H
-
-#include <stdlib.h>
-
-char *strndup(const char *str, size_t n);
-char *stresc(const char *str);
-
-#endif
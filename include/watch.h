@@ -0,0 +1,19 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "dump.h"
+#include "files.h"
+
+// milliseconds without events that end a burst of them
+#define WATCH_QUIET 10
+
+// milliseconds a burst that goes on is held at most before being lexed
+#define WATCH_HOLD 200
+
+void watch_files(const char *const *dirs, size_t n, struct file_set *files,
+                 unsigned jobs, struct dump *out, bool timed);
+
+#endif
@@ -0,0 +1,435 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BTH_HASH_IMPLEMENTATION
+#include "../include/bth_hash.h"
+
+#include "../include/bth_lex.h"
+#include "../include/cache.h"
+#include "../include/token.h"
+
+// an entry is a header of little-endian fields, then a record a token:
+// its kind byte, and as varints its id, the gap since the end of the
+// previous token and its length. The repeats follow as varints, the gap
+// since the previous repeated token, the count and how far past the token
+// its last occurrence ends
+#define CACHE_MAGIC "CBTC"
+#define CACHE_HEADER 48
+#define CACHE_SUFFIX ".tok"
+
+#define CACHE_ADD(p, n) __atomic_fetch_add(p, n, __ATOMIC_RELAXED)
+
+static uint64_t cache_seed_entries(uint64_t h, const struct bth_lex_entry *e,
+                                   size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        h = bth_xxh64(&e[i].id, sizeof(e[i].id), h);
+        h = bth_xxh64(e[i].str, e[i].len, h);
+
+        if (e[i].close)
+            h = bth_xxh64(e[i].close, e[i].close_len, h);
+    }
+
+    return h;
+}
+
+// dir is made if missing. Entries only match lexers built from the same
+// tables and keywords as lexer, with the same trivia folding
+int token_cache_open(struct token_cache *c, const char *dir, size_t limit,
+                     const struct bth_lexer *lexer)
+{
+    unsigned char folded = lexer->trivia != NULL;
+    uint64_t h = TOKEN_CACHE_VERSION;
+
+    if (mkdir(dir, 0777) && errno != EEXIST)
+        return 0;
+
+    h = bth_xxh64(&folded, 1, h);
+    h = bth_xxh64(lexer->ids, sizeof(lexer->ids), h);
+    h = cache_seed_entries(h, lexer->symbols, lexer->symbols_count);
+    h = cache_seed_entries(h, lexer->delims, lexer->delims_count);
+
+    // the words behind lexer->keyword, which are in no table
+    if (lexer->keyword)
+        h = keyword_hash(h, bth_xxh64);
+
+    *c = (struct token_cache){.dir = malloc(strlen(dir) + 1),
+                              .limit = limit, .seed = h};
+
+    if (!c->dir)
+        return 0;
+
+    strcpy(c->dir, dir);
+    return 1;
+}
+
+uint64_t token_cache_key(const struct token_cache *c, const char *buffer,
+                         size_t size)
+{
+    return bth_xxh64(buffer, size, c->seed);
+}
+
+static void cache_path(const struct token_cache *c, uint64_t key, char *path,
+                       size_t n)
+{
+    snprintf(path, n, "%s/%016llx" CACHE_SUFFIX, c->dir,
+             (unsigned long long)key);
+}
+
+static uint64_t get_le(const unsigned char *p, size_t n)
+{
+    uint64_t v = 0;
+
+    while (n--)
+        v = (v << 8) | p[n];
+
+    return v;
+}
+
+static unsigned char *put_le(unsigned char *p, uint64_t v, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+
+    return p + n;
+}
+
+static unsigned char *put_varint(unsigned char *p, uint64_t v)
+{
+    for (; v >= 0x80; v >>= 7)
+        *p++ = (unsigned char)(v | 0x80);
+
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+// 0 past end or on a varint too long for 64 bits
+static int get_varint(const unsigned char **p, const unsigned char *end,
+                      uint64_t *v)
+{
+    *v = 0;
+
+    for (int shift = 0; *p < end && shift < 64; shift += 7)
+    {
+        unsigned char b = *(*p)++;
+
+        *v |= (uint64_t)(b & 0x7f) << shift;
+
+        if (!(b & 0x80))
+            return 1;
+    }
+
+    return 0;
+}
+
+// fills s, initialized for the buffer of size bytes, from the entry data.
+// Anything out of place makes the entry a miss
+static int cache_decode(const unsigned char *data, size_t len, uint64_t key,
+                        size_t size, struct bth_lex_store *s)
+{
+    const unsigned char *end = data + len;
+
+    if (len < CACHE_HEADER || memcmp(data, CACHE_MAGIC, 4)
+        || get_le(data + 4, 4) != TOKEN_CACHE_VERSION
+        || get_le(data + 8, 8) != key || get_le(data + 16, 8) != size)
+        return 0;
+
+    uint64_t count = get_le(data + 24, 8);
+    uint64_t repeats = get_le(data + 32, 8);
+    const unsigned char *p = data + CACHE_HEADER;
+
+    // a record takes a byte at least
+    if (count > len || repeats > len
+        || get_le(data + 40, 8) != len - CACHE_HEADER
+        || !bth_lex_store_reserve(s, count)
+        || !bth_lex_store_reserve_repeats(s, repeats))
+        return 0;
+
+    uint64_t pos = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t id, gap, n;
+
+        if (p == end)
+            return 0;
+
+        s->kinds[i] = *p++;
+
+        if (!get_varint(&p, end, &id) || !get_varint(&p, end, &gap)
+            || !get_varint(&p, end, &n) || id > 0xffff
+            || gap > size - pos || n > size - pos - gap)
+            return 0;
+
+        s->ids[i] = id;
+        s->offsets[i] = pos + gap;
+        s->lens[i] = n;
+        pos += gap + n;
+    }
+
+    uint64_t idx = 0;
+
+    // strictly after the previous repeated token, each counting one more
+    // occurrence at least
+    for (size_t i = 0; i < repeats; i++)
+    {
+        uint64_t gap, n, past;
+
+        if (!get_varint(&p, end, &gap) || !get_varint(&p, end, &n)
+            || !get_varint(&p, end, &past) || gap >= count - idx
+            || (i && !gap) || !n || n > UINT32_MAX)
+            return 0;
+
+        idx += gap;
+
+        uint64_t last = (uint64_t)s->offsets[idx] + s->lens[idx];
+
+        if (past > size - last)
+            return 0;
+
+        s->repeats[i] = (struct bth_lex_repeat){idx, n, last + past};
+    }
+
+    s->count = count;
+    s->repeats_count = repeats;
+    return p == end;
+}
+
+// returns 1 and the tokens of the buffer of lexer in s if key has them, s
+// then taking its arrays from alloc like collect_tokens
+int token_cache_load(struct token_cache *c, uint64_t key,
+                     const struct bth_lexer *lexer,
+                     const struct bth_allocator *alloc,
+                     struct bth_lex_store *s)
+{
+    char path[4096];
+    struct stat st;
+    int ok = 0;
+
+    cache_path(c, key, path, sizeof(path));
+
+    int fd = open(path, O_RDONLY);
+
+    if (fd >= 0 && !fstat(fd, &st) && st.st_size > 0)
+    {
+        void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (m != MAP_FAILED)
+        {
+            bth_lex_store_init(s, lexer, alloc);
+            ok = cache_decode(m, st.st_size, key, lexer->size, s);
+
+            if (!ok)
+                bth_lex_store_fini(s);
+
+            munmap(m, st.st_size);
+        }
+    }
+
+    if (fd >= 0)
+        close(fd);
+
+    // a hit is a use, eviction goes by modification time
+    if (ok)
+        utimensat(AT_FDCWD, path, NULL, 0);
+
+    CACHE_ADD(ok ? &c->stats.hits : &c->stats.misses, 1);
+    return ok;
+}
+
+// stores s, the tokens of a buffer of size bytes, under key. The entry is
+// written aside and renamed over, so concurrent runs only see whole entries
+void token_cache_save(struct token_cache *c, uint64_t key, size_t size,
+                      const struct bth_lex_store *s)
+{
+    // a varint of 32 bits takes 5 bytes at most, one of 16 bits 3
+    size_t cap = CACHE_HEADER + s->count * (1 + 3 + 5 + 5)
+        + s->repeats_count * (5 + 5 + 5);
+    unsigned char *data = malloc(cap);
+    char tmp[4096];
+    char path[4096];
+
+    if (!data)
+        return;
+
+    unsigned char *p = data + CACHE_HEADER;
+    uint64_t pos = 0;
+    uint64_t idx = 0;
+
+    for (size_t i = 0; i < s->count; i++)
+    {
+        *p++ = s->kinds[i];
+        p = put_varint(p, s->ids[i]);
+        p = put_varint(p, s->offsets[i] - pos);
+        p = put_varint(p, s->lens[i]);
+        pos = (uint64_t)s->offsets[i] + s->lens[i];
+    }
+
+    for (size_t i = 0; i < s->repeats_count; i++)
+    {
+        p = put_varint(p, s->repeats[i].idx - idx);
+        p = put_varint(p, s->repeats[i].count);
+        idx = s->repeats[i].idx;
+        p = put_varint(p, s->repeats[i].end - s->offsets[idx]
+                              - s->lens[idx]);
+    }
+
+    size_t len = p - data;
+
+    memcpy(data, CACHE_MAGIC, 4);
+    put_le(data + 4, TOKEN_CACHE_VERSION, 4);
+    put_le(data + 8, key, 8);
+    put_le(data + 16, size, 8);
+    put_le(data + 24, s->count, 8);
+    put_le(data + 32, s->repeats_count, 8);
+    put_le(data + 40, len - CACHE_HEADER, 8);
+
+    snprintf(tmp, sizeof(tmp), "%s/.tmp.XXXXXX", c->dir);
+    cache_path(c, key, path, sizeof(path));
+
+    int fd = mkstemp(tmp);
+
+    if (fd >= 0)
+    {
+        size_t done = 0;
+        ssize_t w = 0;
+
+        while (done < len && (w = write(fd, data + done, len - done)) > 0)
+            done += w;
+
+        if (!close(fd) && done == len && !rename(tmp, path))
+        {
+            CACHE_ADD(&c->stats.stored, 1);
+            CACHE_ADD(&c->stats.stored_bytes, len);
+        }
+        else
+            unlink(tmp);
+    }
+
+    free(data);
+}
+
+struct cache_entry
+{
+    char *name;
+    size_t size;
+    struct timespec used;
+};
+
+static int cache_entry_older(const void *a, const void *b)
+{
+    const struct cache_entry *x = a;
+    const struct cache_entry *y = b;
+
+    if (x->used.tv_sec != y->used.tv_sec)
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+
+    return (x->used.tv_nsec > y->used.tv_nsec)
+        - (x->used.tv_nsec < y->used.tv_nsec);
+}
+
+static int cache_is_entry(const struct dirent *d)
+{
+    size_t n = strlen(d->d_name);
+    size_t s = sizeof(CACHE_SUFFIX) - 1;
+
+    return n > s && d->d_name[0] != '.'
+        && !strcmp(d->d_name + n - s, CACHE_SUFFIX);
+}
+
+// removes the least recently used entries until the rest fit the limit
+static void cache_evict(struct token_cache *c)
+{
+    struct dirent **names;
+    int n = scandir(c->dir, &names, cache_is_entry, NULL);
+
+    if (n < 0)
+        return;
+
+    struct cache_entry *entries = malloc((n + 1) * sizeof(*entries));
+    size_t count = 0;
+    size_t total = 0;
+    char path[4096];
+
+    for (int i = 0; i < n; i++)
+    {
+        struct stat st;
+
+        snprintf(path, sizeof(path), "%s/%s", c->dir, names[i]->d_name);
+
+        if (entries && !stat(path, &st))
+        {
+            entries[count++] = (struct cache_entry){
+                .name = names[i]->d_name,
+                .size = st.st_size,
+                .used = st.st_mtim,
+            };
+            total += st.st_size;
+        }
+    }
+
+    if (entries && total > c->limit)
+    {
+        qsort(entries, count, sizeof(*entries), cache_entry_older);
+
+        for (size_t i = 0; i < count && total > c->limit; i++)
+        {
+            snprintf(path, sizeof(path), "%s/%s", c->dir, entries[i].name);
+
+            if (!unlink(path))
+            {
+                total -= entries[i].size;
+                c->stats.evicted++;
+                c->stats.evicted_bytes += entries[i].size;
+            }
+        }
+    }
+
+    for (int i = 0; i < n; i++)
+        free(names[i]);
+
+    free(names);
+    free(entries);
+}
+
+// the tokens of the buffer of lexer in s, out of c if it has them. Else
+// they are lexed and stored there for the next runs, c being NULL for no
+// cache. Returns 0 on an INVALID token like lex_tokens, for the workers to
+// leave reporting it to the thread that dumps
+int token_cache_lex(struct token_cache *c, struct bth_lexer *lexer,
+                    bth_lex_fn next, const struct bth_allocator *alloc,
+                    struct bth_lex_store *s)
+{
+    uint64_t key = c ? token_cache_key(c, lexer->buffer, lexer->size) : 0;
+
+    if (c && token_cache_load(c, key, lexer, alloc, s))
+        return 1;
+
+    if (!lex_tokens(lexer, next, alloc, s))
+        return 0;
+
+    if (c)
+        token_cache_save(c, key, lexer->size, s);
+
+    return 1;
+}
+
+// once no thread uses c anymore
+void token_cache_close(struct token_cache *c)
+{
+    cache_evict(c);
+    free(c->dir);
+    c->dir = NULL;
+}
+
+#undef CACHE_ADD
@@ -0,0 +1,626 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // SCM_RIGHTS and the CMSG macros
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/bth_lex.h"
+#include "../include/bth_types.h"
+#include "../include/daemon.h"
+#include "../include/dump.h"
+#include "../include/files.h"
+
+// a request is a little-endian u32 length then as many bytes of NUL
+// terminated strings: the working directory of the client, a command and
+// its arguments. The standard output of the client comes along as
+// ancillary data and gets the output of the request, which the daemon
+// then answers on the socket with a line: "ok FILES TOKENS NS" or
+// "error MESSAGE". The commands are
+//
+//   lex FILE...          keeps the files warm
+//   dump FORMAT FILE...  dumps their tokens like -d
+//   query NAME FILE...   FILE:ROW:COL of every use of the identifier NAME
+//   stats                what the daemon keeps and how it went
+
+#define DAEMON_ERROR 4096
+
+struct daemon
+{
+    int fd;
+    struct file_set *files;
+    size_t requests;
+    size_t failed;
+};
+
+struct request
+{
+    const char *cwd;
+    const char *cmd;
+    const char **args;
+    size_t count;
+    int out;
+
+    size_t files;
+    size_t tokens;
+    char error[DAEMON_ERROR];
+};
+
+static int read_full(int fd, char *p, size_t n)
+{
+    while (n)
+    {
+        ssize_t r = read(fd, p, n);
+
+        if (r < 0 && errno == EINTR)
+            continue;
+
+        if (r <= 0)
+            return 0;
+
+        p += r;
+        n -= r;
+    }
+
+    return 1;
+}
+
+static int write_full(int fd, const char *p, size_t n)
+{
+    while (n)
+    {
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+
+        if (w < 0 && errno == EINTR)
+            continue;
+
+        if (w < 0)
+            return 0;
+
+        p += w;
+        n -= w;
+    }
+
+    return 1;
+}
+
+// reads the request on c, its strings then pointing into *buf. Returns -1
+// if c closed before sending anything, as when probed by another daemon
+static int request_read(int c, struct request *r, char **buf)
+{
+    unsigned char head[4];
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {head, sizeof(head)};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    ssize_t got;
+
+    while ((got = recvmsg(c, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC)) < 0
+           && errno == EINTR)
+        ;
+
+    struct cmsghdr *cm = got > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+
+    if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+        memcpy(&r->out, CMSG_DATA(cm), sizeof(int));
+
+    if (!got)
+        return -1;
+
+    if (got != sizeof(head) || r->out < 0)
+        return 0;
+
+    size_t n = (size_t)head[0] | (size_t)head[1] << 8
+        | (size_t)head[2] << 16 | (size_t)head[3] << 24;
+
+    if (n > DAEMON_REQUEST_MAX || !(*buf = malloc(n + 1))
+        || !read_full(c, *buf, n))
+        return 0;
+
+    (*buf)[n] = '\0';
+
+    size_t strings = 0;
+
+    for (size_t i = 0; i < n; i++)
+        strings += !(*buf)[i];
+
+    if (strings < 2 || (n && (*buf)[n - 1])
+        || !(r->args = malloc(strings * sizeof(*r->args))))
+        return 0;
+
+    for (char *p = *buf; p < *buf + n; p += strlen(p) + 1)
+        r->args[r->count++] = p;
+
+    r->cwd = r->args[0];
+    r->cmd = r->args[1];
+    r->args += 2;
+    r->count -= 2;
+    return 1;
+}
+
+// path as the client meant it, from its working directory
+static const char *request_path(const struct request *r, const char *path,
+                                char *buf, size_t n)
+{
+    if (*path == '/')
+        return path;
+
+    snprintf(buf, n, "%s/%s", r->cwd, path);
+    return buf;
+}
+
+static int serve_lex(struct daemon *d, struct request *r)
+{
+    char buf[4096];
+
+    for (size_t i = 0; i < r->count; i++)
+    {
+        const char *path = request_path(r, r->args[i], buf, sizeof(buf));
+        struct file_entry *e = file_set_get(d->files, path, 0, r->error,
+                                            sizeof(r->error));
+
+        if (!e)
+            return 0;
+
+        r->files++;
+        r->tokens += e->tokens.count;
+        file_set_put(d->files, e);
+    }
+
+    return 1;
+}
+
+static int serve_dump(struct daemon *d, struct request *r)
+{
+    char buf[4096];
+    enum dump_format format;
+    struct dump out;
+    int ok = 1;
+
+    if (!r->count || !dump_format_parse(r->args[0], &format))
+    {
+        snprintf(r->error, sizeof(r->error), "unknown dump format");
+        return 0;
+    }
+
+    if (!dump_init(&out, r->out, format))
+    {
+        snprintf(r->error, sizeof(r->error), "%s", strerror(ENOMEM));
+        return 0;
+    }
+
+    out.lenient = 1;
+
+    for (size_t i = 1; ok && i < r->count && !out.error; i++)
+    {
+        const char *path = request_path(r, r->args[i], buf, sizeof(buf));
+        struct file_entry *e = file_set_get(d->files, path, 0, r->error,
+                                            sizeof(r->error));
+
+        if (!(ok = e != NULL))
+            break;
+
+        // named as the client gave it
+        struct bth_lex_store view = e->tokens;
+
+        view.filename = r->args[i];
+        dump_store(&out, &view);
+        r->files++;
+        r->tokens += e->tokens.count;
+        file_set_put(d->files, e);
+    }
+
+    dump_fini(&out);
+
+    if (ok && out.error)
+    {
+        snprintf(r->error, sizeof(r->error), "Could not write the tokens: "
+                 "%s", strerror(out.error));
+        ok = 0;
+    }
+
+    return ok;
+}
+
+static FILE *request_output(struct request *r)
+{
+    int fd = dup(r->out);
+    FILE *f = fd < 0 ? NULL : fdopen(fd, "w");
+
+    if (!f)
+    {
+        snprintf(r->error, sizeof(r->error), "%s", strerror(errno));
+
+        if (fd >= 0)
+            close(fd);
+    }
+
+    return f;
+}
+
+static int request_output_close(struct request *r, FILE *f, int ok)
+{
+    int bad = ferror(f);
+
+    if (fclose(f) || bad)
+    {
+        if (ok)
+            snprintf(r->error, sizeof(r->error), "Could not write the "
+                     "answer: %s", strerror(errno));
+        return 0;
+    }
+
+    return ok;
+}
+
+static int serve_query(struct daemon *d, struct request *r)
+{
+    char buf[4096];
+    FILE *f;
+    int ok = 1;
+
+    if (!r->count)
+    {
+        snprintf(r->error, sizeof(r->error), "no name to look for");
+        return 0;
+    }
+
+    if (!(f = request_output(r)))
+        return 0;
+
+    String name = str_view(r->args[0], strlen(r->args[0]));
+
+    for (size_t i = 1; ok && i < r->count; i++)
+    {
+        const char *path = request_path(r, r->args[i], buf, sizeof(buf));
+        struct file_entry *e = file_set_get(d->files, path, 1, r->error,
+                                            sizeof(r->error));
+
+        if (!(ok = e != NULL))
+            break;
+
+        // interned with the file if it has it
+        uint32_t id = file_set_name(d->files, name);
+        const struct bth_lex_store *t = &e->tokens;
+
+        for (size_t k = 0; id && k < t->count; k++)
+        {
+            size_t row = 0;
+            size_t col = 0;
+
+            if (e->names[k] != id)
+                continue;
+
+            bth_lex_position(&e->lexer, t->offsets[k], &row, &col);
+            fprintf(f, "%s:%zu:%zu\n", r->args[i], row, col);
+            r->tokens++;
+        }
+
+        r->files++;
+        file_set_put(d->files, e);
+    }
+
+    return request_output_close(r, f, ok);
+}
+
+static int serve_stats(struct daemon *d, struct request *r)
+{
+    struct file_set *s = d->files;
+    struct file_set_stats st;
+    FILE *f = request_output(r);
+    size_t files;
+    size_t bytes;
+
+    if (!f)
+        return 0;
+
+    pthread_mutex_lock(&s->lock);
+    st = s->stats;
+    files = s->count;
+    bytes = s->bytes;
+    pthread_mutex_unlock(&s->lock);
+
+    fprintf(f, "files: %zu kept, %zu bytes, %zu names\n"
+            "reads: %zu hits, %zu touched, %zu relexed, %zu lexed, "
+            "%zu evicted\nrequests: %zu, %zu failed\n", files, bytes,
+            st.names, st.hits, st.touched, st.relexed, st.lexed, st.evicted,
+            __atomic_load_n(&d->requests, __ATOMIC_RELAXED),
+            __atomic_load_n(&d->failed, __ATOMIC_RELAXED));
+
+    if (s->cache)
+        fprintf(f, "cache: %zu hits, %zu misses, %zu stored\n",
+                s->cache->stats.hits, s->cache->stats.misses,
+                s->cache->stats.stored);
+
+    return request_output_close(r, f, 1);
+}
+
+static void serve(struct daemon *d, int c)
+{
+    struct request r = {.out = -1};
+    struct timespec t0, t1;
+    char *buf = NULL;
+    char reply[DAEMON_ERROR + 64];
+    int ok;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    if ((ok = request_read(c, &r, &buf)) < 0)
+        return;
+
+    if (!ok)
+    {
+        snprintf(r.error, sizeof(r.error), "bad request");
+        ok = 0;
+    }
+    else if (!strcmp(r.cmd, "lex"))
+        ok = serve_lex(d, &r);
+    else if (!strcmp(r.cmd, "dump"))
+        ok = serve_dump(d, &r);
+    else if (!strcmp(r.cmd, "query"))
+        ok = serve_query(d, &r);
+    else if (!strcmp(r.cmd, "stats"))
+        ok = serve_stats(d, &r);
+    else
+    {
+        snprintf(r.error, sizeof(r.error), "unknown command %s", r.cmd);
+        ok = 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    // done with the output of the client
+    if (r.out >= 0)
+        close(r.out);
+
+    if (ok)
+        snprintf(reply, sizeof(reply), "ok %zu %zu %llu\n", r.files,
+                 r.tokens, (t1.tv_sec - t0.tv_sec) * 1000000000ULL
+                           + t1.tv_nsec - t0.tv_nsec);
+    else
+        snprintf(reply, sizeof(reply), "error %s\n", r.error);
+
+    write_full(c, reply, strlen(reply));
+
+    __atomic_fetch_add(&d->requests, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&d->failed, !ok, __ATOMIC_RELAXED);
+
+    if (r.args)
+        free(r.args - 2);
+    free(buf);
+}
+
+// every worker waits on the socket itself, a request per connection
+static void *daemon_work(void *arg)
+{
+    struct daemon *d = arg;
+
+    for (;;)
+    {
+        int c = accept(d->fd, NULL, NULL);
+
+        if (c < 0 && (errno == EINTR || errno == ECONNABORTED))
+            continue;
+
+        // shut down
+        if (c < 0)
+            return NULL;
+
+        struct timeval tv = {DAEMON_TIMEOUT, 0};
+
+        setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        serve(d, c);
+        close(c);
+    }
+}
+
+static int daemon_listen(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+
+    int ok = !bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+
+    if (!ok && errno == EADDRINUSE)
+    {
+        // left by a daemon gone, unless one still answers on it
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int alive = probe >= 0
+            && !connect(probe, (struct sockaddr *)&addr, sizeof(addr));
+
+        if (probe >= 0)
+            close(probe);
+
+        errno = EADDRINUSE;
+        ok = !alive && !unlink(path)
+            && !bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+
+    if (!ok || listen(fd, SOMAXCONN))
+    {
+        int e = errno;
+
+        close(fd);
+        errno = e;
+        return -1;
+    }
+
+    return fd;
+}
+
+// answers the requests on a socket at path with jobs workers, until
+// SIGINT, SIGTERM or SIGHUP. Returns 0 if it cannot listen
+int daemon_serve(const char *path, struct file_set *files, unsigned jobs,
+                 bool timed)
+{
+    struct daemon d = {.files = files};
+    pthread_t *threads = malloc(jobs * sizeof(*threads));
+    sigset_t stop, old;
+    unsigned started = 0;
+    int sig;
+
+    if (!threads || (d.fd = daemon_listen(path)) < 0)
+    {
+        free(threads);
+        return 0;
+    }
+
+    // the workers only take requests, the signals come here
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    sigaddset(&stop, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &stop, &old);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (started < jobs
+           && !pthread_create(threads + started, NULL, daemon_work, &d))
+        started++;
+
+    if (!started)
+        errx(1, "Could not start the workers");
+
+    sigwait(&stop, &sig);
+
+    // wakes the workers up in accept, the requests in flight go on
+    shutdown(d.fd, SHUT_RDWR);
+
+    for (unsigned i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    close(d.fd);
+    unlink(path);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    free(threads);
+
+    if (timed)
+        fprintf(stderr, "%s: %zu requests, %zu failed, %zu files kept\n",
+                path, d.requests, d.failed, files->count);
+
+    return 1;
+}
+
+// has the daemon at path run args, its output going to the standard
+// output, and exits on its error
+void daemon_request(const char *path, const char *const *args, size_t n,
+                    bool timed)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    char cwd[4096];
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        errx(1, "%s: %s", path, strerror(ENAMETOOLONG));
+
+    strcpy(addr.sun_path, path);
+
+    if (!getcwd(cwd, sizeof(cwd)))
+        err(1, "Could not get the working directory");
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0
+        || connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+        err(1, "%s", path);
+
+    size_t len = strlen(cwd) + 1;
+
+    for (size_t i = 0; i < n; i++)
+        len += strlen(args[i]) + 1;
+
+    if (len > DAEMON_REQUEST_MAX)
+        errx(1, "%s: request too long", path);
+
+    char *buf = malloc(4 + len);
+    char *p = buf + 4;
+
+    if (!buf)
+        errx(1, "Could not allocate the request");
+
+    for (int i = 0; i < 4; i++)
+        buf[i] = (char)(len >> (8 * i));
+
+    p = stpcpy(p, cwd) + 1;
+
+    for (size_t i = 0; i < n; i++)
+        p = stpcpy(p, args[i]) + 1;
+
+    // the standard output rides along the first bytes
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    int out = STDOUT_FILENO;
+    struct iovec iov = {buf, 4 + len};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &out, sizeof(int));
+
+    ssize_t sent;
+
+    while ((sent = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+
+    if (sent < 0 || !write_full(fd, buf + sent, 4 + len - sent))
+        err(1, "%s", path);
+
+    free(buf);
+
+    char reply[DAEMON_ERROR + 64];
+    size_t got = 0;
+    ssize_t r;
+
+    while (got < sizeof(reply) - 1
+           && ((r = read(fd, reply + got, sizeof(reply) - 1 - got)) > 0
+               || (r < 0 && errno == EINTR)))
+        got += r > 0 ? r : 0;
+
+    close(fd);
+    reply[got] = '\0';
+    reply[strcspn(reply, "\n")] = '\0';
+
+    size_t files, tokens;
+    unsigned long long ns;
+
+    if (sscanf(reply, "ok %zu %zu %llu", &files, &tokens, &ns) == 3)
+    {
+        if (timed)
+            fprintf(stderr, "%s: %zu files, %zu tokens in %.3f ms\n", path,
+                    files, tokens, ns / 1e6);
+        return;
+    }
+
+    if (!strncmp(reply, "error ", 6))
+        errx(1, "%s", reply + 6);
+
+    errx(1, "%s: no answer", path);
+}
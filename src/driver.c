@@ -0,0 +1,652 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/bth_aio.h"
+#include "../include/bth_arena.h"
+#include "../include/bth_io.h"
+#include "../include/bth_lex.h"
+#include "../include/bth_pool.h"
+#include "../include/bth_types.h"
+#include "../include/cache.h"
+#include "../include/daemon.h"
+#include "../include/driver.h"
+#include "../include/dump.h"
+#include "../include/files.h"
+#include "../include/memory.h"
+#include "../include/pipeline.h"
+#include "../include/token.h"
+#include "../include/watch.h"
+
+typedef struct bth_lexer Lexer;
+
+// a lexer over nothing yet, with the tables built and trivia folded if the
+// options tell
+Lexer driver_lexer(const struct driver_options *o)
+{
+    Lexer lexer = token_lexer(NULL, 0);
+
+    lexer.trivia = o->skip ? token_is_trivia : NULL;
+    lexer.alloc = o->mem->base;
+
+    if (!bth_lex_init(&lexer))
+        errx(1, "Could not build lexer tables");
+
+    return lexer;
+}
+
+// c opened for lexer, NULL without a cache directory
+struct token_cache *driver_cache_open(const struct driver_options *o,
+                                      struct token_cache *c,
+                                      const Lexer *lexer)
+{
+    if (!o->cache_dir)
+        return NULL;
+
+    if (!token_cache_open(c, o->cache_dir, o->cache_limit, lexer))
+        err(1, "%s", o->cache_dir);
+
+    return c;
+}
+
+static void report_cache(const struct token_cache *cache)
+{
+    const struct token_cache_stats *s = &cache->stats;
+    size_t lookups = s->hits + s->misses;
+
+    fprintf(stderr, "cache: %zu hits, %zu misses, %.1f%% hit rate, "
+            "%zu stored (%zu bytes), %zu evicted (%zu bytes)\n",
+            s->hits, s->misses,
+            lookups ? 100. * s->hits / lookups : 0., s->stored,
+            s->stored_bytes, s->evicted, s->evicted_bytes);
+}
+
+// evicts what is past the limit, then reports the use of c if timed
+void driver_cache_close(const struct driver_options *o, struct token_cache *c)
+{
+    if (!c)
+        return;
+
+    token_cache_close(c);
+
+    if (o->timed)
+        report_cache(c);
+}
+
+// lexes the input as it comes in, holding only the tokens in the stream's
+// lookahead. Runs of equal tokens are dumped once, like collect_tokens
+// merges them
+static void stream_tokens(Lexer *lexer, bth_lex_fn next, struct dump *out)
+{
+    struct bth_lex_stream s;
+    size_t repeat = 0;
+    size_t first = 0; // offset of the first token of the run
+
+    bth_lex_stream_init(&s, lexer, next);
+
+    if (out)
+        dump_begin(out, lexer->filename);
+
+    for (;;)
+    {
+        // peeking further may move the ring, so the farthest comes first
+        const struct bth_lex_token *u = bth_lex_peek(&s, 1);
+        const struct bth_lex_token *t = bth_lex_peek(&s, 0);
+
+        if (t->kind == INVALID)
+        {
+            size_t row = 0;
+            size_t col = 0;
+
+            bth_lex_position(lexer, t->begin - lexer->buffer, &row, &col);
+            errx(1, "at %zu:%zu: INVALID", row, col);
+        }
+
+        if (t->kind == LK_END)
+            break;
+
+        String text = str_slice(t->begin, t->end);
+
+        if (!repeat)
+            first = lexer->base + (t->begin - lexer->buffer);
+
+        if (out && (u->id != t->id || u->kind != t->kind
+                    || !str_eq(str_slice(u->begin, u->end), text)))
+        {
+            dump_token(out, first, t->id, t->kind, text, repeat);
+            repeat = 0;
+        }
+        else if (out)
+            repeat++;
+
+        bth_lex_next(&s);
+    }
+
+    if (out)
+        dump_end(out);
+}
+
+static void dump_tokens(struct dump *out, const struct bth_lex_store *tokens)
+{
+    if (out)
+        dump_store(out, tokens);
+}
+
+// lexes every file of paths in turn, the next depth of them being read
+// while the current one is lexed. Only the time spent lexing counts
+// towards the throughput, the time spent waiting for a file to be read is
+// reported apart
+static void lex_files(const struct driver_options *o, Lexer *lexer,
+                      const char *const *paths, size_t count,
+                      struct token_cache *cache)
+{
+    struct memory *mem = o->mem;
+    struct worker_memory own = {0};
+    const struct bth_allocator *a = worker_alloc(mem, &own);
+    struct bth_aio aio;
+    struct bth_aio_file f;
+    size_t bytes = 0;
+    double secs = 0;
+
+    if (!bth_aio_init(&aio, paths, count, o->depth, o->flags))
+        errx(1, "Could not start reading the input files");
+
+    while (bth_aio_next(&aio, &f))
+    {
+        if (f.error)
+        {
+            errno = f.error;
+            err(1, "%s", f.path);
+        }
+
+        struct timespec t0, t1;
+        struct bth_arena arena = {0};
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        bth_lex_reset(lexer, f.data, f.size);
+        lexer->filename = f.path;
+        lexer->padding = BTH_AIO_PADDING;
+
+        struct bth_allocator ta = tokens_alloc(mem, a, &arena);
+        struct bth_lex_store tokens;
+
+        if (!token_cache_lex(cache, lexer, o->next, &ta, &tokens))
+            report_invalid(lexer, lexer->cur);
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        secs += elapsed(&t0, &t1);
+        bytes += f.size;
+
+        mem->tokens += tokens.count;
+        dump_tokens(o->out, &tokens);
+
+        bth_lex_store_fini(&tokens);
+        bth_arena_fini(&arena);
+        bth_aio_release(&f);
+    }
+
+    if (o->timed)
+        fprintf(stderr, "%zu files: %zu bytes in %.3f ms, %.1f MB/s "
+                "(%s lexer), %.3f ms waiting on %s reads (depth %u)\n",
+                count, bytes, secs * 1e3, bytes / secs / 1e6,
+                o->next == lex_gen_get_token ? "generated" : "table",
+                aio.wait_ns / 1e6, bth_aio_backend2str(aio.backend),
+                aio.depth);
+
+    bth_aio_fini(&aio);
+    worker_memory_fini(mem, &own);
+}
+
+struct lex_result
+{
+    struct bth_io_map input;
+    struct bth_arena arena;
+    struct bth_lex_store tokens;
+    int error; // errno of a failed mapfn
+    int invalid; // lexing stopped on an INVALID token at row and col
+    size_t row;
+    size_t col;
+    int done;
+};
+
+// what the workers of lex_parallel share, each only writes to the lexer of
+// its number and the results of its tasks
+struct lex_job
+{
+    Lexer *lexers; // forks of one lexer, sharing its tables
+    struct worker_memory *memory; // by worker, like lexers
+    const struct memory *mem;
+    struct token_cache *cache;
+    bth_lex_fn next;
+    const char *const *paths;
+    int flags;
+    struct lex_result *results;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+};
+
+static void lex_task(void *ctx, unsigned worker, size_t i)
+{
+    struct lex_job *job = ctx;
+    struct lex_result *r = job->results + i;
+    Lexer *lexer = job->lexers + worker;
+    const struct bth_allocator *a = worker_alloc(job->mem,
+                                                 job->memory + worker);
+
+    // the fork holds no line index before its first file
+    lexer->alloc = *a;
+    r->input.alloc = *a;
+
+    if (mapfn(&r->input, job->paths[i], job->flags))
+    {
+        struct bth_allocator ta = tokens_alloc(job->mem, a, &r->arena);
+
+        bth_lex_reset(lexer, r->input.data, r->input.size);
+        lexer->filename = job->paths[i];
+        lexer->padding = BTH_IO_PADDING;
+        if (!token_cache_lex(job->cache, lexer, job->next, &ta, &r->tokens))
+        {
+            r->invalid = 1;
+            bth_lex_position(lexer, lexer->cur, &r->row, &r->col);
+        }
+    }
+    else
+        r->error = errno;
+
+    pthread_mutex_lock(&job->lock);
+    r->done = 1;
+    pthread_cond_broadcast(&job->done);
+    pthread_mutex_unlock(&job->lock);
+}
+
+// lexes the files of paths on jobs threads and dumps them in list order,
+// each as soon as it and all the ones before are lexed
+static void lex_parallel(const struct driver_options *o, Lexer *lexer,
+                         const char *const *paths, size_t count,
+                         unsigned jobs, struct token_cache *cache)
+{
+    struct memory *mem = o->mem;
+    struct lex_job job = {
+        .lexers = malloc(jobs * sizeof(Lexer)),
+        .memory = calloc(jobs, sizeof(struct worker_memory)),
+        .mem = mem,
+        .cache = cache,
+        .next = o->next,
+        .paths = paths,
+        .flags = o->populate ? BTH_IO_POPULATE : 0,
+        .results = calloc(count, sizeof(struct lex_result)),
+    };
+    struct bth_pool pool;
+    struct timespec t0, t1;
+    size_t bytes = 0;
+
+    if (!job.lexers || !job.memory || !job.results)
+        errx(1, "Could not allocate the workers");
+
+    for (unsigned i = 0; i < jobs; i++)
+        bth_lex_fork(job.lexers + i, lexer);
+
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.done, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    if (!bth_pool_start(&pool, jobs, count, lex_task, &job))
+        errx(1, "Could not start the workers");
+
+    for (size_t i = 0; i < count; i++)
+    {
+        struct lex_result *r = job.results + i;
+
+        pthread_mutex_lock(&job.lock);
+        while (!r->done)
+            pthread_cond_wait(&job.done, &job.lock);
+        pthread_mutex_unlock(&job.lock);
+
+        if (r->error)
+        {
+            errno = r->error;
+            err(1, "%s", paths[i]);
+        }
+
+        if (r->invalid)
+            errx(1, "%s:%zu:%zu: INVALID", paths[i], r->row, r->col);
+
+        bytes += r->input.size;
+        mem->tokens += r->tokens.count;
+        dump_tokens(o->out, &r->tokens);
+
+        bth_lex_store_fini(&r->tokens);
+        bth_arena_fini(&r->arena);
+        unmapfn(&r->input);
+    }
+
+    size_t steals = bth_pool_join(&pool);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (o->timed)
+    {
+        double secs = elapsed(&t0, &t1);
+
+        fprintf(stderr, "%zu files: %zu bytes in %.3f ms, %.1f MB/s "
+                "(%s lexer), %u workers, %zu files stolen\n",
+                count, bytes, secs * 1e3, bytes / secs / 1e6,
+                o->next == lex_gen_get_token ? "generated" : "table",
+                pool.workers, steals);
+    }
+
+    for (unsigned i = 0; i < jobs; i++)
+    {
+        bth_lex_fini(job.lexers + i);
+        worker_memory_fini(mem, job.memory + i);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.done);
+    free(job.lexers);
+    free(job.memory);
+    free(job.results);
+}
+
+struct chunk_job
+{
+    Lexer *lexers; // forks over the whole buffer, one per worker
+    struct worker_memory *memory; // by worker, like lexers
+    const struct memory *mem;
+    bth_lex_fn next;
+    struct token_chunk *chunks;
+};
+
+static void chunk_task(void *ctx, unsigned worker, size_t i)
+{
+    struct chunk_job *job = ctx;
+    const struct bth_allocator *a = worker_alloc(job->mem,
+                                                 job->memory + worker);
+
+    job->chunks[i].arena.alloc = *a;
+    collect_chunk(job->lexers + worker, job->next, job->chunks + i);
+}
+
+// lexes the buffer of lexer on jobs threads, a chunk of lines each, about
+// four chunks a worker so that stealing evens out their costs
+static struct bth_lex_store lex_chunked(const struct driver_options *o,
+                                        Lexer *lexer,
+                                        const struct bth_allocator *alloc)
+{
+    unsigned jobs = o->jobs;
+    size_t n = lexer->size / LEX_CHUNK;
+
+    if (n > 4 * jobs)
+        n = 4 * jobs;
+
+    struct chunk_job job = {
+        .lexers = malloc(jobs * sizeof(Lexer)),
+        .memory = calloc(jobs, sizeof(struct worker_memory)),
+        .mem = o->mem,
+        .next = o->next,
+        .chunks = malloc(n * sizeof(struct token_chunk)),
+    };
+    struct bth_pool pool;
+
+    if (!job.lexers || !job.memory || !job.chunks)
+        errx(1, "Could not allocate the workers");
+
+    n = split_chunks(lexer->buffer, lexer->size, lexer->size / n,
+                     job.chunks, n);
+
+    for (unsigned i = 0; i < jobs; i++)
+    {
+        bth_lex_fork(job.lexers + i, lexer);
+        bth_lex_reset(job.lexers + i, lexer->buffer, lexer->size);
+        job.lexers[i].padding = lexer->padding;
+    }
+
+    if (!bth_pool_start(&pool, jobs, n, chunk_task, &job))
+        errx(1, "Could not start the workers");
+
+    bth_pool_join(&pool);
+
+    struct bth_lex_store tokens = stitch_chunks(lexer, o->next, job.chunks,
+                                                n, alloc);
+
+    for (size_t i = 0; i < n; i++)
+        bth_arena_fini(&job.chunks[i].arena);
+
+    for (unsigned i = 0; i < jobs; i++)
+    {
+        bth_lex_fini(job.lexers + i);
+        worker_memory_fini(o->mem, job.memory + i);
+    }
+
+    free(job.lexers);
+    free(job.memory);
+    free(job.chunks);
+
+    return tokens;
+}
+
+// lexes the files of paths with the driver the options tell
+static void lex_many(const struct driver_options *o,
+                     const char *const *paths, size_t count)
+{
+    Lexer lexer = driver_lexer(o);
+    struct token_cache tc;
+    struct token_cache *cache = driver_cache_open(o, &tc, &lexer);
+    unsigned jobs = o->jobs > count ? count : o->jobs;
+
+    if (o->pipelined)
+        lex_pipeline(o, &lexer, paths, count, jobs, cache);
+    else if (jobs > 1)
+        lex_parallel(o, &lexer, paths, count, jobs, cache);
+    else
+        lex_files(o, &lexer, paths, count, cache);
+
+    bth_lex_fini(&lexer);
+    driver_cache_close(o, cache);
+}
+
+// lexes the standard input if path is "-", else the file at path, split
+// between the workers when it is big enough
+static void lex_one(const struct driver_options *o, const char *path)
+{
+    struct memory *mem = o->mem;
+    bool streamed = !strcmp(path, "-");
+    struct bth_io_map input = {.alloc = mem->base};
+    struct token_cache tc;
+    struct token_cache *cache = NULL;
+    Lexer lexer;
+
+    if (streamed)
+    {
+        lexer = token_lexer(NULL, 0);
+        lexer.alloc = mem->base;
+
+        if (!bth_lex_window_init(&lexer, BTH_LEX_WINDOW, readfile, stdin))
+            errx(1, "Could not allocate the input window");
+    }
+    else
+    {
+        if (!mapfn(&input, path, o->populate ? BTH_IO_POPULATE : 0))
+            err(1, "%s", path);
+
+        lexer = token_lexer(input.data, input.size);
+        lexer.filename = path;
+        lexer.padding = BTH_IO_PADDING;
+        lexer.alloc = mem->base;
+    }
+
+    lexer.trivia = o->skip ? token_is_trivia : NULL;
+
+    if (!bth_lex_init(&lexer))
+        errx(1, "Could not build lexer tables");
+
+    if (!streamed)
+        cache = driver_cache_open(o, &tc, &lexer);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    struct worker_memory own = {0};
+    struct bth_arena arena = {0};
+    struct bth_allocator ta = tokens_alloc(mem, worker_alloc(mem, &own),
+                                           &arena);
+    struct bth_lex_store tokens = {0};
+
+    if (streamed)
+        stream_tokens(&lexer, o->next, o->out);
+    else if (o->jobs > 1 && lexer.size >= 2 * LEX_CHUNK)
+    {
+        uint64_t key = cache ? token_cache_key(cache, lexer.buffer,
+                                               lexer.size) : 0;
+
+        if (!cache || !token_cache_load(cache, key, &lexer, &ta, &tokens))
+        {
+            tokens = lex_chunked(o, &lexer, &ta);
+
+            if (cache)
+                token_cache_save(cache, key, lexer.size, &tokens);
+        }
+    }
+    else if (!token_cache_lex(cache, &lexer, o->next, &ta, &tokens))
+        report_invalid(&lexer, lexer.cur);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (o->timed)
+    {
+        double secs = elapsed(&t0, &t1);
+        size_t bytes = lexer.base + lexer.size;
+
+        fprintf(stderr, "%s: %zu bytes in %.3f ms, %.1f MB/s (%s lexer)\n",
+                path, bytes, secs * 1e3, bytes / secs / 1e6,
+                o->next == lex_gen_get_token ? "generated" : "table");
+    }
+
+    mem->tokens += tokens.count;
+    dump_tokens(o->out, &tokens);
+
+    bth_lex_store_fini(&tokens);
+    bth_arena_fini(&arena);
+    worker_memory_fini(mem, &own);
+    bth_lex_fini(&lexer);
+    unmapfn(&input);
+    driver_cache_close(o, cache);
+}
+
+// lexes the files args name, directories and patterns among them being
+// expanded. A single - streams the standard input
+void driver_lex(const struct driver_options *o, const char *const *args,
+                size_t n)
+{
+    struct file_list paths = {0};
+
+    if (n == 1 && !strcmp(args[0], "-"))
+    {
+        lex_one(o, args[0]);
+        return;
+    }
+
+    for (size_t i = 0; i < n; i++)
+        file_list_arg(&paths, args[i]);
+
+    if (!paths.count)
+        errx(1, "no input files");
+
+    // anything but one plain file goes through the many files drivers
+    if (paths.count != 1 || strcmp(paths.v[0], args[0]))
+        lex_many(o, (const char *const *)paths.v, paths.count);
+    else
+        lex_one(o, args[0]);
+
+    file_list_free(&paths);
+}
+
+// runs the daemon at path until signaled
+void driver_serve(const struct driver_options *o, const char *path)
+{
+    Lexer lexer = driver_lexer(o);
+    struct token_cache tc;
+    struct token_cache *cache = driver_cache_open(o, &tc, &lexer);
+    struct file_set files;
+
+    if (!file_set_init(&files, &lexer, o->next, cache, FILE_SET_LIMIT))
+        errx(1, "Could not allocate the files");
+
+    if (!daemon_serve(path, &files, o->jobs, o->timed))
+        err(1, "%s", path);
+
+    file_set_fini(&files);
+    bth_lex_fini(&lexer);
+    driver_cache_close(o, cache);
+}
+
+// lexes the files under dirs, then again as they change, until signaled
+void driver_watch(const struct driver_options *o, const char *const *dirs,
+                  size_t n)
+{
+    Lexer lexer = driver_lexer(o);
+    struct token_cache tc;
+    struct token_cache *cache = driver_cache_open(o, &tc, &lexer);
+    struct file_set files;
+
+    if (!file_set_init(&files, &lexer, o->next, cache, FILE_SET_LIMIT))
+        errx(1, "Could not allocate the files");
+
+    watch_files(dirs, n, &files, o->jobs, o->out, o->timed);
+
+    file_set_fini(&files);
+    bth_lex_fini(&lexer);
+    driver_cache_close(o, cache);
+}
+
+// sends the request the options tell to the daemon at path, directories
+// and patterns among args being expanded here
+void driver_request(const char *path, const char *dump_name,
+                    const char *query, const char *const *args, size_t n,
+                    bool timed)
+{
+    struct file_list paths = {0};
+    const char *head[2];
+    size_t k = 0;
+
+    if (query)
+    {
+        head[k++] = "query";
+        head[k++] = query;
+    }
+    else if (dump_name)
+    {
+        head[k++] = "dump";
+        head[k++] = dump_name;
+    }
+    else
+        head[k++] = n ? "lex" : "stats";
+
+    for (size_t i = 0; i < n; i++)
+        file_list_arg(&paths, args[i]);
+
+    if (n && !paths.count)
+        errx(1, "no input files");
+
+    const char **v = malloc((k + paths.count) * sizeof(*v));
+
+    if (!v)
+        errx(1, "Could not allocate the request");
+
+    memcpy(v, head, k * sizeof(*v));
+
+    for (size_t i = 0; i < paths.count; i++)
+        v[k + i] = paths.v[i];
+
+    daemon_request(path, v, k + paths.count, timed);
+
+    file_list_free(&paths);
+    free(v);
+}
@@ -0,0 +1,339 @@
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../include/bth_lex.h"
+#include "../include/dump.h"
+#include "../include/token.h"
+
+// what each byte becomes after a backslash, 0 for bytes written as they
+// are. 'u' stands for a \u00XX escape
+static const char TEXT_ESCAPES[256] = {
+    ['\a'] = 'a', ['\b'] = 'b', ['\t'] = 't', ['\n'] = 'n',
+    ['\v'] = 'v', ['\f'] = 'f', ['\r'] = 'r',
+};
+
+static const char JSON_ESCAPES[256] = {
+    [0x00] = 'u', [0x01] = 'u', [0x02] = 'u', [0x03] = 'u',
+    [0x04] = 'u', [0x05] = 'u', [0x06] = 'u', [0x07] = 'u',
+    ['\b'] = 'b', ['\t'] = 't', ['\n'] = 'n', [0x0b] = 'u',
+    ['\f'] = 'f', ['\r'] = 'r', [0x0e] = 'u', [0x0f] = 'u',
+    [0x10] = 'u', [0x11] = 'u', [0x12] = 'u', [0x13] = 'u',
+    [0x14] = 'u', [0x15] = 'u', [0x16] = 'u', [0x17] = 'u',
+    [0x18] = 'u', [0x19] = 'u', [0x1a] = 'u', [0x1b] = 'u',
+    [0x1c] = 'u', [0x1d] = 'u', [0x1e] = 'u', [0x1f] = 'u',
+    ['"'] = '"', ['\\'] = '\\',
+};
+
+// the dump, if any, for exit to flush what it holds. Only the thread
+// writing it may, one exiting from a worker leaves it be
+static struct dump *exit_dump;
+static pthread_t exit_thread;
+
+static void dump_exit(void)
+{
+    if (exit_dump && pthread_equal(pthread_self(), exit_thread))
+        dump_flush(exit_dump);
+}
+
+int dump_format_parse(const char *name, enum dump_format *format)
+{
+    if (!strcmp(name, "text"))
+        *format = DUMP_TEXT;
+    else if (!strcmp(name, "jsonl"))
+        *format = DUMP_JSONL;
+    else if (!strcmp(name, "binary"))
+        *format = DUMP_BINARY;
+    else
+        return 0;
+
+    return 1;
+}
+
+int dump_init(struct dump *d, int fd, enum dump_format format)
+{
+    *d = (struct dump){.format = format, .fd = fd};
+    d->buf = malloc(DUMP_BUFFER);
+
+    return d->buf != NULL;
+}
+
+static void dump_write(struct dump *d, const char *p, size_t n)
+{
+    while (n && !d->error)
+    {
+        ssize_t w = write(d->fd, p, n);
+
+        if (w < 0 && errno == EINTR)
+            continue;
+
+        if (w < 0 && !d->lenient)
+            err(1, "Could not write the tokens");
+
+        if (w < 0)
+        {
+            d->error = errno;
+            break;
+        }
+
+        p += w;
+        n -= w;
+        d->written += w;
+    }
+}
+
+void dump_flush(struct dump *d)
+{
+    dump_write(d, d->buf, d->len);
+    d->len = 0;
+}
+
+void dump_fini(struct dump *d)
+{
+    if (d == exit_dump)
+        exit_dump = NULL;
+
+    dump_flush(d);
+    free(d->buf);
+    d->buf = NULL;
+}
+
+// has d flushed by the errors that exit from the calling thread, until
+// dump_fini. Once a process
+void dump_flush_at_exit(struct dump *d)
+{
+    exit_dump = d;
+    exit_thread = pthread_self();
+    atexit(dump_exit);
+}
+
+// room for n more bytes, n being at most DUMP_BUFFER
+static char *dump_reserve(struct dump *d, size_t n)
+{
+    if (d->len + n > DUMP_BUFFER)
+        dump_flush(d);
+
+    return d->buf + d->len;
+}
+
+static void dump_bytes(struct dump *d, const char *p, size_t n)
+{
+    if (!n)
+        return;
+
+    if (n > DUMP_BUFFER / 2)
+    {
+        dump_flush(d);
+        dump_write(d, p, n);
+        return;
+    }
+
+    memcpy(dump_reserve(d, n), p, n);
+    d->len += n;
+}
+
+#define DUMP_LITERAL(d, s) dump_bytes(d, s, sizeof(s) - 1)
+
+// bytes of a binary token record before its text
+#define DUMP_RECORD 19
+
+static void dump_uint(struct dump *d, uint64_t v)
+{
+    char tmp[20];
+    size_t n = sizeof(tmp);
+
+    do
+    {
+        tmp[--n] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+
+    dump_bytes(d, tmp + n, sizeof(tmp) - n);
+}
+
+// stores the n low bytes of v at p, little-endian, returns what follows
+static char *put_le(char *p, uint64_t v, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        p[i] = (char)(v >> (8 * i));
+
+    return p + n;
+}
+
+// first byte from p on that escapes has table set, end if none
+static const char *dump_plain(const char *table, const char *p,
+                              const char *end)
+{
+#ifdef BTH_LEX_SIMD
+    // 16 bytes at a time until one may need escaping, the table then
+    // tells which
+    if (table == TEXT_ESCAPES)
+    {
+        const __m128i lo = _mm_set1_epi8('\a');
+        const __m128i span = _mm_set1_epi8('\r' - '\a');
+
+        for (; p + 16 <= end; p += 16)
+        {
+            __m128i v = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)p),
+                                     lo);
+
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, span), v)))
+                break;
+        }
+    }
+    else
+    {
+        const __m128i ctl = _mm_set1_epi8(0x1f);
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i slash = _mm_set1_epi8('\\');
+
+        for (; p + 16 <= end; p += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)p);
+            __m128i m = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v),
+                                     _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                                  _mm_cmpeq_epi8(v, slash)));
+
+            if (_mm_movemask_epi8(m))
+                break;
+        }
+    }
+#endif
+
+    while (p < end && !table[(unsigned char)*p])
+        p++;
+
+    return p;
+}
+
+// writes s with the escapes of table, runs of plain bytes in one copy
+static void dump_escaped(struct dump *d, const char *table, String s)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *p = s.data;
+    const char *end = s.data + s.len;
+
+    for (;;)
+    {
+        const char *q = dump_plain(table, p, end);
+
+        dump_bytes(d, p, q - p);
+
+        if (q == end)
+            return;
+
+        unsigned char c = *q;
+        char *o = dump_reserve(d, 6);
+
+        o[0] = '\\';
+        o[1] = table[c];
+
+        if (table[c] == 'u')
+        {
+            memcpy(o + 2, "00", 2);
+            o[4] = hex[c >> 4];
+            o[5] = hex[c & 0xf];
+            d->len += 6;
+        }
+        else
+            d->len += 2;
+
+        p = q + 1;
+    }
+}
+
+// a binary dump is, for each file: "CBTD", a version byte, the u32 length
+// of the file name and the name, then a record per token: u16 id, u8 kind,
+// u64 offset, u32 length, u32 repeats and the text of the token. An
+// LK_END record with no text closes the file
+void dump_begin(struct dump *d, const char *filename)
+{
+    d->filename = filename ? filename : "-";
+
+    if (d->format != DUMP_BINARY)
+        return;
+
+    size_t n = strlen(d->filename);
+
+    DUMP_LITERAL(d, "CBTD\x01");
+    put_le(dump_reserve(d, 4), n, 4);
+    d->len += 4;
+    dump_bytes(d, d->filename, n);
+}
+
+// repeat is how many more times the token comes right after itself
+void dump_token(struct dump *d, size_t offset, unsigned short id,
+                unsigned char kind, String text, size_t repeat)
+{
+    switch (d->format)
+    {
+    case DUMP_TEXT:
+        DUMP_LITERAL(d, "(bth_lex_token){name='");
+        dump_bytes(d, token_kind2str(id), strlen(token_kind2str(id)));
+        DUMP_LITERAL(d, "', value='");
+        dump_escaped(d, TEXT_ESCAPES, text);
+        DUMP_LITERAL(d, "'}\n");
+        break;
+    case DUMP_JSONL:
+        DUMP_LITERAL(d, "{\"file\":\"");
+        dump_escaped(d, JSON_ESCAPES, str_view(d->filename,
+                                               strlen(d->filename)));
+        DUMP_LITERAL(d, "\",\"offset\":");
+        dump_uint(d, offset);
+        DUMP_LITERAL(d, ",\"len\":");
+        dump_uint(d, text.len);
+        DUMP_LITERAL(d, ",\"kind\":\"");
+        dump_bytes(d, token_kind2str(id), strlen(token_kind2str(id)));
+        DUMP_LITERAL(d, "\",\"text\":\"");
+        dump_escaped(d, JSON_ESCAPES, text);
+        DUMP_LITERAL(d, "\",\"repeat\":");
+        dump_uint(d, repeat);
+        DUMP_LITERAL(d, "}\n");
+        break;
+    case DUMP_BINARY:
+    {
+        char *p = dump_reserve(d, DUMP_RECORD);
+
+        p = put_le(p, id, 2);
+        p = put_le(p, kind, 1);
+        p = put_le(p, offset, 8);
+        p = put_le(p, text.len, 4);
+        put_le(p, repeat, 4);
+        d->len += DUMP_RECORD;
+        dump_bytes(d, text.data, text.len);
+        break;
+    }
+    }
+}
+
+void dump_end(struct dump *d)
+{
+    if (d->format == DUMP_BINARY)
+        dump_token(d, 0, 0, LK_END, str_view(NULL, 0), 0);
+}
+
+// the tokens of s up to LK_END, as a whole file
+void dump_store(struct dump *d, const struct bth_lex_store *s)
+{
+    size_t r = 0; // next of the repeats
+
+    dump_begin(d, s->filename);
+
+    for (size_t i = 0; i < s->count && s->kinds[i] != LK_END; i++)
+    {
+        size_t repeat = 0;
+
+        if (r < s->repeats_count && s->repeats[r].idx == i)
+            repeat = s->repeats[r++].count;
+
+        dump_token(d, s->offsets[i], s->ids[i], s->kinds[i],
+                   str_slice(bth_lex_store_begin(s, i),
+                             bth_lex_store_end(s, i)),
+                   repeat);
+    }
+
+    dump_end(d);
+}
@@ -0,0 +1,735 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../include/bth_hash.h"
+#include "../include/bth_io.h"
+#include "../include/bth_lex.h"
+#include "../include/bth_types.h"
+#include "../include/files.h"
+#include "../include/token.h"
+
+#define FILES_ADD(p, n) __atomic_fetch_add(p, n, __ATOMIC_RELAXED)
+
+// limit is in bytes, cache may be NULL. The lexer outlives the set
+int file_set_init(struct file_set *s, const struct bth_lexer *lexer,
+                  bth_lex_fn next, struct token_cache *cache, size_t limit)
+{
+    *s = (struct file_set){
+        .lexer = lexer,
+        .next = next,
+        .cache = cache,
+        .seed = cache ? cache->seed : 0,
+        .limit = limit,
+        .cap = 64,
+    };
+    s->buckets = calloc(s->cap, sizeof(*s->buckets));
+
+    if (!s->buckets)
+        return 0;
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_mutex_init(&s->names_lock, NULL);
+    return 1;
+}
+
+static void entry_free(struct file_entry *e)
+{
+    bth_lex_store_fini(&e->tokens);
+    bth_lex_fini(&e->lexer);
+    pthread_rwlock_destroy(&e->lock);
+    free(e->names);
+    free(e->data);
+    free(e->path);
+    free(e);
+}
+
+// once no thread uses s anymore
+void file_set_fini(struct file_set *s)
+{
+    for (size_t i = 0; i < s->cap; i++)
+        while (s->buckets[i])
+        {
+            struct file_entry *e = s->buckets[i];
+
+            s->buckets[i] = e->next;
+            entry_free(e);
+        }
+
+    free(s->buckets);
+    free(s->names);
+    free(s->slots);
+    bth_arena_fini(&s->arena);
+    pthread_mutex_destroy(&s->lock);
+    pthread_mutex_destroy(&s->names_lock);
+}
+
+static struct file_entry **entry_link(struct file_set *s, const char *path)
+{
+    size_t h = str_hash(str_view(path, strlen(path))) & (s->cap - 1);
+    struct file_entry **link = &s->buckets[h];
+
+    while (*link && strcmp((*link)->path, path))
+        link = &(*link)->next;
+
+    return link;
+}
+
+// twice the buckets once there are more entries than buckets, if it can
+static void set_grow(struct file_set *s)
+{
+    size_t cap = s->cap * 2;
+    struct file_entry **buckets = calloc(cap, sizeof(*buckets));
+
+    if (!buckets)
+        return;
+
+    for (size_t i = 0; i < s->cap; i++)
+        while (s->buckets[i])
+        {
+            struct file_entry *e = s->buckets[i];
+            size_t h = str_hash(str_view(e->path, strlen(e->path)))
+                & (cap - 1);
+
+            s->buckets[i] = e->next;
+            e->next = buckets[h];
+            buckets[h] = e;
+        }
+
+    free(s->buckets);
+    s->buckets = buckets;
+    s->cap = cap;
+}
+
+static struct file_entry *entry_new(struct file_set *s, const char *path)
+{
+    struct file_entry *e = calloc(1, sizeof(*e));
+
+    if (!e || !(e->path = malloc(strlen(path) + 1)))
+    {
+        free(e);
+        return NULL;
+    }
+
+    strcpy(e->path, path);
+    pthread_rwlock_init(&e->lock, NULL);
+    bth_lex_fork(&e->lexer, s->lexer);
+    return e;
+}
+
+// under the set lock, with e out of the table. Freed once unused
+static void entry_unref(struct file_entry *e, struct file_entry **dead)
+{
+    if (!--e->refs)
+    {
+        e->next = *dead;
+        *dead = e;
+    }
+}
+
+static void entries_free(struct file_entry *dead)
+{
+    while (dead)
+    {
+        struct file_entry *next = dead->next;
+
+        entry_free(dead);
+        dead = next;
+    }
+}
+
+// under the set lock, drops the least recently used entries nobody uses
+// until the others fit the limit
+static void set_evict(struct file_set *s, struct file_entry **dead)
+{
+    while (s->bytes > s->limit)
+    {
+        struct file_entry **oldest = NULL;
+
+        for (size_t i = 0; i < s->cap; i++)
+            for (struct file_entry **l = &s->buckets[i]; *l;
+                 l = &(*l)->next)
+                if ((*l)->refs == 1
+                    && (!oldest || (*l)->used < (*oldest)->used))
+                    oldest = l;
+
+        if (!oldest)
+            return;
+
+        struct file_entry *e = *oldest;
+
+        *oldest = e->next;
+        s->count--;
+        s->bytes -= e->bytes;
+        s->stats.evicted++;
+        entry_unref(e, dead);
+    }
+}
+
+static int entry_fresh(const struct file_entry *e, const struct stat *st)
+{
+    return e->loaded && e->dev == st->st_dev && e->ino == st->st_ino
+        && e->size == st->st_size
+        && e->mtime.tv_sec == st->st_mtim.tv_sec
+        && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// reads what fd has left, expecting size bytes, then pads it with zeros
+static int read_all(int fd, size_t size, char **data, size_t *len,
+                    size_t *cap)
+{
+    size_t c = size + 1 + BTH_IO_PADDING;
+    size_t n = 0;
+    char *d = malloc(c);
+
+    while (d)
+    {
+        if (c - n <= BTH_IO_PADDING)
+        {
+            char *nd = realloc(d, 2 * c);
+
+            if (!nd)
+                break;
+
+            d = nd;
+            c *= 2;
+        }
+
+        ssize_t r = read(fd, d + n, c - n - BTH_IO_PADDING);
+
+        if (r < 0 && errno == EINTR)
+            continue;
+
+        if (r < 0)
+            break;
+
+        if (!r)
+        {
+            memset(d + n, 0, BTH_IO_PADDING);
+            *data = d;
+            *len = n;
+            *cap = c;
+            return 1;
+        }
+
+        n += r;
+    }
+
+    free(d);
+    return 0;
+}
+
+// the single edit turning a into b, all they have between their common
+// prefix and suffix
+static struct token_edit diff_edit(const char *a, size_t na, const char *b,
+                                   size_t nb)
+{
+    size_t m = na < nb ? na : nb;
+    size_t p = 0;
+    size_t q = 0;
+
+    while (p + 64 <= m && !memcmp(a + p, b + p, 64))
+        p += 64;
+
+    while (p < m && a[p] == b[p])
+        p++;
+
+    while (q + 64 <= m - p && !memcmp(a + na - q - 64, b + nb - q - 64, 64))
+        q += 64;
+
+    while (q < m - p && a[na - q - 1] == b[nb - q - 1])
+        q++;
+
+    return (struct token_edit){p, na - q, nb - p - q};
+}
+
+static size_t entry_bytes(const struct file_entry *e)
+{
+    const struct bth_lex_store *t = &e->tokens;
+
+    return e->cap + e->lexer.lines_count * sizeof(size_t)
+        + t->cap * (sizeof(*t->kinds) + sizeof(*t->ids)
+                    + sizeof(*t->offsets) + sizeof(*t->lens))
+        + t->repeats_cap * sizeof(*t->repeats)
+        + (e->names ? t->count * sizeof(*e->names) : 0);
+}
+
+// brings e, write-locked, up to date with the file open at fd. Only what
+// changed since it was last read is lexed again, when the content did
+static int entry_load(struct file_set *s, struct file_entry *e, int fd,
+                      const struct stat *st, char *error, size_t n)
+{
+    char *data;
+    size_t size;
+    size_t cap;
+
+    if (!read_all(fd, st->st_size, &data, &size, &cap))
+    {
+        snprintf(error, n, "%s: %s", e->path, strerror(errno));
+        return 0;
+    }
+
+    uint64_t hash = bth_xxh64(data, size, s->seed);
+
+    if (e->loaded && hash == e->hash && size == e->lexer.size)
+    {
+        free(data);
+        FILES_ADD(&s->stats.touched, 1);
+    }
+    else
+    {
+        struct bth_lexer lexer;
+        struct bth_lex_store tokens;
+        int ok;
+
+        bth_lex_fork(&lexer, s->lexer);
+        bth_lex_reset(&lexer, data, size);
+        lexer.filename = e->path;
+        lexer.padding = BTH_IO_PADDING;
+
+        if (e->loaded)
+        {
+            struct token_edit edit = diff_edit(e->data, e->lexer.size, data,
+                                               size);
+
+            ok = relex_tokens(&lexer, s->next, &e->tokens, &edit, NULL);
+            FILES_ADD(&s->stats.relexed, ok);
+        }
+        else
+        {
+            ok = s->cache && token_cache_load(s->cache, hash, &lexer, NULL,
+                                              &tokens);
+
+            if (!ok && (ok = lex_tokens(&lexer, s->next, NULL, &tokens))
+                && s->cache)
+                token_cache_save(s->cache, hash, size, &tokens);
+
+            if (ok)
+                e->tokens = tokens;
+
+            FILES_ADD(&s->stats.lexed, ok);
+        }
+
+        if (!ok)
+        {
+            size_t row = 0;
+            size_t col = 0;
+
+            bth_lex_position(&lexer, lexer.cur, &row, &col);
+            snprintf(error, n, "%s:%zu:%zu: INVALID", e->path, row, col);
+            bth_lex_fini(&lexer);
+            free(data);
+            return 0;
+        }
+
+        bth_lex_fini(&e->lexer);
+        free(e->data);
+        free(e->names);
+        e->lexer = lexer;
+        e->data = data;
+        e->cap = cap;
+        e->names = NULL;
+        e->loaded = 1;
+        e->hash = hash;
+    }
+
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtim;
+    return 1;
+}
+
+// id of name, interned first if add, 0 if unknown. Under the names lock
+static uint32_t names_find(struct file_set *s, String name, int add)
+{
+    if (add && 2 * (s->names_count + 1) > s->slots_cap)
+    {
+        size_t cap = s->slots_cap ? 2 * s->slots_cap : 1024;
+        uint32_t *slots = calloc(cap, sizeof(*slots));
+
+        if (!slots)
+            errx(1, "Could not intern names");
+
+        for (size_t id = 1; id <= s->names_count; id++)
+        {
+            size_t i = str_hash(s->names[id]) & (cap - 1);
+
+            while (slots[i])
+                i = (i + 1) & (cap - 1);
+
+            slots[i] = id;
+        }
+
+        free(s->slots);
+        s->slots = slots;
+        s->slots_cap = cap;
+    }
+
+    if (!s->slots_cap)
+        return 0;
+
+    size_t mask = s->slots_cap - 1;
+    size_t i = str_hash(name) & mask;
+
+    for (; s->slots[i]; i = (i + 1) & mask)
+        if (str_eq(s->names[s->slots[i]], name))
+            return s->slots[i];
+
+    if (!add)
+        return 0;
+
+    if (s->names_count + 2 > s->names_cap)
+    {
+        size_t cap = s->names_cap ? 2 * s->names_cap : 1024;
+        String *names = realloc(s->names, cap * sizeof(*names));
+
+        if (!names)
+            errx(1, "Could not intern names");
+
+        s->names = names;
+        s->names_cap = cap;
+    }
+
+    char *text = bth_arena_alloc(&s->arena, name.len + 1);
+
+    if (!text)
+        errx(1, "Could not intern names");
+
+    memcpy(text, name.data, name.len);
+    s->names[++s->names_count] = str_view(text, name.len);
+    s->slots[i] = s->names_count;
+    return s->names_count;
+}
+
+// interns the identifiers of e, write-locked, and indexes its lines so that
+// readers can tell where they are
+static int entry_names(struct file_set *s, struct file_entry *e, char *error,
+                       size_t n)
+{
+    const struct bth_lex_store *t = &e->tokens;
+    uint32_t *names = malloc((t->count + 1) * sizeof(*names));
+
+    if (!names || !bth_lex_lines_build(&e->lexer))
+    {
+        free(names);
+        snprintf(error, n, "%s: %s", e->path, strerror(ENOMEM));
+        return 0;
+    }
+
+    pthread_mutex_lock(&s->names_lock);
+
+    for (size_t i = 0; i < t->count; i++)
+        names[i] = t->kinds[i] == LK_IDENT
+            ? names_find(s, str_slice(bth_lex_store_begin(t, i),
+                                      bth_lex_store_end(t, i)), 1)
+            : 0;
+
+    s->stats.names = s->names_count;
+    pthread_mutex_unlock(&s->names_lock);
+
+    e->names = names;
+    return 1;
+}
+
+// the entry of the file at path, up to date and read-locked until
+// file_set_put, its names interned too if names. NULL with a message in
+// error if it cannot be read or lexed
+struct file_entry *file_set_get(struct file_set *s, const char *path,
+                                int names, char *error, size_t n)
+{
+    struct file_entry *dead = NULL;
+    struct file_entry *e;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st))
+    {
+        snprintf(error, n, "%s: %s", path, strerror(errno));
+
+        if (fd >= 0)
+            close(fd);
+
+        return NULL;
+    }
+
+    if (!S_ISREG(st.st_mode))
+    {
+        snprintf(error, n, "%s: Not a regular file", path);
+        close(fd);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&s->lock);
+
+    struct file_entry **link = entry_link(s, path);
+
+    if (!(e = *link) && (e = *link = entry_new(s, path)))
+    {
+        e->refs = 1;
+
+        if (++s->count > s->cap)
+            set_grow(s);
+    }
+
+    if (e)
+    {
+        e->refs++;
+        e->used = ++s->clock;
+    }
+
+    pthread_mutex_unlock(&s->lock);
+
+    if (!e)
+    {
+        snprintf(error, n, "%s: %s", path, strerror(ENOMEM));
+        close(fd);
+        return NULL;
+    }
+
+    int ok = 1;
+    int hit = 1;
+
+    pthread_rwlock_rdlock(&e->lock);
+
+    while (ok && (!entry_fresh(e, &st) || (names && !e->names)))
+    {
+        pthread_rwlock_unlock(&e->lock);
+        pthread_rwlock_wrlock(&e->lock);
+
+        if (!entry_fresh(e, &st))
+        {
+            ok = entry_load(s, e, fd, &st, error, n);
+            hit = 0;
+        }
+
+        if (ok && names && !e->names)
+            ok = entry_names(s, e, error, n);
+
+        size_t bytes = entry_bytes(e);
+
+        pthread_rwlock_unlock(&e->lock);
+        pthread_mutex_lock(&s->lock);
+        s->bytes += bytes - e->bytes;
+        e->bytes = bytes;
+
+        if (!ok)
+            entry_unref(e, &dead);
+
+        set_evict(s, &dead);
+        pthread_mutex_unlock(&s->lock);
+
+        if (ok)
+            pthread_rwlock_rdlock(&e->lock);
+    }
+
+    close(fd);
+    entries_free(dead);
+
+    if (!ok)
+        return NULL;
+
+    if (hit)
+        FILES_ADD(&s->stats.hits, 1);
+
+    return e;
+}
+
+void file_set_put(struct file_set *s, struct file_entry *e)
+{
+    struct file_entry *dead = NULL;
+
+    pthread_rwlock_unlock(&e->lock);
+    pthread_mutex_lock(&s->lock);
+    entry_unref(e, &dead);
+    pthread_mutex_unlock(&s->lock);
+    entries_free(dead);
+}
+
+// forgets the file at path, returns 0 if it was not kept
+int file_set_drop(struct file_set *s, const char *path)
+{
+    struct file_entry *dead = NULL;
+
+    pthread_mutex_lock(&s->lock);
+
+    struct file_entry **link = entry_link(s, path);
+    struct file_entry *e = *link;
+
+    if (e)
+    {
+        *link = e->next;
+        s->count--;
+        s->bytes -= e->bytes;
+        entry_unref(e, &dead);
+    }
+
+    pthread_mutex_unlock(&s->lock);
+    entries_free(dead);
+    return e != NULL;
+}
+
+// id of the identifier name in the files interned so far, 0 if in none
+uint32_t file_set_name(struct file_set *s, String name)
+{
+    pthread_mutex_lock(&s->names_lock);
+
+    uint32_t id = names_find(s, name, 0);
+
+    pthread_mutex_unlock(&s->names_lock);
+    return id;
+}
+
+void file_list_add(struct file_list *l, const char *path)
+{
+    if (l->count == l->cap)
+    {
+        l->cap = l->cap ? l->cap * 2 : 64;
+        l->v = realloc(l->v, l->cap * sizeof(char *));
+
+        if (!l->v)
+            errx(1, "Could not list the input files");
+    }
+
+    if (!(l->v[l->count] = strdup(path)))
+        errx(1, "Could not list the input files");
+
+    l->count++;
+}
+
+void file_list_clear(struct file_list *l)
+{
+    for (size_t i = 0; i < l->count; i++)
+        free(l->v[i]);
+
+    l->count = 0;
+}
+
+void file_list_free(struct file_list *l)
+{
+    file_list_clear(l);
+    free(l->v);
+    l->v = NULL;
+    l->cap = 0;
+}
+
+int file_is_source(const char *name)
+{
+    size_t len = strlen(name);
+
+    return len > 2 && name[len - 2] == '.'
+        && (name[len - 1] == 'c' || name[len - 1] == 'h');
+}
+
+// dir/name, to free
+char *file_join(const char *dir, const char *name)
+{
+    size_t dlen = strlen(dir);
+    char *path = malloc(dlen + strlen(name) + 2);
+
+    if (!path)
+        errx(1, "Could not list the input files");
+
+    sprintf(path, "%s%s%s", dir, dlen && dir[dlen - 1] == '/' ? "" : "/",
+            name);
+    return path;
+}
+
+// adds the C sources and headers under dir, sorted by name so that the
+// output does not depend on the file system. Hidden entries and symbolic
+// links to directories are skipped. enter may be NULL. Returns 0 if a
+// directory could not be listed, which is warned about
+int file_list_dir(struct file_list *l, const char *dir, file_dir_fn enter,
+                  void *ctx)
+{
+    struct dirent **names;
+    int ok = 1;
+
+    if (enter && !enter(ctx, dir))
+        return 1;
+
+    int n = scandir(dir, &names, NULL, alphasort);
+
+    if (n < 0)
+    {
+        warn("%s", dir);
+        return 0;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        const char *name = names[i]->d_name;
+        char *path = file_join(dir, name);
+        struct stat st;
+
+        if (name[0] != '.' && !lstat(path, &st))
+        {
+            if (S_ISDIR(st.st_mode))
+                ok &= file_list_dir(l, path, enter, ctx);
+            else if (file_is_source(name) && (S_ISREG(st.st_mode)
+                                              || !stat(path, &st)))
+                file_list_add(l, path);
+        }
+
+        free(path);
+        free(names[i]);
+    }
+
+    free(names);
+    return ok;
+}
+
+// adds arg, the files under it if a directory, or what it matches if a
+// pattern. Exits if it names nothing to lex
+void file_list_arg(struct file_list *l, const char *arg)
+{
+    struct stat st;
+
+    if (!stat(arg, &st) && S_ISDIR(st.st_mode))
+    {
+        if (!file_list_dir(l, arg, NULL, NULL))
+            exit(1);
+        return;
+    }
+
+    // patterns the shell left alone, quoted or from a script
+    if (stat(arg, &st) && strpbrk(arg, "*?["))
+    {
+        glob_t g;
+
+        if (glob(arg, 0, NULL, &g))
+            errx(1, "%s: no match", arg);
+
+        for (size_t i = 0; i < g.gl_pathc; i++)
+        {
+            if (!stat(g.gl_pathv[i], &st) && S_ISDIR(st.st_mode))
+            {
+                if (!file_list_dir(l, g.gl_pathv[i], NULL, NULL))
+                    exit(1);
+            }
+            else
+                file_list_add(l, g.gl_pathv[i]);
+        }
+
+        globfree(&g);
+        return;
+    }
+
+    // errors are reported when the file gets read
+    file_list_add(l, arg);
+}
+
+double elapsed(const struct timespec *t0, const struct timespec *t1)
+{
+    return (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+#undef FILES_ADD
@@ -1,10 +1,19 @@
-#include <assert.h>
-#include <error.h>
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS, MAP_POPULATE
+
+#include <err.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BTH_ALLOC_IMPLEMENTATION
+#include "../include/bth_alloc.h"
+
+#define BTH_ARENA_IMPLEMENTATION
+#include "../include/bth_arena.h"
 
 #define BTH_LEX_IMPLEMENTATION
 #include "../include/bth_lex.h"
-typedef struct bth_lexer Lexer;
 
 #define BTH_OPTION_IMPLEMENTATION
 #include "../include/bth_option.h"
@@ -13,56 +22,172 @@ OPTION_TYPEDEF(size_t);
 #define BTH_IO_IMPLEMENTATION
 #include "../include/bth_io.h"
 
-#include "../include/bth_types.h"
+#define BTH_AIO_IMPLEMENTATION
+#include "../include/bth_aio.h"
+
+#define BTH_POOL_IMPLEMENTATION
+#include "../include/bth_pool.h"
+
+#define BTH_QUEUE_IMPLEMENTATION
+#include "../include/bth_queue.h"
+
+#include "../include/cache.h"
+#include "../include/driver.h"
+#include "../include/dump.h"
+#include "../include/memory.h"
 #include "../include/token.h"
 
-int main(void)
+static void usage(const char *prog)
+{
+    errx(2, "usage: %s [-a ALLOC] [-c DIR] [-d FORMAT] [-g] [-j JOBS] "
+         "[-l MIB] [-m] [-P]\n       [-p] [-q DEPTH] [-r] [-s] [-t] "
+         "FILE...\n"
+         "       %s -D SOCKET [-c DIR] [-g] [-j JOBS] [-l MIB] [-s] [-t]\n"
+         "       %s -S SOCKET [-d FORMAT | -n NAME] [-t] [FILE...]\n"
+         "       %s -w [-c DIR] [-d FORMAT] [-g] [-j JOBS] [-l MIB] [-s] [-t] "
+         "DIR...\n"
+         "  -a  allocate the tokens of a file from an arena, the heap or a "
+         "cache\n      per thread (default arena)\n"
+         "  -c  keep the tokens of the files in DIR, keyed by their content, "
+         "and\n      load them from there instead of lexing on later runs\n"
+         "  -D  serve requests on the Unix socket SOCKET until signaled, "
+         "keeping the\n      files, their tokens and identifiers in "
+         "memory across them\n"
+         "  -d  dump the tokens to the standard output as text, jsonl or "
+         "binary\n"
+         "  -g  use the lexer generated by tools/lexgen\n"
+         "  -j  lex on JOBS threads, splitting big files (default: one per "
+         "processor)\n"
+         "  -l  with -c, evict the least recently used entries past MIB "
+         "(default %zu)\n"
+         "  -m  count heap allocations, report them per token on stderr; "
+         "twice\n      traces each one too\n"
+         "  -n  with -S, print FILE:ROW:COL for each use of the identifier "
+         "NAME\n"
+         "  -P  pipeline loading, lexing and dumping, reporting each stage "
+         "with -t\n"
+         "  -p  prefault the mapped input instead of faulting it in lazily\n"
+         "  -q  with -j 1 or -P, read up to DEPTH files ahead (default %d)\n"
+         "  -r  with -j 1, read ahead with threads instead of io_uring\n"
+         "  -S  have the daemon at SOCKET lex, dump or query the files, or "
+         "report\n      on itself given none\n"
+         "  -s  skip trivia, folding it into the next significant token\n"
+         "  -t  report lexing throughput on stderr\n"
+         "  -w  lex the files under each DIR, then again the ones changed, "
+         "made or\n      removed as they are, until signaled\n"
+         "Directories are searched for .c and .h files and patterns are "
+         "expanded.\nTokens are dumped in the order of the files. A single "
+         "- streams the\nstandard input", prog, prog, prog, prog,
+         TOKEN_CACHE_LIMIT >> 20, BTH_AIO_DEPTH);
+}
+
+int main(int argc, char **argv)
 {
-#if CHECK_PREFIX_COLLISIONS
+    struct memory mem = {.base = bth_alloc_heap};
+    struct dump dump;
+    struct driver_options o = {
+        .next = bth_lex_get_token,
+        .cache_limit = TOKEN_CACHE_LIMIT,
+        .mem = &mem,
+    };
+    bool watching = false;
+    int counted = 0;
+    int opt;
+    enum dump_format format;
+    const char *serve_path = NULL;
+    const char *daemon_path = NULL;
+    const char *dump_name = NULL;
+    const char *query = NULL;
+
+    while ((opt = getopt(argc, argv, "a:c:D:d:gj:l:mn:Ppq:rS:stw")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            if (!alloc_mode_parse(optarg, &mem.mode))
+                usage(argv[0]);
+            break;
+        case 'c': o.cache_dir = optarg; break;
+        case 'D': serve_path = optarg; break;
+        case 'd':
+            if (!dump_format_parse(optarg, &format))
+                usage(argv[0]);
+            dump_name = optarg;
+            o.out = &dump;
+            break;
+        case 'g': o.next = lex_gen_get_token; break;
+        case 'j':
+            if (sscanf(optarg, "%u", &o.jobs) != 1 || !o.jobs)
+                usage(argv[0]);
+            break;
+        case 'l':
+            if (sscanf(optarg, "%zu", &o.cache_limit) != 1)
+                usage(argv[0]);
+            o.cache_limit <<= 20;
+            break;
+        case 'm': counted++; break;
+        case 'n': query = optarg; break;
+        case 'P': o.pipelined = true; break;
+        case 'p': o.populate = true; break;
+        case 'q':
+            if (sscanf(optarg, "%u", &o.depth) != 1 || !o.depth)
+                usage(argv[0]);
+            break;
+        case 'r': o.flags |= BTH_AIO_NO_URING; break;
+        case 'S': daemon_path = optarg; break;
+        case 's': o.skip = true; break;
+        case 't': o.timed = true; break;
+        case 'w': watching = true; break;
+        default: usage(argv[0]);
+        }
+    }
+
+    const char *const *args = (const char *const *)argv + optind;
+    size_t n = argc - optind;
+
+    if (daemon_path)
     {
-        size_t hay;
-        size_t sub;
+        if (serve_path || watching || (query && o.out))
+            usage(argv[0]);
 
-        if (check_prefix_collisions(&hay, &sub))
-            errx(1, "Collisions detected: idx(%s) > idx(%s)",
-                 KEYWORD_TABLE[hay*2+1], KEYWORD_TABLE[sub*2+1]);
+        driver_request(daemon_path, dump_name, query, args, n, o.timed);
+        return 0;
     }
-#endif
-
-    str buf;
-    OPTION(size_t) buflen = readfn(&buf, 0, "./samples/sample_1.c");
-    CHECK(buflen);
-    
-    Lexer lexer = {
-        .buffer = buf, .size = buflen.some,
-        .col = 1, .row = 1,
-        .cur = 0,
-        .symbols = KEYWORD_TABLE,
-        .symbols_count = KEYWORD_COUNT,
-        .delims = DELIM_TABLE,
-        .delims_count = DELIM_COUNT,
-    };
 
-    struct bth_lex_token *tokens = collect_tokens(&lexer);
+    if (query || (serve_path && watching) || (serve_path ? n : !n))
+        usage(argv[0]);
 
-#if PRINT_TOKENS
+    if (counted)
+        mem.base = bth_alloc_counting(&mem.counter, &bth_alloc_heap,
+                                      counted > 1 ? stderr : NULL);
+
+    if (o.out)
     {
-        size_t i = 0;
-        while (tokens[i].kind != LK_END)
-        {
-            size_t len = tokens[i].end - tokens[i].begin;
-            char *content = strndup(tokens[i].begin, len);
-            char *todisp = stresc(content);
-            free(content);
+        if (!dump_init(o.out, STDOUT_FILENO, format))
+            errx(1, "Could not allocate the dump");
+
+        dump_flush_at_exit(o.out);
+    }
 
-            printf("(bth_lex_token){name='%s', value='%s'}\n",
-                   tokens[i].name, todisp);
+    if (!o.jobs)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
 
-            free(todisp);
-            i++;
-        }
+        o.jobs = cpus > 0 ? cpus : 1;
     }
-#endif
-    
+
+    if (serve_path)
+        driver_serve(&o, serve_path);
+    else if (watching)
+        driver_watch(&o, args, n);
+    else
+        driver_lex(&o, args, n);
+
+    if (o.out)
+        dump_fini(o.out);
+
+    if (counted)
+        report_memory(&mem);
+
     return 0;
 }
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/bth_alloc.h"
+#include "../include/bth_arena.h"
+#include "../include/memory.h"
+
+int alloc_mode_parse(const char *name, enum alloc_mode *mode)
+{
+    if (!strcmp(name, "arena"))
+        *mode = ALLOC_ARENA;
+    else if (!strcmp(name, "heap"))
+        *mode = ALLOC_HEAP;
+    else if (!strcmp(name, "cache"))
+        *mode = ALLOC_CACHE;
+    else
+        return 0;
+
+    return 1;
+}
+
+const struct bth_allocator *worker_alloc(const struct memory *mem,
+                                         struct worker_memory *w)
+{
+    if (!w->alloc.alloc)
+        w->alloc = mem->mode == ALLOC_CACHE
+            ? bth_alloc_cache_init(&w->cache, &mem->base)
+            : mem->base;
+
+    return &w->alloc;
+}
+
+// once nothing it gave is still in use, from any thread
+void worker_memory_fini(const struct memory *mem, struct worker_memory *w)
+{
+    if (mem->mode == ALLOC_CACHE && w->alloc.alloc)
+        bth_alloc_cache_fini(&w->cache);
+}
+
+// the allocator for the tokens of a file lexed by the owner of a, out of
+// arena with ALLOC_ARENA
+struct bth_allocator tokens_alloc(const struct memory *mem,
+                                  const struct bth_allocator *a,
+                                  struct bth_arena *arena)
+{
+    if (mem->mode != ALLOC_ARENA)
+        return *a;
+
+    arena->alloc = *a;
+    return bth_arena_allocator(arena);
+}
+
+void report_memory(const struct memory *mem)
+{
+    const struct bth_alloc_stats *s = &mem->counter.stats;
+
+    fprintf(stderr, "%zu allocs, %zu reallocs, %zu frees for %zu tokens: "
+            "%.4f allocs per token, %zu bytes asked, %zu at peak, "
+            "%zu left\n",
+            s->allocs, s->reallocs, s->frees, mem->tokens,
+            mem->tokens ? (double)(s->allocs + s->reallocs) / mem->tokens
+                        : 0.,
+            s->bytes, s->peak, s->live);
+}
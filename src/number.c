@@ -0,0 +1,626 @@
+#include <err.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/number.h"
+#include "../include/number_pow10.h"
+
+// Numeric literals are lexed as C99 pp-numbers and converted in the same
+// pass: integers with eight digits at a time SWAR, floats with Clinger's
+// fast path then Eisel-Lemire, strtod being left for the rare inputs these
+// cannot decide (more than 19 significant digits, subnormals, halfway
+// cases).
+
+#define ISDIGIT(c) BTH_LEX_ISCLASS((c), BTH_LEX_CLASS_DIGIT)
+
+static const signed char HEX_VALUE[256] = {
+    ['0'] = 0,  ['1'] = 1,  ['2'] = 2,  ['3'] = 3,  ['4'] = 4,
+    ['5'] = 5,  ['6'] = 6,  ['7'] = 7,  ['8'] = 8,  ['9'] = 9,
+    ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+    ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+};
+
+#define ISHEX(c) (ISDIGIT(c) || (((c) | 0x20) >= 'a' && ((c) | 0x20) <= 'f'))
+
+static uint64_t load8(const char *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static int is_eight_digits(uint64_t v)
+{
+    return !(((v + 0x4646464646464646ULL) | (v - 0x3030303030303030ULL))
+             & 0x8080808080808080ULL);
+}
+
+static uint32_t parse_eight_digits(uint64_t v)
+{
+    v -= 0x3030303030303030ULL;
+    v = (v * 10) + (v >> 8);
+    v = (((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32)))
+         + (((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32))))
+        >> 32;
+    return (uint32_t)v;
+}
+
+static const char *skip_digits(const char *p, const char *e)
+{
+    while (e - p >= 8 && is_eight_digits(load8(p)))
+        p += 8;
+    while (p < e && ISDIGIT(*p))
+        p++;
+    return p;
+}
+
+// [p, e) holds at most 19 decimal digits
+static uint64_t parse_digits(const char *p, const char *e, uint64_t w)
+{
+    while (e - p >= 8)
+    {
+        w = w * 100000000 + parse_eight_digits(load8(p));
+        p += 8;
+    }
+    while (p < e)
+        w = w * 10 + (*p++ - '0');
+    return w;
+}
+
+// pp-number: a digit (or dot digit) then identifier characters, dots and
+// signs following an exponent letter
+static size_t scan_pp_number(const char *s, const char *end)
+{
+    const char *p = s + 1;
+
+    while (p < end)
+    {
+        char c = *p;
+
+        if (BTH_LEX_ISCLASS(c, BTH_LEX_CLASS_IDENT) || c == '.')
+            p++;
+        else if ((c == '+' || c == '-')
+                 && ((p[-1] | 0x20) == 'e' || (p[-1] | 0x20) == 'p'))
+            p++;
+        else
+            break;
+    }
+
+    return p - s;
+}
+
+// u, l, ll and their combinations, in any case but not lL
+static const char *parse_int_suffix(const char *p, const char *e,
+                                    unsigned *flags)
+{
+    if (p < e && (*p | 0x20) == 'u')
+    {
+        *flags |= NUM_UNSIGNED;
+        p++;
+    }
+
+    if (p < e && (*p | 0x20) == 'l')
+    {
+        if (p + 1 < e && p[1] == p[0])
+        {
+            *flags |= NUM_LONG_LONG;
+            p += 2;
+        }
+        else
+        {
+            *flags |= NUM_LONG;
+            p++;
+        }
+
+        if (!(*flags & NUM_UNSIGNED) && p < e && (*p | 0x20) == 'u')
+        {
+            *flags |= NUM_UNSIGNED;
+            p++;
+        }
+    }
+
+    return p;
+}
+
+static int parse_exponent(const char **pp, const char *e, int64_t *exp)
+{
+    const char *p = *pp + 1;
+    int neg = 0;
+    int64_t x = 0;
+
+    if (p < e && (*p == '+' || *p == '-'))
+        neg = *p++ == '-';
+
+    if (p >= e || !ISDIGIT(*p))
+        return 0;
+
+    for (; p < e && ISDIGIT(*p); p++)
+        if (x < 100000)
+            x = x * 10 + (*p - '0');
+
+    *exp = neg ? -x : x;
+    *pp = p;
+    return 1;
+}
+
+static uint64_t mul64(uint64_t a, uint64_t b, uint64_t *lo)
+{
+    unsigned __int128 r = (unsigned __int128)a * b;
+
+    *lo = (uint64_t)r;
+    return (uint64_t)(r >> 64);
+}
+
+// Eisel-Lemire: w * 10^q correctly rounded to a binary format with mbits
+// explicit mantissa bits and ebits exponent bits, 0 when undecided
+static int eisel_lemire(uint64_t w, int64_t q, int mbits, int ebits,
+                        uint64_t *bits)
+{
+    const int low = 64 - (mbits + 1) - 2;
+    const uint64_t lowmask = (1ULL << low) - 1;
+    const uint64_t bias = (1ULL << (ebits - 1)) - 1;
+
+    if (w == 0)
+    {
+        *bits = 0;
+        return 1;
+    }
+
+    if (q < POW10_MIN_EXP || q > POW10_MAX_EXP)
+        return 0;
+
+    int clz = __builtin_clzll(w);
+    w <<= clz;
+
+    uint64_t exp2 = (uint64_t)(((217706 * q) >> 16) + 64 + bias) - clz;
+    const uint64_t *pow = POW10_TABLE[q - POW10_MIN_EXP];
+    uint64_t xlo;
+    uint64_t xhi = mul64(w, pow[1], &xlo);
+
+    if ((xhi & lowmask) == lowmask && xlo + w < w)
+    {
+        uint64_t ylo;
+        uint64_t yhi = mul64(w, pow[0], &ylo);
+        uint64_t mhi = xhi;
+        uint64_t mlo = xlo + yhi;
+
+        if (mlo < xlo)
+            mhi++;
+
+        if ((mhi & lowmask) == lowmask && mlo + 1 == 0 && ylo + w < w)
+            return 0;
+
+        xhi = mhi;
+        xlo = mlo;
+    }
+
+    uint64_t msb = xhi >> 63;
+    uint64_t mant = xhi >> (msb + low);
+    exp2 -= 1 ^ msb;
+
+    // exactly halfway between two floats, let strtod break the tie
+    if (xlo == 0 && (xhi & lowmask) == 0 && (mant & 3) == 1)
+        return 0;
+
+    mant += mant & 1;
+    mant >>= 1;
+
+    if (mant >> (mbits + 1))
+    {
+        mant >>= 1;
+        exp2++;
+    }
+
+    // subnormals and overflows are left to strtod
+    if (exp2 - 1 >= (1ULL << ebits) - 2)
+        return 0;
+
+    *bits = exp2 << mbits | (mant & ((1ULL << mbits) - 1));
+    return 1;
+}
+
+static const double POW10_EXACT[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static int decimal_to_double(uint64_t w, int64_t q, double *d)
+{
+#if FLT_EVAL_METHOD == 0
+    // Clinger: both operands are exact, so is the rounding of the result
+    if (w <= (1ULL << 53) && q >= -22 && q <= 22)
+    {
+        *d = q < 0 ? (double)w / POW10_EXACT[-q] : (double)w * POW10_EXACT[q];
+        return 1;
+    }
+#endif
+
+    uint64_t bits;
+
+    if (!eisel_lemire(w, q, 52, 11, &bits))
+        return 0;
+
+    memcpy(d, &bits, sizeof(*d));
+    return 1;
+}
+
+static int decimal_to_float(uint64_t w, int64_t q, float *f)
+{
+#if FLT_EVAL_METHOD == 0
+    if (w <= (1ULL << 24) && q >= -10 && q <= 10)
+    {
+        float p = (float)POW10_EXACT[q < 0 ? -q : q];
+        *f = q < 0 ? (float)w / p : (float)w * p;
+        return 1;
+    }
+#endif
+
+    uint64_t bits;
+
+    if (!eisel_lemire(w, q, 23, 8, &bits))
+        return 0;
+
+    uint32_t b = (uint32_t)bits;
+    memcpy(f, &b, sizeof(*f));
+    return 1;
+}
+
+// literals short enough to be copied on the stack for libc
+#define NUMBER_COPY 64
+
+enum slow_kind
+{
+    SLOW_FLOAT,
+    SLOW_DOUBLE,
+    SLOW_LONG_DOUBLE,
+};
+
+// the literal s to e through strtof, strtod or strtold. They read as long
+// as a number could go on, past e or the end of an unpadded buffer, so they
+// get a NUL terminated copy
+static long double slow_parse(const char *s, const char *e,
+                              enum slow_kind kind)
+{
+    char buf[NUMBER_COPY];
+    size_t n = e - s;
+    char *c = n < sizeof(buf) ? buf : malloc(n + 1);
+    long double v;
+
+    if (!c)
+        errx(1, "Could not allocate a number");
+
+    memcpy(c, s, n);
+    c[n] = 0;
+
+    switch (kind)
+    {
+    case SLOW_FLOAT: v = strtof(c, NULL); break;
+    case SLOW_DOUBLE: v = strtod(c, NULL); break;
+    default: v = strtold(c, NULL); break;
+    }
+
+    if (c != buf)
+        free(c);
+
+    return v;
+}
+
+static double slow_double(const char *s, const char *e, int is_float)
+{
+    return (double)slow_parse(s, e, is_float ? SLOW_FLOAT : SLOW_DOUBLE);
+}
+
+static const char *parse_float_suffix(const char *p, const char *e,
+                                      struct bth_lex_token *t)
+{
+    t->id = TK_DOUBLE_CONST;
+
+    if (p < e && (*p | 0x20) == 'f')
+    {
+        t->id = TK_FLOAT_CONST;
+        p++;
+    }
+    else if (p < e && (*p | 0x20) == 'l')
+    {
+        t->flags |= NUM_LONG;
+        p++;
+    }
+
+    return p;
+}
+
+// decimal float: [int digits][.frac digits][e exp], one of . or e present
+static const char *parse_decimal_float(const char *s, const char *ie,
+                                       const char *e, struct bth_lex_token *t)
+{
+    const char *p = ie;
+    const char *fb = ie;
+    const char *fe = ie;
+    int64_t exp = 0;
+
+    if (p < e && *p == '.')
+    {
+        fb = ++p;
+        fe = p = skip_digits(p, e);
+    }
+
+    if (p < e && (*p | 0x20) == 'e' && !parse_exponent(&p, e, &exp))
+        return s;
+
+    const char *end = parse_float_suffix(p, e, t);
+
+    // significant digits: no leading zeros, no trailing fraction zeros
+    const char *ib = s;
+    while (ib < ie && *ib == '0')
+        ib++;
+    while (fe > fb && fe[-1] == '0')
+        fe--;
+    if (ib == ie)
+        while (fb < fe && *fb == '0')
+        {
+            fb++;
+            exp--;
+        }
+
+    size_t n = (ie - ib) + (fe - fb);
+    double d;
+
+    if (n <= 19)
+    {
+        uint64_t w = parse_digits(fb, fe, parse_digits(ib, ie, 0));
+        exp -= fe - fb;
+
+        if (t->id == TK_FLOAT_CONST)
+        {
+            float f;
+
+            if (decimal_to_float(w, exp, &f))
+            {
+                t->value.d = f;
+                return end;
+            }
+        }
+        else if (decimal_to_double(w, exp, &d))
+        {
+            t->value.d = d;
+            return end;
+        }
+    }
+
+    t->value.d = slow_double(s, end, t->id == TK_FLOAT_CONST);
+    return end;
+}
+
+// hexadecimal float: 0x[digits][.digits]p[exp], the binary exponent is
+// mandatory in C99
+static const char *parse_hex_float(const char *s, const char *p,
+                                   uint64_t m, int digits, const char *e,
+                                   struct bth_lex_token *t)
+{
+    int64_t exp = 0;
+    int64_t bexp;
+    int lost = digits > 16;
+
+    if (p < e && *p == '.')
+    {
+        for (p++; p < e && ISHEX(*p); p++)
+        {
+            if (m >> 60)
+            {
+                lost |= *p != '0';
+                continue;
+            }
+
+            m = m << 4 | HEX_VALUE[(unsigned char)*p];
+            exp -= 4;
+        }
+    }
+
+    if (p >= e || (*p | 0x20) != 'p' || !parse_exponent(&p, e, &bexp))
+        return s;
+
+    exp += bexp;
+
+    t->flags |= NUM_HEX;
+    p = parse_float_suffix(p, e, t);
+
+    int is_float = t->id == TK_FLOAT_CONST;
+
+    // ldexp only rounds once, so an exact mantissa gives a correct result
+    if (!lost && m <= (1ULL << (is_float ? 24 : 53)))
+        t->value.d = is_float ? (double)ldexpf((float)m, (int)exp)
+                              : ldexp((double)m, (int)exp);
+    else
+        t->value.d = slow_double(s, p, is_float);
+
+    return p;
+}
+
+static const char *parse_hex(const char *s, const char *e,
+                             struct bth_lex_token *t)
+{
+    const char *p = s + 2;
+    const char *db = p;
+    uint64_t m = 0;
+    int digits = 0;
+    int overflow = 0;
+
+    for (; p < e && ISHEX(*p); p++)
+    {
+        if (m >> 60)
+            overflow = 1;
+        else
+            m = m << 4 | HEX_VALUE[(unsigned char)*p];
+
+        if (m || digits)
+            digits++;
+    }
+
+    if (p < e && (*p == '.' || (*p | 0x20) == 'p'))
+        return parse_hex_float(s, p, m, digits, e, t);
+
+    if (p == db)
+        return s;
+
+    t->id = TK_INT_CONST;
+    t->flags |= NUM_HEX | (overflow ? NUM_OVERFLOW : 0);
+    t->value.u = overflow ? UINT64_MAX : m;
+
+    return parse_int_suffix(p, e, &t->flags);
+}
+
+static const char *parse_decimal(const char *s, const char *e,
+                                 struct bth_lex_token *t)
+{
+    const char *ie = skip_digits(s, e);
+
+    if (ie < e && (*ie == '.' || (*ie | 0x20) == 'e'))
+        return parse_decimal_float(s, ie, e, t);
+
+    t->id = TK_INT_CONST;
+
+    if (*s == '0')
+    {
+        uint64_t v = 0;
+
+        t->flags |= NUM_OCTAL;
+
+        for (const char *p = s + 1; p < ie; p++)
+        {
+            if (*p > '7')
+                return s;
+            if (v >> 61)
+                t->flags |= NUM_OVERFLOW;
+            v = v << 3 | (*p - '0');
+        }
+
+        t->value.u = t->flags & NUM_OVERFLOW ? UINT64_MAX : v;
+    }
+    else if (ie - s <= 19)
+        t->value.u = parse_digits(s, ie, 0);
+    else
+    {
+        uint64_t v = parse_digits(s, s + 19, 0);
+
+        for (const char *p = s + 19; p < ie; p++)
+        {
+            if (__builtin_mul_overflow(v, 10, &v)
+                || __builtin_add_overflow(v, (uint64_t)(*p - '0'), &v))
+            {
+                t->flags |= NUM_OVERFLOW;
+                v = UINT64_MAX;
+                break;
+            }
+        }
+
+        t->value.u = v;
+    }
+
+    return parse_int_suffix(ie, e, &t->flags);
+}
+
+size_t number_lex(const char *s, const char *end, struct bth_lex_token *t)
+{
+    size_t len = scan_pp_number(s, end);
+    const char *e = s + len;
+    const char *p;
+
+    if (len > 1 && s[0] == '0' && (s[1] | 0x20) == 'x')
+        p = parse_hex(s, e, t);
+    else if (s[0] == '.')
+        p = parse_decimal_float(s, s, e, t);
+    else
+        p = parse_decimal(s, e, t);
+
+    // still a single pp-number, but not a valid constant
+    if (p != e)
+        t->id = TK_UNKNOWN;
+
+    return len;
+}
+
+void token_value(struct bth_lexer *lex, const struct bth_lex_token *t,
+                 Value *v)
+{
+    size_t row = 0;
+    size_t col = 0;
+
+    memset(v, 0, sizeof(*v));
+    bth_lex_position(lex, t->begin - lex->buffer, &row, &col);
+    v->line = row;
+    v->column = col;
+
+    if (t->id == TK_FLOAT_CONST || t->id == TK_DOUBLE_CONST)
+    {
+        v->floating.hex_float = t->flags & NUM_HEX;
+
+        if (t->id == TK_FLOAT_CONST)
+        {
+            v->kind = VALUE_FLOAT;
+            v->floating.f = (float)t->value.d;
+        }
+        else if (t->flags & NUM_LONG)
+        {
+            // the token only holds the double rounding of the literal
+            v->kind = VALUE_LONGDOUBLE;
+            v->floating.ld = slow_parse(t->begin, t->end, SLOW_LONG_DOUBLE);
+        }
+        else
+        {
+            v->kind = VALUE_DOUBLE;
+            v->floating.d = t->value.d;
+        }
+
+        return;
+    }
+
+    // C99 6.4.4.1: first type of the list that can hold the value, the
+    // unsigned ones only for octal, hex or u-suffixed constants
+    static const struct
+    {
+        ValueKind kind;
+        unsigned long long max;
+        bool is_unsigned;
+    } types[] = {
+        {VALUE_INT, INT_MAX, false},
+        {VALUE_UINT, UINT_MAX, true},
+        {VALUE_LONG, LONG_MAX, false},
+        {VALUE_ULONG, ULONG_MAX, true},
+        {VALUE_LONGLONG, LLONG_MAX, false},
+        {VALUE_ULONGLONG, ULLONG_MAX, true},
+    };
+
+    unsigned long long u = t->value.u;
+    bool decimal = !(t->flags & (NUM_OCTAL | NUM_HEX));
+    bool uns = t->flags & NUM_UNSIGNED;
+    size_t i = t->flags & NUM_LONG_LONG ? 4 : t->flags & NUM_LONG ? 2 : 0;
+
+    for (; i < 5; i++)
+    {
+        if (types[i].is_unsigned ? !(uns || !decimal) : uns)
+            continue;
+        if (u <= types[i].max)
+            break;
+    }
+
+    v->kind = types[i].kind;
+    v->integer.is_unsigned = types[i].is_unsigned;
+    v->integer.base = decimal ? 10 : t->flags & NUM_HEX ? 16 : 8;
+
+    switch (v->kind)
+    {
+    case VALUE_INT: v->integer.i = (int)u; break;
+    case VALUE_UINT: v->integer.u = (unsigned)u; break;
+    case VALUE_LONG: v->integer.l = (long)u; break;
+    case VALUE_ULONG: v->integer.ul = (unsigned long)u; break;
+    case VALUE_LONGLONG: v->integer.ll = (long long)u; break;
+    default: v->integer.ull = u; break;
+    }
+}
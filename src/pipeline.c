@@ -0,0 +1,275 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../include/bth_aio.h"
+#include "../include/bth_arena.h"
+#include "../include/bth_io.h"
+#include "../include/bth_lex.h"
+#include "../include/bth_queue.h"
+#include "../include/cache.h"
+#include "../include/driver.h"
+#include "../include/dump.h"
+#include "../include/memory.h"
+#include "../include/pipeline.h"
+#include "../include/token.h"
+
+// a file on its way through the stages of lex_pipeline
+struct pipe_item
+{
+    size_t idx;
+    struct bth_io_map input;
+    struct bth_arena arena;
+    struct bth_lex_store tokens;
+    int error; // errno of a failed mapfn
+    int invalid; // lexing stopped on an INVALID token at row and col
+    size_t row;
+    size_t col;
+};
+
+// loading, lexing and dumping run at once on different files: a reader
+// thread maps them, lexer threads take them from loaded and hand them to
+// the main thread through lexed. The reader stays less than window files
+// ahead of the dump, which holds the early finishers back until their turn
+struct pipeline
+{
+    struct bth_lexer *lexers;
+    const struct memory *mem;
+    struct token_cache *cache;
+    bth_lex_fn next;
+    const char *const *paths;
+    size_t count;
+    int flags;
+    size_t window;
+    size_t dumped; // files dumped so far, written by the main thread only
+    struct bth_queue loaded;
+    struct bth_queue lexed;
+    unsigned long long read_ns;
+    unsigned long long held_ns; // reader waiting on the window
+};
+
+struct pipe_lexer
+{
+    struct pipeline *p;
+    struct bth_lexer *lexer;
+    struct worker_memory memory;
+    pthread_t thread;
+    unsigned long long busy_ns;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *pipe_read(void *arg)
+{
+    struct pipeline *p = arg;
+
+    for (size_t i = 0; i < p->count; i++)
+    {
+        unsigned long long t0 = now_ns();
+        unsigned spins = 0;
+
+        while (i >= __atomic_load_n(&p->dumped, __ATOMIC_ACQUIRE)
+                    + p->window)
+            bth_queue_pause(&spins);
+
+        if (spins)
+            p->held_ns += now_ns() - t0;
+
+        t0 = now_ns();
+        struct pipe_item *it = calloc(1, sizeof(*it));
+
+        if (!it)
+            errx(1, "Could not allocate the pipeline");
+
+        it->idx = i;
+        it->input.alloc = p->mem->base;
+
+        if (!mapfn(&it->input, p->paths[i], p->flags))
+            it->error = errno;
+
+        p->read_ns += now_ns() - t0;
+        bth_queue_put(&p->loaded, it);
+    }
+
+    bth_queue_done(&p->loaded);
+    return NULL;
+}
+
+static void *pipe_lex(void *arg)
+{
+    struct pipe_lexer *w = arg;
+    struct pipeline *p = w->p;
+    const struct bth_allocator *a = worker_alloc(p->mem, &w->memory);
+    void *data;
+
+    w->lexer->alloc = *a;
+
+    while (bth_queue_take(&p->loaded, &data))
+    {
+        struct pipe_item *it = data;
+
+        if (!it->error)
+        {
+            unsigned long long t0 = now_ns();
+            struct bth_allocator ta = tokens_alloc(p->mem, a, &it->arena);
+
+            bth_lex_reset(w->lexer, it->input.data, it->input.size);
+            w->lexer->filename = p->paths[it->idx];
+            w->lexer->padding = BTH_IO_PADDING;
+
+            if (!token_cache_lex(p->cache, w->lexer, p->next, &ta,
+                                 &it->tokens))
+            {
+                it->invalid = 1;
+                bth_lex_position(w->lexer, w->lexer->cur, &it->row,
+                                 &it->col);
+            }
+
+            w->busy_ns += now_ns() - t0;
+        }
+
+        bth_queue_put(&p->lexed, it);
+    }
+
+    bth_queue_done(&p->lexed);
+    return NULL;
+}
+
+static void print_stage(const char *name, const struct bth_queue *q)
+{
+    const struct bth_queue_stats *s = &q->stats;
+
+    fprintf(stderr, "  %-6s queue of %zu: %.1f queued on average, "
+            "%zu/%zu puts blocked %.3f ms, %zu/%zu takes starved %.3f ms\n",
+            name, q->mask + 1, s->takes ? (double)s->occupied / s->takes : 0.,
+            s->full, s->puts, s->put_wait_ns / 1e6, s->empty, s->takes,
+            s->take_wait_ns / 1e6);
+}
+
+// lexes the files of paths through the stages of a pipeline, jobs lexer
+// threads, and dumps them in list order
+void lex_pipeline(const struct driver_options *o, struct bth_lexer *lexer,
+                  const char *const *paths, size_t count, unsigned jobs,
+                  struct token_cache *cache)
+{
+    struct memory *mem = o->mem;
+    struct pipeline p = {
+        .lexers = malloc(jobs * sizeof(struct bth_lexer)),
+        .mem = mem,
+        .cache = cache,
+        .next = o->next,
+        .paths = paths,
+        .count = count,
+        .flags = o->populate ? BTH_IO_POPULATE : 0,
+        .window = o->depth ? o->depth : BTH_AIO_DEPTH,
+    };
+    struct pipe_lexer *workers = calloc(jobs, sizeof(*workers));
+    struct pipe_item **pending = calloc(p.window, sizeof(*pending));
+    pthread_t reader;
+    size_t bytes = 0;
+    unsigned long long dump_ns = 0;
+    unsigned long long t0 = now_ns();
+
+    if (!p.lexers || !workers || !pending
+        || !bth_queue_init(&p.loaded, p.window, 1)
+        || !bth_queue_init(&p.lexed, p.window, jobs))
+        errx(1, "Could not allocate the pipeline");
+
+    if (pthread_create(&reader, NULL, pipe_read, &p))
+        errx(1, "Could not start the pipeline");
+
+    for (unsigned i = 0; i < jobs; i++)
+    {
+        bth_lex_fork(p.lexers + i, lexer);
+        workers[i] = (struct pipe_lexer){.p = &p, .lexer = p.lexers + i};
+
+        if (pthread_create(&workers[i].thread, NULL, pipe_lex, workers + i))
+            errx(1, "Could not start the pipeline");
+    }
+
+    void *data;
+
+    // files come out of order, pending holds them until their turn
+    while (bth_queue_take(&p.lexed, &data))
+    {
+        struct pipe_item *it = data;
+
+        pending[it->idx % p.window] = it;
+
+        while (p.dumped < count && (it = pending[p.dumped % p.window])
+               && it->idx == p.dumped)
+        {
+            unsigned long long d0 = now_ns();
+
+            if (it->error)
+            {
+                errno = it->error;
+                err(1, "%s", paths[it->idx]);
+            }
+
+            if (it->invalid)
+                errx(1, "%s:%zu:%zu: INVALID", paths[it->idx], it->row,
+                     it->col);
+
+            bytes += it->input.size;
+            mem->tokens += it->tokens.count;
+            if (o->out)
+                dump_store(o->out, &it->tokens);
+
+            bth_lex_store_fini(&it->tokens);
+            bth_arena_fini(&it->arena);
+            unmapfn(&it->input);
+            pending[p.dumped % p.window] = NULL;
+            free(it);
+
+            dump_ns += now_ns() - d0;
+            __atomic_store_n(&p.dumped, p.dumped + 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    pthread_join(reader, NULL);
+
+    unsigned long long lex_ns = 0;
+
+    for (unsigned i = 0; i < jobs; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        lex_ns += workers[i].busy_ns;
+        bth_lex_fini(p.lexers + i);
+        worker_memory_fini(mem, &workers[i].memory);
+    }
+
+    if (o->timed)
+    {
+        double secs = (now_ns() - t0) / 1e9;
+
+        fprintf(stderr, "%zu files: %zu bytes in %.3f ms, %.1f MB/s "
+                "(%s lexer), pipelined over %u lexers\n"
+                "  read   busy %.3f ms, held %.3f ms by the dump\n"
+                "  lex    busy %.3f ms over all threads\n"
+                "  dump   busy %.3f ms\n",
+                count, bytes, secs * 1e3, bytes / secs / 1e6,
+                o->next == lex_gen_get_token ? "generated" : "table", jobs,
+                p.read_ns / 1e6, p.held_ns / 1e6, lex_ns / 1e6,
+                dump_ns / 1e6);
+        print_stage("loaded", &p.loaded);
+        print_stage("lexed", &p.lexed);
+    }
+
+    bth_queue_fini(&p.loaded);
+    bth_queue_fini(&p.lexed);
+    free(pending);
+    free(workers);
+    free(p.lexers);
+}
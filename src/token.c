@@ -1,124 +1,387 @@
+#include <pthread.h>
 #include <stddef.h>
 #include <stdbool.h>
 #include <string.h>
 #include "../include/bth_lex.h"
+#include "../include/bth_types.h"
+#include "../include/token.h"
+#include "../include/number.h"
 typedef struct bth_lexer Lexer;
 
-const char *KEYWORD_TABLE[] = {
-    // Keywords
-    "TK_DEFINE", "define",
-    "TK_INCLUDE", "include",
-    "TK_IFDEF", "ifdef",
-    "TK_IFNDEF", "ifndef",
-    "TK_ENDIF", "endif",
-    "TK_ELIF", "elif",
-    "TK_PRAGMA", "pragma",
-    "TK_ERROR", "error",
-    "TK_AUTO", "auto",
-    "TK_BREAK", "break",
-    "TK_CASE", "case",
-    "TK_CHAR", "char",
-    "TK_CONST", "const",
-    "TK_CONTINUE", "continue",
-    "TK_DEFAULT", "default",
-    "TK_DOUBLE", "double",
-    "TK_DO", "do",
-    "TK_ELSE", "else",
-    "TK_ENUM", "enum",
-    "TK_EXTERN", "extern",
-    "TK_FLOAT", "float",
-    "TK_FOR", "for",
-    "TK_GOTO", "goto",
-    "TK_IF", "if",
-    "TK_INLINE", "inline",
-    "TK_INT", "int",
-    "TK_LONG", "long",
-    "TK_REGISTER", "register",
-    "TK_RESTRICT", "restrict",
-    "TK_RETURN", "return",
-    "TK_SHORT", "short",
-    "TK_UNSIGNED", "unsigned",
-    "TK_SIGNED", "signed",
-    "TK_SIZEOF", "sizeof",
-    "TK_STATIC", "static",
-    "TK_STRUCT", "struct",
-    "TK_SWITCH", "switch",
-    "TK_TYPEDEF", "typedef",
-    "TK_UNION", "union",
-    "TK_VOID", "void",
-    "TK_VOLATILE", "volatile",
-    "TK_WHILE", "while",
-    "TK_LINE", "line",
+#define SYMBOL BTH_LEX_SYMBOL
+#define DELIM BTH_LEX_DELIM
 
+const struct bth_lex_entry KEYWORD_TABLE[] = {
     // Punctuators
-    "TK_SEMICOLON", ";",
-    "TK_LPAREN", "(",
-    "TK_RPAREN", ")",
-    "TK_LBRACE", "{",
-    "TK_RBRACE", "}",
-    "TK_LBRACKET", "[",
-    "TK_RBRACKET", "]",
-    "TK_COMMA", ",",
-    "TK_ELLIPSIS", "...",
+    SYMBOL(TK_SEMICOLON, ";"),
+    SYMBOL(TK_LPAREN, "("),
+    SYMBOL(TK_RPAREN, ")"),
+    SYMBOL(TK_LBRACE, "{"),
+    SYMBOL(TK_RBRACE, "}"),
+    SYMBOL(TK_LBRACKET, "["),
+    SYMBOL(TK_RBRACKET, "]"),
+    SYMBOL(TK_COMMA, ","),
+    SYMBOL(TK_ELLIPSIS, "..."),
     
     // Operators
-    "TK_LSHIFT_ASSIGN", "<<=",
-    "TK_RSHIFT_ASSIGN", ">>=",
-    "TK_INC", "++",
-    "TK_DEC", "--",
-    "TK_ARROW", "->",
-    "TK_LSHIFT", "<<",
-    "TK_RSHIFT", ">>",
-    "TK_LE", "<=",
-    "TK_GE", ">=",
-    "TK_EQ", "==",
-    "TK_NE", "!=",
-    "TK_AND_AND", "&&",
-    "TK_OR_OR", "||",
-    "TK_MUL_ASSIGN", "*=",
-    "TK_DIV_ASSIGN", "/=",
-    "TK_MOD_ASSIGN", "%=",
-    "TK_ADD_ASSIGN", "+=",
-    "TK_SUB_ASSIGN", "-=",
-    "TK_AND_ASSIGN", "&=",
-    "TK_XOR_ASSIGN", "^=",
-    "TK_OR_ASSIGN", "|=",
-
-    "TK_PLUS", "+",
-    "TK_MINUS", "-",
-    "TK_STAR", "*",
-    "TK_SLASH", "/",
-    "TK_PERCENT", "%",
-    "TK_DOT", ".",
-    "TK_AND", "&",
-    "TK_OR", "|",
-    "TK_TILDE", "~",
-    "TK_NOT", "!",
-    "TK_LT", "<",
-    "TK_GT", ">",
-    "TK_XOR", "^",
-    "TK_QUESTION", "?",
-    "TK_COLON", ":",
-    "TK_ASSIGN", "=",
+    SYMBOL(TK_LSHIFT_ASSIGN, "<<="),
+    SYMBOL(TK_RSHIFT_ASSIGN, ">>="),
+    SYMBOL(TK_INC, "++"),
+    SYMBOL(TK_DEC, "--"),
+    SYMBOL(TK_ARROW, "->"),
+    SYMBOL(TK_LSHIFT, "<<"),
+    SYMBOL(TK_RSHIFT, ">>"),
+    SYMBOL(TK_LE, "<="),
+    SYMBOL(TK_GE, ">="),
+    SYMBOL(TK_EQ, "=="),
+    SYMBOL(TK_NE, "!="),
+    SYMBOL(TK_AND_AND, "&&"),
+    SYMBOL(TK_OR_OR, "||"),
+    SYMBOL(TK_MUL_ASSIGN, "*="),
+    SYMBOL(TK_DIV_ASSIGN, "/="),
+    SYMBOL(TK_MOD_ASSIGN, "%="),
+    SYMBOL(TK_ADD_ASSIGN, "+="),
+    SYMBOL(TK_SUB_ASSIGN, "-="),
+    SYMBOL(TK_AND_ASSIGN, "&="),
+    SYMBOL(TK_XOR_ASSIGN, "^="),
+    SYMBOL(TK_OR_ASSIGN, "|="),
+
+    SYMBOL(TK_PLUS, "+"),
+    SYMBOL(TK_MINUS, "-"),
+    SYMBOL(TK_STAR, "*"),
+    SYMBOL(TK_SLASH, "/"),
+    SYMBOL(TK_PERCENT, "%"),
+    SYMBOL(TK_DOT, "."),
+    SYMBOL(TK_AND, "&"),
+    SYMBOL(TK_OR, "|"),
+    SYMBOL(TK_TILDE, "~"),
+    SYMBOL(TK_NOT, "!"),
+    SYMBOL(TK_LT, "<"),
+    SYMBOL(TK_GT, ">"),
+    SYMBOL(TK_XOR, "^"),
+    SYMBOL(TK_QUESTION, "?"),
+    SYMBOL(TK_COLON, ":"),
+    SYMBOL(TK_ASSIGN, "="),
 
     // Preprocessor
-    "TK_HASH_HASH", "##",
-    "TK_HASH", "#",
-    "TK_SPACE", " ",
-    "TK_NEWLINE", "\n",
-    "TK_ANTISLASH", "\\",
+    SYMBOL(TK_HASH_HASH, "##"),
+    SYMBOL(TK_HASH, "#"),
+    SYMBOL(TK_SPACE, " "),
+    SYMBOL(TK_SPACE, "\t"),
+    SYMBOL(TK_SPACE, "\v"),
+    SYMBOL(TK_SPACE, "\f"),
+    SYMBOL(TK_SPACE, "\r"),
+    SYMBOL(TK_NEWLINE, "\n"),
+    SYMBOL(TK_ANTISLASH, "\\"),
+};
+
+const size_t KEYWORD_COUNT = sizeof(KEYWORD_TABLE) / sizeof(*KEYWORD_TABLE);
+
+const struct bth_lex_entry DELIM_TABLE[] = {
+    DELIM(TK_STRING_LITERAL, "\"", "\""),
+    DELIM(TK_CHAR_CONST,     "\'", "\'"),
+    DELIM(TK_COMMENT,        "//", "\n"),
+    DELIM(TK_CPP_COMMENT,    "/*", "*/"),
 };
 
-const size_t KEYWORD_COUNT = sizeof(KEYWORD_TABLE) / (sizeof(char *) * 2);
+const size_t DELIM_COUNT = sizeof(DELIM_TABLE) / sizeof(*DELIM_TABLE);
+
+#define NAME(k) [k] = #k
+static const char *TOKEN_NAMES[] = {
+    NAME(TK_AUTO),
+    NAME(TK_BREAK),
+    NAME(TK_CASE),
+    NAME(TK_CHAR),
+    NAME(TK_CONST),
+    NAME(TK_CONTINUE),
+    NAME(TK_DEFAULT),
+    NAME(TK_DO),
+    NAME(TK_DOUBLE),
+    NAME(TK_ELSE),
+    NAME(TK_ENUM),
+    NAME(TK_EXTERN),
+    NAME(TK_FLOAT),
+    NAME(TK_FOR),
+    NAME(TK_GOTO),
+    NAME(TK_IF),
+    NAME(TK_INLINE),
+    NAME(TK_INT),
+    NAME(TK_LONG),
+    NAME(TK_REGISTER),
+    NAME(TK_RESTRICT),
+    NAME(TK_RETURN),
+    NAME(TK_SHORT),
+    NAME(TK_SIGNED),
+    NAME(TK_SIZEOF),
+    NAME(TK_STATIC),
+    NAME(TK_STRUCT),
+    NAME(TK_SWITCH),
+    NAME(TK_TYPEDEF),
+    NAME(TK_UNION),
+    NAME(TK_UNSIGNED),
+    NAME(TK_VOID),
+    NAME(TK_VOLATILE),
+    NAME(TK_WHILE),
+    NAME(TK_INT_CONST),
+    NAME(TK_FLOAT_CONST),
+    NAME(TK_DOUBLE_CONST),
+    NAME(TK_CHAR_CONST),
+    NAME(TK_STRING_LITERAL),
+    NAME(TK_IDENTIFIER),
+    NAME(TK_PLUS),
+    NAME(TK_MINUS),
+    NAME(TK_STAR),
+    NAME(TK_SLASH),
+    NAME(TK_PERCENT),
+    NAME(TK_INC),
+    NAME(TK_DEC),
+    NAME(TK_ARROW),
+    NAME(TK_DOT),
+    NAME(TK_AND),
+    NAME(TK_OR),
+    NAME(TK_TILDE),
+    NAME(TK_NOT),
+    NAME(TK_LSHIFT),
+    NAME(TK_RSHIFT),
+    NAME(TK_LT),
+    NAME(TK_GT),
+    NAME(TK_LE),
+    NAME(TK_GE),
+    NAME(TK_EQ),
+    NAME(TK_NE),
+    NAME(TK_XOR),
+    NAME(TK_AND_AND),
+    NAME(TK_OR_OR),
+    NAME(TK_QUESTION),
+    NAME(TK_COLON),
+    NAME(TK_ASSIGN),
+    NAME(TK_MUL_ASSIGN),
+    NAME(TK_DIV_ASSIGN),
+    NAME(TK_MOD_ASSIGN),
+    NAME(TK_ADD_ASSIGN),
+    NAME(TK_SUB_ASSIGN),
+    NAME(TK_LSHIFT_ASSIGN),
+    NAME(TK_RSHIFT_ASSIGN),
+    NAME(TK_AND_ASSIGN),
+    NAME(TK_XOR_ASSIGN),
+    NAME(TK_OR_ASSIGN),
+    NAME(TK_SEMICOLON),
+    NAME(TK_LPAREN),
+    NAME(TK_RPAREN),
+    NAME(TK_LBRACE),
+    NAME(TK_RBRACE),
+    NAME(TK_LBRACKET),
+    NAME(TK_RBRACKET),
+    NAME(TK_COMMA),
+    NAME(TK_ELLIPSIS),
+    NAME(TK_HASH),
+    NAME(TK_HASH_HASH),
+    NAME(TK_DEFINE),
+    NAME(TK_INCLUDE),
+    NAME(TK_IFDEF),
+    NAME(TK_IFNDEF),
+    NAME(TK_ENDIF),
+    NAME(TK_ELIF),
+    NAME(TK_PRAGMA),
+    NAME(TK_ERROR),
+    NAME(TK_LINE),
+    NAME(TK_COMMENT),
+    NAME(TK_CPP_COMMENT),
+    NAME(TK_NEWLINE),
+    NAME(TK_SPACE),
+    NAME(TK_ANTISLASH),
+    NAME(TK_EOF),
+};
+#undef NAME
+
+const char *token_kind2str(size_t kind)
+{
+    if (kind >= sizeof(TOKEN_NAMES) / sizeof(*TOKEN_NAMES))
+        return "TK_UNKNOWN";
+
+    return TOKEN_NAMES[kind];
+}
+
+// Identifiers are scanned as a whole run first and then looked up here, in
+// a table filled once from KEYWORD_WORDS at the slot each word hashes to
+// from its length, first, second and last characters. The hash is
+// collision free over this set: check_keywords fails the build of
+// tools/lexgen if an added keyword breaks that.
+#define KEYWORD_SLOTS 128
+#define KEYWORD_MAXLEN 8
+#define KEYWORD_HASH(len, c0, c1, cn) \
+    (((len) + 9 * (c0) + 13 * (c1) + 12 * (cn)) & (KEYWORD_SLOTS - 1))
+#define KEYWORD(k, w) {w, sizeof(w) - 1, k}
+
+struct keyword
+{
+    const char *word;
+    size_t len;
+    TokenKind kind;
+};
 
-const char *DELIM_TABLE[] = {
-    "TK_STRING_LITERAL", "\"", "\"",
-    "TK_CHAR_LITERAL",   "\'", "\'",
-    "TK_COMMENT",        "//", "\n",
-    "TK_CPP_COMMENT",    "/*", "*/",
+static const struct keyword KEYWORD_WORDS[] = {
+    KEYWORD(TK_DEFINE, "define"),
+    KEYWORD(TK_INCLUDE, "include"),
+    KEYWORD(TK_IFDEF, "ifdef"),
+    KEYWORD(TK_IFNDEF, "ifndef"),
+    KEYWORD(TK_ENDIF, "endif"),
+    KEYWORD(TK_ELIF, "elif"),
+    KEYWORD(TK_PRAGMA, "pragma"),
+    KEYWORD(TK_ERROR, "error"),
+    KEYWORD(TK_AUTO, "auto"),
+    KEYWORD(TK_BREAK, "break"),
+    KEYWORD(TK_CASE, "case"),
+    KEYWORD(TK_CHAR, "char"),
+    KEYWORD(TK_CONST, "const"),
+    KEYWORD(TK_CONTINUE, "continue"),
+    KEYWORD(TK_DEFAULT, "default"),
+    KEYWORD(TK_DOUBLE, "double"),
+    KEYWORD(TK_DO, "do"),
+    KEYWORD(TK_ELSE, "else"),
+    KEYWORD(TK_ENUM, "enum"),
+    KEYWORD(TK_EXTERN, "extern"),
+    KEYWORD(TK_FLOAT, "float"),
+    KEYWORD(TK_FOR, "for"),
+    KEYWORD(TK_GOTO, "goto"),
+    KEYWORD(TK_IF, "if"),
+    KEYWORD(TK_INLINE, "inline"),
+    KEYWORD(TK_INT, "int"),
+    KEYWORD(TK_LONG, "long"),
+    KEYWORD(TK_REGISTER, "register"),
+    KEYWORD(TK_RESTRICT, "restrict"),
+    KEYWORD(TK_RETURN, "return"),
+    KEYWORD(TK_SHORT, "short"),
+    KEYWORD(TK_UNSIGNED, "unsigned"),
+    KEYWORD(TK_SIGNED, "signed"),
+    KEYWORD(TK_SIZEOF, "sizeof"),
+    KEYWORD(TK_STATIC, "static"),
+    KEYWORD(TK_STRUCT, "struct"),
+    KEYWORD(TK_SWITCH, "switch"),
+    KEYWORD(TK_TYPEDEF, "typedef"),
+    KEYWORD(TK_UNION, "union"),
+    KEYWORD(TK_VOID, "void"),
+    KEYWORD(TK_VOLATILE, "volatile"),
+    KEYWORD(TK_WHILE, "while"),
+    KEYWORD(TK_LINE, "line"),
 };
 
-const size_t DELIM_COUNT = sizeof(DELIM_TABLE) / (sizeof(char *) * 3);
+static struct keyword KEYWORD_HASH_TABLE[KEYWORD_SLOTS];
+static pthread_once_t keyword_once = PTHREAD_ONCE_INIT;
+
+static size_t keyword_slot(const char *s, size_t len)
+{
+    return KEYWORD_HASH(len, (unsigned char)s[0], (unsigned char)s[1],
+                        (unsigned char)s[len - 1]);
+}
+
+static void keyword_fill(void)
+{
+    size_t n = sizeof(KEYWORD_WORDS) / sizeof(*KEYWORD_WORDS);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        const struct keyword *k = KEYWORD_WORDS + i;
+
+        KEYWORD_HASH_TABLE[keyword_slot(k->word, k->len)] = *k;
+    }
+}
+
+// the table is filled by token_lexer, before any lexer can call this
+int keyword_lookup(const char *s, size_t len, unsigned short *kind)
+{
+    if (len < 2 || len > KEYWORD_MAXLEN)
+        return 0;
+
+    const struct keyword *k = &KEYWORD_HASH_TABLE[keyword_slot(s, len)];
+
+    if (k->len != len || memcmp(k->word, s, len))
+        return 0;
+
+    *kind = k->kind;
+    return 1;
+}
+
+// checks that every keyword is found back by keyword_lookup, returns 1 and
+// the first that is not in *word otherwise
+int check_keywords(const char **word)
+{
+    size_t n = sizeof(KEYWORD_WORDS) / sizeof(*KEYWORD_WORDS);
+
+    pthread_once(&keyword_once, keyword_fill);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        const struct keyword *k = KEYWORD_WORDS + i;
+        unsigned short kind;
+
+        if (!keyword_lookup(k->word, k->len, &kind) || kind != k->kind)
+        {
+            *word = k->word;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// chains hash over each keyword and its kind from h. The words are not in
+// the tables a lexer is built from, so what keeps tokens across runs mixes
+// them in this way
+uint64_t keyword_hash(uint64_t h,
+                      uint64_t (*hash)(const void *data, size_t len,
+                                       uint64_t seed))
+{
+    size_t n = sizeof(KEYWORD_WORDS) / sizeof(*KEYWORD_WORDS);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        const struct keyword *k = KEYWORD_WORDS + i;
+        unsigned short kind = k->kind;
+
+        h = hash(&kind, sizeof(kind), h);
+        h = hash(k->word, k->len, h);
+    }
+
+    return h;
+}
+
+// blanks, line continuations and comments
+int token_is_trivia(const struct bth_lex_token *t)
+{
+    switch (t->id)
+    {
+    case TK_SPACE:
+    case TK_NEWLINE:
+    case TK_ANTISLASH:
+    case TK_COMMENT:
+    case TK_CPP_COMMENT:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+Lexer token_lexer(const char *buffer, size_t size)
+{
+    pthread_once(&keyword_once, keyword_fill);
+
+    return (Lexer){
+        .buffer = buffer, .size = size,
+        .cur = 0,
+        .symbols = KEYWORD_TABLE,
+        .symbols_count = KEYWORD_COUNT,
+        .delims = DELIM_TABLE,
+        .delims_count = DELIM_COUNT,
+        .ids = {
+            [INVALID] = TK_UNKNOWN,
+            [LK_END] = TK_EOF,
+            [LK_IDENT] = TK_IDENTIFIER,
+        },
+        .keyword = keyword_lookup,
+        .number = number_lex,
+    };
+}
 
 // checks if a substring of a symbol is placed before it in the table
 int check_prefix_collisions(size_t *h, size_t *s)
@@ -146,8 +409,8 @@ int check_prefix_collisions(size_t *h, size_t *s)
                 hidx ^= sidx;
             }
             
-            const char *hay = KEYWORD_TABLE[hidx*2+1];
-            const char *sub = KEYWORD_TABLE[sidx*2+1];
+            const char *hay = KEYWORD_TABLE[hidx].str;
+            const char *sub = KEYWORD_TABLE[sidx].str;
 
             if (!strncmp(hay, sub, strlen(sub)))
             {
@@ -162,44 +425,551 @@ int check_prefix_collisions(size_t *h, size_t *s)
     return 0;
 }
 
-struct bth_lex_token *collect_tokens(Lexer *lexer)
+static String stored_text(const struct bth_lex_store *s, size_t i)
 {
-    struct bth_lex_token *toks = malloc(0);
-    size_t c = 0;
-    struct bth_lex_token tok;
+    return str_slice(bth_lex_store_begin(s, i), bth_lex_store_end(s, i));
+}
 
-    do
+// exits on the INVALID token at off
+void report_invalid(Lexer *lexer, size_t off)
+{
+    size_t row = 0;
+    size_t col = 0;
+
+    bth_lex_position(lexer, off, &row, &col);
+
+    if (lexer->filename)
+        errx(1, "%s:%zu:%zu: INVALID", lexer->filename, row, col);
+
+    errx(1, "at %zu:%zu: INVALID", row, col);
+}
+
+// returns 0 for an INVALID token, which is not stored
+static int store_token(struct bth_lex_store *toks,
+                       const struct bth_lex_token *tok)
+{
+    switch (tok->kind)
+    {
+    case INVALID:
+        return 0;
+    case LK_END:
+    // FALLTHROUGH
+    case LK_IDENT:
+    // FALLTHROUGH
+    case LK_KEYWORD:
+    // FALLTHROUGH
+    case LK_NUMBER:
+    // FALLTHROUGH
+    case LK_SYMBOL:
+    // FALLTHROUGH
+    case LK_DELIMITED:
     {
-        tok = bth_lex_get_token(lexer);
+        size_t c = toks->count;
+        size_t len = tok->end - tok->begin;
 
-        switch (tok.kind)
+        // cheap array compares first, the text only for equal tokens
+        if (c > 0 && tok->id == toks->ids[c - 1]
+            && tok->kind == toks->kinds[c - 1]
+            && len == toks->lens[c - 1]
+            && str_eq(str_slice(tok->begin, tok->end),
+                      stored_text(toks, c - 1)))
         {
-        case INVALID:
-            errx(1, "at %zu:%zu: INVALID", tok.col, tok.row);
-            break;
-        case LK_END:
-        // FALLTHROUGH
-        case LK_IDENT:
-        // FALLTHROUGH
-        case LK_SYMBOL:
-        // FALLTHROUGH
-        case LK_DELIMITED:
-            if (c > 0 && tok.kind == toks[c - 1].kind
-                && !strncmp(tok.begin, toks[c - 1].begin, tok.end - tok.begin))
+            if (!bth_lex_store_repeat(toks, tok->end - toks->buffer))
+                errx(1, "Could not store tokens");
+        }
+        else if (!bth_lex_store_push(toks, tok))
+            errx(1, "Could not store tokens");
+        return 1;
+    }
+    default:
+        errx(1, "UNREACHABLE");
+    }
+}
+
+static void collect_token(Lexer *lexer, struct bth_lex_store *toks,
+                          const struct bth_lex_token *tok)
+{
+    if (!store_token(toks, tok))
+        report_invalid(lexer, tok->begin - lexer->buffer);
+}
+
+// fills toks like collect_tokens, but returns 0 on an INVALID token with
+// the lexer at it and nothing left to free, for callers that go on
+int lex_tokens(Lexer *lexer, bth_lex_fn next,
+               const struct bth_allocator *alloc, struct bth_lex_store *toks)
+{
+    struct bth_lex_token batch[64];
+    size_t n;
+
+    bth_lex_store_init(toks, lexer, alloc);
+
+    // C averages a token every 2 bytes, 3 once trivia is folded, so this
+    // is about the final size and saves the doublings on big inputs
+    if (!bth_lex_store_reserve(toks, lexer->size / (lexer->trivia ? 3 : 2)
+                                     + 1))
+        errx(1, "Could not store tokens");
+
+    do
+    {
+        n = bth_lex_get_tokens(lexer, next, batch, 64);
+
+        for (size_t i = 0; i < n; i++)
+            if (!store_token(toks, batch + i))
             {
-                toks[c - 1].repeat++;
+                lexer->cur = batch[i].begin - lexer->buffer;
+                bth_lex_store_fini(toks);
+                return 0;
             }
-            else
+    } while (batch[n - 1].kind != LK_END);
+
+    return 1;
+}
+
+// alloc may be NULL for the heap, the tokens live until bth_lex_store_fini
+struct bth_lex_store collect_tokens(Lexer *lexer, bth_lex_fn next,
+                                    const struct bth_allocator *alloc)
+{
+    struct bth_lex_store toks;
+
+    if (!lex_tokens(lexer, next, alloc, &toks))
+        report_invalid(lexer, lexer->cur);
+
+    return toks;
+}
+
+// splits buffer into at most n chunks of about target bytes, each but the
+// last ending after a newline. Returns how many there are
+size_t split_chunks(const char *buffer, size_t size, size_t target,
+                    struct token_chunk *chunks, size_t n)
+{
+    size_t count = 0;
+    size_t begin = 0;
+
+    while (begin < size && count < n)
+    {
+        size_t end = size;
+
+        if (count + 1 < n && size - begin > target)
+        {
+            const char *nl = memchr(buffer + begin + target, '\n',
+                                    size - begin - target);
+
+            end = nl ? (size_t)(nl - buffer) + 1 : size;
+        }
+
+        chunks[count++] = (struct token_chunk){.begin = begin, .end = end};
+        begin = end;
+    }
+
+    return count;
+}
+
+static int same_stored(const struct bth_lex_store *a, size_t i,
+                       const struct bth_lex_store *b, size_t j)
+{
+    return a->ids[i] == b->ids[j] && a->kinds[i] == b->kinds[j]
+        && a->lens[i] == b->lens[j]
+        && str_eq(stored_text(a, i), stored_text(b, j));
+}
+
+// lexes c as if nothing before it could change its tokens, from any
+// thread given a lexer of its own over the whole buffer. Tokens are lexed
+// while the lexer is still inside c, so the last one may run past its end.
+// Nothing is reported, an INVALID token only stops the chunk
+void collect_chunk(Lexer *lexer, bth_lex_fn next, struct token_chunk *c)
+{
+    struct bth_lex_store *toks = &c->tokens;
+    size_t cap = (c->end - c->begin) / (lexer->trivia ? 3 : 2) + 1;
+    struct bth_allocator arena = bth_arena_allocator(&c->arena);
+
+    bth_lex_store_init(toks, lexer, &arena);
+    c->starts = bth_arena_alloc(&c->arena, cap * sizeof(*c->starts));
+
+    if (!c->starts || !bth_lex_store_reserve(toks, cap))
+        errx(1, "Could not store tokens");
+
+    lexer->cur = c->begin;
+
+    // the last chunk goes on to LK_END
+    while (lexer->cur < c->end || c->end == lexer->size)
+    {
+        size_t start = lexer->cur;
+        struct bth_lex_token tok = next(lexer);
+
+        if (tok.kind == INVALID)
+        {
+            c->invalid = 1;
+            lexer->cur = start;
+            break;
+        }
+
+        size_t n = toks->count;
+        size_t len = tok.end - tok.begin;
+
+        if (n > 0 && tok.id == toks->ids[n - 1]
+            && tok.kind == toks->kinds[n - 1] && len == toks->lens[n - 1]
+            && str_eq(str_slice(tok.begin, tok.end), stored_text(toks, n - 1)))
+        {
+            if (!bth_lex_store_repeat(toks, tok.end - toks->buffer))
+                errx(1, "Could not store tokens");
+        }
+        else
+        {
+            if (n == cap)
             {
-                toks = realloc(toks, (c + 1) * sizeof(struct bth_lex_token));
-                toks[c] = tok;
-                c++;
+                c->starts = bth_arena_realloc(&c->arena, c->starts,
+                                              cap * sizeof(*c->starts),
+                                              2 * cap * sizeof(*c->starts));
+                cap *= 2;
+
+                if (!c->starts || !bth_lex_store_reserve(toks, cap))
+                    errx(1, "Could not store tokens");
             }
+
+            c->starts[n] = start;
+
+            if (!bth_lex_store_push(toks, &tok))
+                errx(1, "Could not store tokens");
+        }
+
+        if (tok.kind == LK_END)
+        {
+            c->ended = 1;
             break;
-        default:
-            errx(1, "UNREACHABLE");
         }
-    } while (tok.kind != LK_END);
+    }
+
+    c->exit = lexer->cur;
+}
+
+// index of the token of c lexed from off, if any
+static int chunk_find(const struct token_chunk *c, size_t off, size_t *k)
+{
+    size_t lo = 0;
+    size_t hi = c->tokens.count;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (c->starts[mid] < off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *k = lo;
+    return lo < c->tokens.count && c->starts[lo] == off;
+}
+
+// lexes one token from off into toks, returns where the next one starts
+static size_t relex_token(Lexer *lexer, bth_lex_fn next,
+                          struct bth_lex_store *toks, size_t off, int *end)
+{
+    lexer->cur = off;
+
+    struct bth_lex_token tok = next(lexer);
+
+    collect_token(lexer, toks, &tok);
+    *end = tok.kind == LK_END;
+
+    return lexer->cur;
+}
+
+// joins the chunks of the buffer of lexer, in order, into the tokens a
+// single collect_tokens would give. The lexer only depends on where it
+// starts, so the tokens of a chunk are right from the first one lexed from
+// where the serial lexing reaches: until then it lexes again from where
+// the previous chunk stopped, which only costs more than a token when the
+// chunk started inside a comment or a literal
+struct bth_lex_store stitch_chunks(Lexer *lexer, bth_lex_fn next,
+                                   struct token_chunk *chunks, size_t n,
+                                   const struct bth_allocator *alloc)
+{
+    struct bth_lex_store toks;
+    size_t total = 1;
+    size_t off = 0;
+    int end = 0;
+
+    for (size_t i = 0; i < n; i++)
+        total += chunks[i].tokens.count;
+
+    bth_lex_store_init(&toks, lexer, alloc);
+
+    if (!bth_lex_store_reserve(&toks, total))
+        errx(1, "Could not store tokens");
+
+    for (size_t i = 0; i < n && !end; i++)
+    {
+        struct token_chunk *c = chunks + i;
+        size_t k;
+
+        while (!chunk_find(c, off, &k) && !end
+               && (off < c->end || i + 1 == n))
+            off = relex_token(lexer, next, &toks, off, &end);
+
+        if (end || !chunk_find(c, off, &k))
+            continue;
+
+        int merge = toks.count > 0
+            && same_stored(&toks, toks.count - 1, &c->tokens, k);
+
+        if (!bth_lex_store_append(&toks, &c->tokens, k, merge))
+            errx(1, "Could not store tokens");
+
+        end = c->ended;
+        off = c->exit;
+    }
+
+    // the last chunk stopped on an INVALID token, which reports it
+    while (!end)
+        off = relex_token(lexer, next, &toks, off, &end);
 
     return toks;
 }
+
+// bytes past its end the lexer may read to end a token: the longest
+// symbol, or a pp-number looking at what follows it
+#define RELEX_LOOKAHEAD 16
+
+static size_t stored_end(const struct bth_lex_store *s, size_t i)
+{
+    return (size_t)s->offsets[i] + s->lens[i];
+}
+
+// first token from lo on ending at off or after
+static size_t find_end(const struct bth_lex_store *s, size_t lo, size_t off)
+{
+    size_t hi = s->count;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (stored_end(s, mid) < off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// whether closer shows up in buffer between from and to, unescaped if
+// quote, with its escapes from from on
+static int find_closer(const char *buffer, size_t from, size_t to,
+                       const struct bth_lex_entry *d, int quote)
+{
+    const char *p = buffer + from;
+    const char *end = buffer + to;
+
+    while ((p = memchr(p, d->close[0], end - p)))
+    {
+        if ((size_t)(end - p) < d->close_len)
+            return 0;
+
+        if (!memcmp(p, d->close, d->close_len)
+            && !(quote && (p == buffer + from || p[-1] == BTH_LEX_ESCAPE)))
+            return 1;
+
+        p++;
+    }
+
+    return 0;
+}
+
+// an opener closed nowhere up to the end of the buffer is lexed as
+// symbols, so a closer brought by the edit may turn one far before it into
+// a delimited token. Not if the rest of the buffer already had a closer the
+// opener would have found
+static int edit_may_close(const Lexer *lexer, const struct token_edit *e)
+{
+    size_t after = e->begin + e->len;
+
+    for (size_t i = 0; i < lexer->delims_count; i++)
+    {
+        const struct bth_lex_entry *d = lexer->delims + i;
+        size_t n = d->close_len;
+        size_t lo = e->begin > n ? e->begin - n + 1 : 0;
+        size_t hi = after + n - 1 < lexer->size ? after + n - 1 : lexer->size;
+        int quote = d->len == n && !memcmp(d->str, d->close, n);
+
+        if (find_closer(lexer->buffer, lo, hi, d, 0)
+            && !find_closer(lexer->buffer, after, lexer->size, d, quote))
+            return 1;
+    }
+
+    return 0;
+}
+
+// replaces the tokens a to b of toks by those of mid, then shifts the
+// offsets of the ones after by delta
+static void splice_tokens(struct bth_lex_store *toks, size_t a, size_t b,
+                          const struct bth_lex_store *mid, ptrdiff_t delta)
+{
+    size_t n = toks->count - b;
+    size_t at = a + mid->count;
+    size_t ra = 0;
+    size_t rb;
+
+    // edits one after the other should not copy the whole store each
+    if (at + n > toks->cap
+        && !bth_lex_store_reserve(toks, at + n > 2 * toks->cap
+                                            ? at + n : 2 * toks->cap))
+        errx(1, "Could not store tokens");
+
+    memmove(toks->kinds + at, toks->kinds + b, n);
+    memmove(toks->ids + at, toks->ids + b, n * sizeof(*toks->ids));
+    memmove(toks->offsets + at, toks->offsets + b,
+            n * sizeof(*toks->offsets));
+    memmove(toks->lens + at, toks->lens + b, n * sizeof(*toks->lens));
+
+    // mid has no arrays yet when nothing was lexed
+    if (mid->count)
+    {
+        memcpy(toks->kinds + a, mid->kinds, mid->count);
+        memcpy(toks->ids + a, mid->ids, mid->count * sizeof(*toks->ids));
+        memcpy(toks->offsets + a, mid->offsets,
+               mid->count * sizeof(*toks->offsets));
+        memcpy(toks->lens + a, mid->lens, mid->count * sizeof(*toks->lens));
+    }
+
+    // offsets wrap around like the sizes they are computed from
+    for (size_t i = at; i < at + n; i++)
+        toks->offsets[i] += (uint32_t)delta;
+
+    while (ra < toks->repeats_count && toks->repeats[ra].idx < a)
+        ra++;
+
+    for (rb = ra; rb < toks->repeats_count && toks->repeats[rb].idx < b;)
+        rb++;
+
+    size_t rn = toks->repeats_count - rb;
+
+    size_t rcap = ra + mid->repeats_count + rn;
+
+    if (rcap > toks->repeats_cap
+        && !bth_lex_store_reserve_repeats(toks, rcap > 2 * toks->repeats_cap
+                                                    ? rcap
+                                                    : 2 * toks->repeats_cap))
+        errx(1, "Could not store tokens");
+
+    if (rn)
+        memmove(toks->repeats + ra + mid->repeats_count, toks->repeats + rb,
+                rn * sizeof(*toks->repeats));
+
+    for (size_t i = 0; i < mid->repeats_count; i++)
+        toks->repeats[ra + i] = (struct bth_lex_repeat){
+            mid->repeats[i].idx + a, mid->repeats[i].count,
+            mid->repeats[i].end};
+
+    for (size_t i = ra + mid->repeats_count;
+         i < ra + mid->repeats_count + rn; i++)
+    {
+        toks->repeats[i].idx = toks->repeats[i].idx + at - b;
+        toks->repeats[i].end += (uint32_t)delta;
+    }
+
+    toks->count = at + n;
+    toks->repeats_count = ra + mid->repeats_count + rn;
+}
+
+// brings toks, the tokens collect_tokens gave for a buffer, up to date with
+// e applied to it, the lexer being over the new buffer and the old one not
+// needed anymore. Lexing starts again from the last token the edit cannot
+// reach and stops once it gets back to where an old token after the edit
+// was lexed from, moved by the edit: the lexer only depends on where it
+// starts, so the tokens from there on are the old ones, shifted. Only the
+// tokens that do not repeat tell where the next one was lexed from, the
+// repeats having folded whatever trivia came between them. Stores in
+// *lexed, unless NULL, how many tokens were lexed: none for an edit the
+// old tokens already fit, all of them when the edit closes a delimiter
+// left open. Returns 0 on an INVALID token, with toks as it was and the
+// lexer at the token
+int relex_tokens(Lexer *lexer, bth_lex_fn next, struct bth_lex_store *toks,
+                 const struct token_edit *e, size_t *lexed)
+{
+    ptrdiff_t delta = (ptrdiff_t)e->len - (ptrdiff_t)(e->end - e->begin);
+    size_t keep = 0;
+    size_t count = 0;
+    struct bth_lex_store mid;
+
+    if (lexer->size > UINT32_MAX)
+        errx(1, "Could not store tokens");
+
+    if (e->begin > RELEX_LOOKAHEAD && !edit_may_close(lexer, e))
+        keep = find_end(toks, 0, e->begin - RELEX_LOOKAHEAD + 1);
+
+    while (keep > 0 && bth_lex_store_repeats(toks, keep - 1))
+        keep--;
+
+    // the last kept token goes through mid, where the first token lexed
+    // may repeat it
+    size_t a = keep ? keep - 1 : 0;
+    size_t b = toks->count;
+    size_t sync = find_end(toks, keep, e->end);
+
+    bth_lex_store_init(&mid, lexer, NULL);
+
+    if (!bth_lex_store_append_range(&mid, toks, a, keep, 0))
+        errx(1, "Could not store tokens");
+
+    lexer->cur = keep ? stored_end(toks, a) : 0;
+
+    for (;;)
+    {
+        // next old token that may be lexed from where the lexer is
+        while (sync + 1 < toks->count
+               && ((size_t)(stored_end(toks, sync) + delta) < lexer->cur
+                   || bth_lex_store_repeats(toks, sync)))
+            sync++;
+
+        if (sync + 1 < toks->count
+            && (size_t)(stored_end(toks, sync) + delta) == lexer->cur)
+        {
+            b = sync + 1;
+            break;
+        }
+
+        struct bth_lex_token tok = next(lexer);
+
+        if (!store_token(&mid, &tok))
+        {
+            lexer->cur = tok.begin - lexer->buffer;
+            bth_lex_store_fini(&mid);
+            return 0;
+        }
+
+        count++;
+
+        if (tok.kind == LK_END)
+            break;
+    }
+
+    // the first old token kept may repeat the last one lexed, if any: an
+    // edit at the very start may resync before lexing anything
+    if (mid.count && b < toks->count
+        && toks->ids[b] == mid.ids[mid.count - 1]
+        && toks->kinds[b] == mid.kinds[mid.count - 1]
+        && toks->lens[b] == mid.lens[mid.count - 1]
+        && str_eq(stored_text(&mid, mid.count - 1),
+                  str_view(lexer->buffer + toks->offsets[b] + delta,
+                           toks->lens[b])))
+    {
+        if (!bth_lex_store_append_range(&mid, toks, b, b + 1, 1))
+            errx(1, "Could not store tokens");
+
+        // the end of its occurrences moves with the edit
+        mid.repeats[mid.repeats_count - 1].end += (uint32_t)delta;
+        b++;
+    }
+
+    toks->buffer = lexer->buffer;
+    splice_tokens(toks, a, b, &mid, delta);
+    bth_lex_store_fini(&mid);
+
+    if (lexed)
+        *lexed = count;
+
+    return 1;
+}
@@ -0,0 +1,533 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/bth_pool.h"
+#include "../include/dump.h"
+#include "../include/files.h"
+#include "../include/watch.h"
+
+// a directory event names the file it is about, the file events are only
+// noted: what became of the file is asked of the file system once the
+// burst is over, so that a write, rename and delete in a row costs one stat
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE \
+                      | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF \
+                      | IN_MOVE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK)
+
+struct watch
+{
+    int fd; // inotify
+    struct file_set *files;
+    unsigned jobs;
+    struct dump *out;
+    bool timed;
+    const char *const *roots;
+    size_t roots_count;
+    char **dirs; // path of each watch descriptor, NULL for the ones gone
+    size_t dirs_cap;
+    size_t watched;
+    struct file_list known;   // files lexed, sorted for the removal of a tree
+    struct file_list changed; // since the last batch, in any order
+    int rescan;          // events were lost, everything is looked at again
+};
+
+struct watch_result
+{
+    size_t bytes;
+    size_t tokens;
+    char *error; // NULL if the file was lexed
+};
+
+struct watch_job
+{
+    struct watch *w;
+    char *const *paths;
+    struct watch_result *results;
+};
+
+static int path_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// index of path in the sorted l, or of where it would go
+static size_t list_find(const struct file_list *l, const char *path)
+{
+    size_t lo = 0;
+    size_t hi = l->count;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (strcmp(l->v[mid], path) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static void known_add(struct watch *w, const char *path)
+{
+    struct file_list *l = &w->known;
+    size_t i = list_find(l, path);
+
+    if (i < l->count && !strcmp(l->v[i], path))
+        return;
+
+    file_list_add(l, path);
+
+    char *p = l->v[l->count - 1];
+
+    memmove(l->v + i + 1, l->v + i, (l->count - 1 - i) * sizeof(char *));
+    l->v[i] = p;
+}
+
+static void known_remove(struct watch *w, const char *path)
+{
+    struct file_list *l = &w->known;
+    size_t i = list_find(l, path);
+
+    if (i == l->count || strcmp(l->v[i], path))
+        return;
+
+    free(l->v[i]);
+    memmove(l->v + i, l->v + i + 1, (l->count - i - 1) * sizeof(char *));
+    l->count--;
+}
+
+// whether path is dir or under it
+static bool is_under(const char *path, const char *dir)
+{
+    size_t len = strlen(dir);
+
+    return !strncmp(path, dir, len)
+        && (!path[len] || path[len] == '/' || (len && dir[len - 1] == '/'));
+}
+
+// watches dir before it is listed, so that no file made in between goes
+// unnoticed
+static int watch_enter(void *ctx, const char *dir)
+{
+    struct watch *w = ctx;
+    int wd = inotify_add_watch(w->fd, dir, WATCH_EVENTS);
+
+    if (wd < 0)
+    {
+        // a directory gone already, or out of watches
+        if (errno != ENOENT && errno != ENOTDIR)
+            warn("%s", dir);
+        return 0;
+    }
+
+    if ((size_t)wd >= w->dirs_cap)
+    {
+        size_t cap = w->dirs_cap ? w->dirs_cap : 64;
+
+        while (cap <= (size_t)wd)
+            cap *= 2;
+
+        if (!(w->dirs = realloc(w->dirs, cap * sizeof(char *))))
+            errx(1, "Could not list the watched directories");
+
+        memset(w->dirs + w->dirs_cap, 0,
+               (cap - w->dirs_cap) * sizeof(char *));
+        w->dirs_cap = cap;
+    }
+
+    // a directory watched again, as after lost events
+    if (w->dirs[wd])
+        free(w->dirs[wd]);
+    else
+        w->watched++;
+
+    if (!(w->dirs[wd] = strdup(dir)))
+        errx(1, "Could not list the watched directories");
+
+    return 1;
+}
+
+// watches dir and the directories under it, adding their C sources and
+// headers to found in the order of a plain run
+static void watch_dir(struct watch *w, const char *dir,
+                      struct file_list *found)
+{
+    file_list_dir(found, dir, watch_enter, w);
+}
+
+// stops watching dir and the directories under it, their files to be
+// looked at with the next batch
+static void forget_dir(struct watch *w, const char *dir)
+{
+    for (size_t wd = 0; wd < w->dirs_cap; wd++)
+    {
+        if (w->dirs[wd] && is_under(w->dirs[wd], dir))
+        {
+            inotify_rm_watch(w->fd, wd);
+            free(w->dirs[wd]);
+            w->dirs[wd] = NULL;
+            w->watched--;
+        }
+    }
+
+    // the ones with the prefix follow each other in the sorted list
+    char *prefix = file_join(dir, "");
+    size_t len = strlen(prefix);
+
+    for (size_t i = list_find(&w->known, prefix); i < w->known.count
+         && !strncmp(w->known.v[i], prefix, len); i++)
+        file_list_add(&w->changed, w->known.v[i]);
+
+    free(prefix);
+}
+
+static void watch_event(struct watch *w, const struct inotify_event *ev)
+{
+    if (ev->mask & IN_Q_OVERFLOW)
+    {
+        w->rescan = 1;
+        return;
+    }
+
+    if (ev->wd < 0 || (size_t)ev->wd >= w->dirs_cap || !w->dirs[ev->wd])
+        return;
+
+    const char *dir = w->dirs[ev->wd];
+
+    if (ev->mask & IN_IGNORED)
+    {
+        free(w->dirs[ev->wd]);
+        w->dirs[ev->wd] = NULL;
+        w->watched--;
+        return;
+    }
+
+    // gone with no event from a parent, as a root
+    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+    {
+        char *path = strdup(dir);
+
+        if (!path)
+            errx(1, "Could not list the watched directories");
+
+        forget_dir(w, path);
+        free(path);
+        return;
+    }
+
+    if (!ev->len || ev->name[0] == '.')
+        return;
+
+    char *path = file_join(dir, ev->name);
+
+    if (!(ev->mask & IN_ISDIR))
+    {
+        if (file_is_source(ev->name))
+            file_list_add(&w->changed, path);
+    }
+    else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+        forget_dir(w, path);
+    else if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+        watch_dir(w, path, &w->changed);
+
+    free(path);
+}
+
+static void watch_task(void *ctx, unsigned worker, size_t i)
+{
+    struct watch_job *job = ctx;
+    struct watch_result *r = job->results + i;
+    char error[4096];
+    struct file_entry *e = file_set_get(job->w->files, job->paths[i], 0,
+                                        error, sizeof(error));
+
+    (void)worker;
+
+    if (!e)
+    {
+        if (!(r->error = strdup(error)))
+            errx(1, "Could not allocate the results");
+        return;
+    }
+
+    r->bytes = e->size;
+    r->tokens = e->tokens.count;
+    file_set_put(job->w->files, e);
+}
+
+// brings the files of paths up to date in the set on the workers, then
+// dumps them in list order. Returns the tokens they hold
+static size_t watch_lex(struct watch *w, char *const *paths, size_t count,
+                        size_t *bytes)
+{
+    struct watch_job job = {.w = w, .paths = paths};
+    struct bth_pool pool;
+    size_t tokens = 0;
+
+    if (!count)
+        return 0;
+
+    if (!(job.results = calloc(count, sizeof(struct watch_result))))
+        errx(1, "Could not allocate the results");
+
+    if (!bth_pool_start(&pool, w->jobs < count ? w->jobs : count, count,
+                        watch_task, &job))
+        errx(1, "Could not start the workers");
+
+    bth_pool_join(&pool);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        struct watch_result *r = job.results + i;
+        char error[4096];
+
+        known_add(w, paths[i]);
+
+        // a broken file is reported and watched on until fixed
+        if (r->error)
+        {
+            warnx("%s", r->error);
+            free(r->error);
+            continue;
+        }
+
+        *bytes += r->bytes;
+        tokens += r->tokens;
+
+        if (!w->out)
+            continue;
+
+        // a hit, unless it changed once more since
+        struct file_entry *e = file_set_get(w->files, paths[i], 0, error,
+                                            sizeof(error));
+
+        if (!e)
+        {
+            warnx("%s", error);
+            continue;
+        }
+
+        dump_store(w->out, &e->tokens);
+        file_set_put(w->files, e);
+    }
+
+    if (w->out)
+        dump_flush(w->out);
+
+    free(job.results);
+    return tokens;
+}
+
+// lexes the files changed since the last batch and forgets the ones gone
+static void watch_batch(struct watch *w)
+{
+    struct file_set_stats before, after;
+    struct timespec t0, t1;
+    struct file_list *c = &w->changed;
+    size_t lexed = 0;
+    size_t gone = 0;
+    size_t bytes = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    if (w->rescan)
+    {
+        for (size_t i = 0; i < w->roots_count; i++)
+            watch_dir(w, w->roots[i], c);
+
+        for (size_t i = 0; i < w->known.count; i++)
+            file_list_add(c, w->known.v[i]);
+
+        w->rescan = 0;
+    }
+
+    qsort(c->v, c->count, sizeof(char *), path_cmp);
+
+    for (size_t i = 0; i < c->count; i++)
+    {
+        struct stat st;
+
+        if (lexed && !strcmp(c->v[lexed - 1], c->v[i]))
+            free(c->v[i]);
+        else if (!stat(c->v[i], &st) && S_ISREG(st.st_mode))
+            c->v[lexed++] = c->v[i];
+        else
+        {
+            gone += file_set_drop(w->files, c->v[i]);
+            known_remove(w, c->v[i]);
+            free(c->v[i]);
+        }
+    }
+
+    c->count = lexed;
+
+    pthread_mutex_lock(&w->files->lock);
+    before = w->files->stats;
+    pthread_mutex_unlock(&w->files->lock);
+
+    size_t tokens = watch_lex(w, c->v, c->count, &bytes);
+
+    pthread_mutex_lock(&w->files->lock);
+    after = w->files->stats;
+    pthread_mutex_unlock(&w->files->lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (w->timed && (lexed || gone))
+        fprintf(stderr, "%zu changed, %zu gone: %zu tokens in %.3f ms "
+                "(%zu relexed, %zu lexed, %zu touched)\n", lexed, gone,
+                tokens, elapsed(&t0, &t1) * 1e3,
+                after.relexed - before.relexed, after.lexed - before.lexed,
+                after.touched - before.touched);
+
+    file_list_clear(c);
+}
+
+// milliseconds left before the batch begun at t0 is due, -1 without one
+static int watch_timeout(const struct watch *w, const struct timespec *t0)
+{
+    struct timespec now;
+
+    if (!w->changed.count && !w->rescan)
+        return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    int left = WATCH_HOLD - (int)(elapsed(t0, &now) * 1e3);
+
+    return left < 0 ? 0 : left < WATCH_QUIET ? left : WATCH_QUIET;
+}
+
+// lexes the C sources and headers under dirs, then again each one that
+// changes, until SIGINT, SIGTERM or SIGHUP. The files stay in the set, so
+// that a change is lexed again around what differs only
+void watch_files(const char *const *dirs, size_t n, struct file_set *files,
+                 unsigned jobs, struct dump *out, bool timed)
+{
+    struct watch w = {
+        .files = files,
+        .jobs = jobs,
+        .out = out,
+        .timed = timed,
+        .roots = dirs,
+        .roots_count = n,
+    };
+    struct timespec t0, t1;
+    sigset_t stop, old;
+    size_t bytes = 0;
+    int sig;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        struct stat st;
+
+        if (stat(dirs[i], &st))
+            err(1, "%s", dirs[i]);
+
+        if (!S_ISDIR(st.st_mode))
+            errx(1, "%s: %s", dirs[i], strerror(ENOTDIR));
+    }
+
+    // the workers inherit the mask, the signals come to sig
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    sigaddset(&stop, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &stop, &old);
+
+    if ((w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0
+        || (sig = signalfd(-1, &stop, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+        err(1, "Could not watch the files");
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    for (size_t i = 0; i < n; i++)
+        watch_dir(&w, dirs[i], &w.changed);
+
+    size_t tokens = watch_lex(&w, w.changed.v, w.changed.count, &bytes);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (timed)
+        fprintf(stderr, "%zu files: %zu bytes, %zu tokens in %.3f ms, "
+                "%zu directories watched\n", w.changed.count, bytes, tokens,
+                elapsed(&t0, &t1) * 1e3, w.watched);
+
+    file_list_clear(&w.changed);
+
+    struct pollfd fds[2] = {{.fd = w.fd, .events = POLLIN},
+                            {.fd = sig, .events = POLLIN}};
+    char buf[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;)
+    {
+        int ready = poll(fds, 2, watch_timeout(&w, &t0));
+
+        if (ready < 0 && errno == EINTR)
+            continue;
+
+        if (ready < 0)
+            err(1, "Could not watch the files");
+
+        if (fds[1].revents)
+            break;
+
+        // quiet long enough, or the burst was held too long already
+        if (!fds[0].revents || !watch_timeout(&w, &t0))
+        {
+            if (w.changed.count || w.rescan)
+                watch_batch(&w);
+
+            if (!fds[0].revents)
+                continue;
+        }
+
+        bool idle = !w.changed.count && !w.rescan;
+        ssize_t len = read(w.fd, buf, sizeof(buf));
+
+        if (len < 0 && errno != EAGAIN && errno != EINTR)
+            err(1, "Could not watch the files");
+
+        for (ssize_t at = 0; at < len;)
+        {
+            const struct inotify_event *ev = (void *)(buf + at);
+
+            watch_event(&w, ev);
+            at += sizeof(*ev) + ev->len;
+        }
+
+        // the first event of a burst
+        if (idle)
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+    }
+
+    if (timed)
+        fprintf(stderr, "%zu files kept, %zu directories watched\n",
+                files->count, w.watched);
+
+    close(sig);
+    close(w.fd);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    file_list_free(&w.known);
+    file_list_free(&w.changed);
+
+    for (size_t i = 0; i < w.dirs_cap; i++)
+        free(w.dirs[i]);
+    free(w.dirs);
+}
@@ -0,0 +1,53 @@
+#!/bin/sh
+# daemon: edits a file between requests to cbtc -D, checking that each
+# dump is what a plain run gives and that the daemon lives on. Cutting the
+# head of a file is lexed again from offset 0, resyncing at once
+#
+# usage: tests/daemon.sh CBTC
+
+cbtc=${1:-./cbtc}
+dir=$(mktemp -d)
+pid=
+
+fail()
+{
+    echo "daemon: $*" >&2
+    [ -n "$pid" ] && kill "$pid" 2>/dev/null
+    rm -rf "$dir"
+    exit 1
+}
+
+# edits the file with the sed script $1 and checks its dump
+check()
+{
+    [ -n "$1" ] && sed -i "$1" "$dir/a.c"
+    "$cbtc" -S "$dir/sock" -d text "$dir/a.c" > "$dir/got" 2> "$dir/err" \
+        || fail "request failed after ${1:-loading}: $(cat "$dir/err")"
+    kill -0 "$pid" 2>/dev/null || fail "died after ${1:-loading}"
+    "$cbtc" -d text "$dir/a.c" > "$dir/want"
+    cmp -s "$dir/got" "$dir/want" || fail "wrong dump after ${1:-loading}"
+}
+
+printf 'int x;\nreturn x;\nint y = 1;\n/* end */\n' > "$dir/a.c"
+
+"$cbtc" -D "$dir/sock" 2> "$dir/log" &
+pid=$!
+
+i=0
+
+while [ ! -S "$dir/sock" ]; do
+    i=$((i + 1))
+    [ $i -gt 100 ] && fail "no socket"
+    sleep 0.05
+done
+
+check ''
+check 's/y = 1/y = 2/'
+check '1d'
+check '1d'
+check '1i int w;'
+
+kill "$pid"
+wait "$pid" 2>/dev/null
+rm -rf "$dir"
+echo "daemon: ok"
@@ -0,0 +1,209 @@
+// relex: random edits of a file, each relexed with relex_tokens and checked
+// against collect_tokens over the edited buffer, with and without trivia
+// folding and with both lexers. A quarter of the edits start at offset 0
+// and some delete whole lines, as when the head of a file is cut
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BTH_ALLOC_IMPLEMENTATION
+#include "../include/bth_alloc.h"
+
+#define BTH_ARENA_IMPLEMENTATION
+#include "../include/bth_arena.h"
+
+#define BTH_LEX_IMPLEMENTATION
+#include "../include/bth_lex.h"
+
+#include "../include/token.h"
+
+#define RELEX_EDITS 4000
+#define RELEX_PADDING 64
+
+static const char *const SNIPPETS[] = {
+    "", "/*", "*/", "\"", "'", "x", "1", "1e", "+", "=", "...", ".", "\n",
+    " ", "//", "<<", "a b", "))", "\\\n", "0x1p+3", "int x;\n", ";;",
+};
+
+#define SNIPPET_COUNT (sizeof(SNIPPETS) / sizeof(*SNIPPETS))
+
+static int same_store(const struct bth_lex_store *a,
+                      const struct bth_lex_store *b)
+{
+    if (a->count != b->count || a->repeats_count != b->repeats_count)
+        return 0;
+
+    for (size_t i = 0; i < a->count; i++)
+        if (a->kinds[i] != b->kinds[i] || a->ids[i] != b->ids[i]
+            || a->offsets[i] != b->offsets[i] || a->lens[i] != b->lens[i])
+            return 0;
+
+    for (size_t i = 0; i < a->repeats_count; i++)
+        if (a->repeats[i].idx != b->repeats[i].idx
+            || a->repeats[i].count != b->repeats[i].count
+            || a->repeats[i].end != b->repeats[i].end)
+            return 0;
+
+    return 1;
+}
+
+static char *padded(const char *data, size_t size)
+{
+    char *p = calloc(size + RELEX_PADDING, 1);
+
+    if (!p)
+    {
+        fprintf(stderr, "relex: out of memory\n");
+        exit(1);
+    }
+
+    memcpy(p, data, size);
+    return p;
+}
+
+// applies e, inserting text, to a copy of buf, relexes toks for it and
+// compares them with a full lexing. Returns 0 on a mismatch, leaves buf
+// and toks as they were if the edit makes the input invalid
+static int check_edit(struct bth_lexer *lexer, bth_lex_fn next, char **buf,
+                      size_t *size, struct bth_lex_store *toks,
+                      const struct token_edit *e, const char *text)
+{
+    size_t n = *size - (e->end - e->begin) + e->len;
+    char *nb = calloc(n + RELEX_PADDING, 1);
+    struct bth_lex_store full;
+
+    if (!nb)
+    {
+        fprintf(stderr, "relex: out of memory\n");
+        exit(1);
+    }
+
+    memcpy(nb, *buf, e->begin);
+    memcpy(nb + e->begin, text, e->len);
+    memcpy(nb + e->begin + e->len, *buf + e->end, *size - e->end);
+
+    bth_lex_reset(lexer, nb, n);
+
+    if (!lex_tokens(lexer, next, NULL, &full))
+    {
+        bth_lex_reset(lexer, *buf, *size);
+        free(nb);
+        return 1;
+    }
+
+    bth_lex_reset(lexer, nb, n);
+
+    // the new buffer is valid, nothing lexed can be INVALID
+    int ok = relex_tokens(lexer, next, toks, e, NULL)
+        && same_store(toks, &full);
+
+    if (!ok)
+        fprintf(stderr, "relex: edit {%zu, %zu, %zu} inserting \"%s\" gave "
+                "%zu tokens instead of %zu\n", e->begin, e->end, e->len,
+                text, toks->count, full.count);
+
+    bth_lex_store_fini(&full);
+    free(*buf);
+    *buf = nb;
+    *size = n;
+    return ok;
+}
+
+static struct token_edit random_edit(const char *buf, size_t size,
+                                     const char *text)
+{
+    struct token_edit e = {.begin = rand() % 4 ? rand() % (size + 1) : 0};
+
+    e.end = e.begin + rand() % 4;
+
+    // a whole line at times, up to its newline
+    if (!(rand() % 8))
+        for (e.end = e.begin; e.end < size && buf[e.end++] != '\n';)
+            ;
+
+    if (e.end > size)
+        e.end = size;
+
+    e.len = strlen(text);
+    return e;
+}
+
+static int check_mode(const char *data, size_t size, int folded,
+                      bth_lex_fn next)
+{
+    char *buf = padded(data, size);
+    struct bth_lexer lexer = token_lexer(buf, size);
+    struct bth_lex_store toks;
+    int ok = 1;
+
+    lexer.trivia = folded ? token_is_trivia : NULL;
+    lexer.padding = RELEX_PADDING;
+
+    if (!bth_lex_init(&lexer))
+    {
+        fprintf(stderr, "relex: could not build lexer tables\n");
+        exit(1);
+    }
+
+    toks = collect_tokens(&lexer, next, NULL);
+
+    // the first line cut, resyncing before any token is lexed
+    const char *nl = memchr(buf, '\n', size);
+
+    if (nl)
+    {
+        struct token_edit e = {0, nl + 1 - buf, 0};
+
+        ok = check_edit(&lexer, next, &buf, &size, &toks, &e, "");
+    }
+
+    for (int i = 0; ok && i < RELEX_EDITS; i++)
+    {
+        const char *text = SNIPPETS[rand() % SNIPPET_COUNT];
+        struct token_edit e = random_edit(buf, size, text);
+
+        ok = check_edit(&lexer, next, &buf, &size, &toks, &e, text);
+    }
+
+    bth_lex_store_fini(&toks);
+    bth_lex_fini(&lexer);
+    free(buf);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : "samples/sample_1.c";
+    FILE *f = fopen(path, "rb");
+    static char data[1 << 20];
+    size_t size;
+    int ok = 1;
+
+    if (!f)
+    {
+        perror(path);
+        return 1;
+    }
+
+    size = fread(data, 1, sizeof(data), f);
+    fclose(f);
+
+    // the crash this guards against: "int x;\n" cut from the head
+    ok &= check_mode("int x;\nreturn x;\n", 17, 0, bth_lex_get_token);
+    ok &= check_mode("int x;\nreturn x;\n", 17, 1, bth_lex_get_token);
+
+    for (int folded = 0; folded < 2; folded++)
+    {
+        srand(42 + folded);
+        ok &= check_mode(data, size, folded, bth_lex_get_token);
+        srand(42 + folded);
+        ok &= check_mode(data, size, folded, lex_gen_get_token);
+    }
+
+    if (!ok)
+        return 1;
+
+    printf("relex: ok\n");
+    return 0;
+}
@@ -0,0 +1,127 @@
+// store: the tokens bth_lex_store_get rebuilds from a store against those
+// the lexer gave, folding trivia. A token after a run of repeats has for
+// trivia only what follows the last of them, not the run itself
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BTH_ALLOC_IMPLEMENTATION
+#include "../include/bth_alloc.h"
+
+#define BTH_ARENA_IMPLEMENTATION
+#include "../include/bth_arena.h"
+
+#define BTH_LEX_IMPLEMENTATION
+#include "../include/bth_lex.h"
+
+#include "../include/token.h"
+
+#define STORE_PADDING 64
+
+static const char *const INPUTS[] = {
+    "x;\n;y",
+    "x;;;\ny",
+    "a a\na /* */ a b",
+    "f(x)\n\n)) // c\n)\n;",
+    "\n\nint x;\n",
+};
+
+#define INPUT_COUNT (sizeof(INPUTS) / sizeof(*INPUTS))
+
+// lexes input twice, once into a store, checking each token the store
+// gives back has the trivia and flags of its first occurrence
+static int check_input(const char *input, bth_lex_fn next)
+{
+    size_t size = strlen(input);
+    char *buf = calloc(size + STORE_PADDING, 1);
+    struct bth_lex_store toks;
+    int ok = 1;
+
+    if (!buf)
+    {
+        fprintf(stderr, "store: out of memory\n");
+        exit(1);
+    }
+
+    memcpy(buf, input, size);
+
+    struct bth_lexer lexer = token_lexer(buf, size);
+
+    lexer.trivia = token_is_trivia;
+    lexer.padding = STORE_PADDING;
+
+    if (!bth_lex_init(&lexer))
+    {
+        fprintf(stderr, "store: could not build lexer tables\n");
+        exit(1);
+    }
+
+    toks = collect_tokens(&lexer, next, NULL);
+    bth_lex_reset(&lexer, buf, size);
+
+    size_t i = 0;
+    struct bth_lex_token prev = {0};
+
+    for (;;)
+    {
+        struct bth_lex_token tok = next(&lexer);
+
+        // repeats are stored once, with the first occurrence
+        if (i > 0 && tok.id == prev.id && tok.kind == prev.kind
+            && tok.end - tok.begin == prev.end - prev.begin
+            && !memcmp(tok.begin, prev.begin, tok.end - tok.begin))
+        {
+            prev = tok;
+            continue;
+        }
+
+        if (i == toks.count)
+        {
+            fprintf(stderr, "store: \"%s\" has more tokens than stored\n",
+                    input);
+            ok = 0;
+            break;
+        }
+
+        struct bth_lex_token got = bth_lex_store_get(&toks, i);
+
+        if (got.begin != tok.begin || got.end != tok.end
+            || got.trivia != tok.trivia || got.flags != tok.flags)
+        {
+            fprintf(stderr, "store: \"%s\" token %zu has trivia at %td "
+                    "and flags %u instead of %td and %u\n", input, i,
+                    got.trivia - buf, got.flags, tok.trivia - buf,
+                    tok.flags);
+            ok = 0;
+        }
+
+        i++;
+        prev = tok;
+
+        if (tok.kind == LK_END)
+            break;
+    }
+
+    bth_lex_store_fini(&toks);
+    bth_lex_fini(&lexer);
+    free(buf);
+    return ok;
+}
+
+int main(void)
+{
+    int ok = 1;
+
+    for (size_t i = 0; i < INPUT_COUNT; i++)
+    {
+        ok &= check_input(INPUTS[i], bth_lex_get_token);
+        ok &= check_input(INPUTS[i], lex_gen_get_token);
+    }
+
+    if (!ok)
+        return 1;
+
+    printf("store: ok\n");
+    return 0;
+}
@@ -0,0 +1,67 @@
+#!/bin/sh
+# watch: edits files under cbtc -w, checking that each is dumped again as
+# a plain run would dump it and that the watcher lives on. Cutting the
+# head of a file is lexed again from offset 0, resyncing at once
+#
+# usage: tests/watch.sh CBTC
+
+cbtc=${1:-./cbtc}
+dir=$(mktemp -d)
+pid=
+
+fail()
+{
+    echo "watch: $*" >&2
+    [ -n "$pid" ] && kill "$pid" 2>/dev/null
+    rm -rf "$dir"
+    exit 1
+}
+
+# waits for the dump to grow past $1 bytes
+grown()
+{
+    i=0
+
+    while [ "$(wc -c < "$dir/out")" -le "$1" ]; do
+        i=$((i + 1))
+        [ $i -gt 100 ] && fail "no dump after $2"
+        sleep 0.05
+    done
+
+    # the rest of the batch
+    sleep 0.1
+}
+
+# edits the file with the sed script $1 and checks its dump
+check()
+{
+    size=$(wc -c < "$dir/out")
+
+    sed -i "$1" "$dir/src/a.c"
+    grown "$size" "$1"
+    kill -0 "$pid" 2>/dev/null || fail "died after $1"
+    tail -c +$((size + 1)) "$dir/out" > "$dir/got"
+    "$cbtc" -d text "$dir/src/a.c" > "$dir/want"
+    cmp -s "$dir/got" "$dir/want" || fail "wrong dump after $1"
+}
+
+mkdir "$dir/src"
+printf 'int x;\nreturn x;\nint y = 1;\n/* end */\n' > "$dir/src/a.c"
+printf 'int z;\n' > "$dir/src/b.h"
+
+"$cbtc" -w -d text "$dir/src" > "$dir/out" 2> "$dir/err" &
+pid=$!
+
+grown 0 "the first pass"
+"$cbtc" -d text "$dir/src" > "$dir/want"
+cmp -s "$dir/out" "$dir/want" || fail "wrong first pass"
+
+check 's/y = 1/y = 2/'
+check '1d'
+check '1d'
+check '1i int w;'
+
+kill "$pid"
+wait "$pid" 2>/dev/null
+rm -rf "$dir"
+echo "watch: ok"
@@ -0,0 +1,202 @@
+// lexgen: compiles KEYWORD_TABLE and DELIM_TABLE into a direct-coded lexer.
+//
+// The tries bth_lex_init would build at runtime are walked once here and
+// printed as nested switches on the input bytes, so the generated
+// lex_gen_get_token does no table lookups. It produces the same tokens as
+// bth_lex_get_token and the build fails if the symbol table has prefix
+// collisions or a keyword is not found back by keyword_lookup.
+
+#include <stdio.h>
+
+#define BTH_ALLOC_IMPLEMENTATION
+#include "../include/bth_alloc.h"
+
+#define BTH_ARENA_IMPLEMENTATION
+#include "../include/bth_arena.h"
+
+#define BTH_LEX_IMPLEMENTATION
+#include "../include/bth_lex.h"
+#include "../include/token.h"
+
+static void emit_byte(FILE *f, unsigned char c)
+{
+    if (c >= 0x20 && c < 0x7f && c != '\'' && c != '\\')
+        fprintf(f, "'%c'", c);
+    else
+        fprintf(f, "0x%02x", c);
+}
+
+// prints the match of the trie below node, depth bytes being matched so
+// far; var receives the lowest table entry prefixing the input
+static void emit_node(FILE *f, const struct bth_lex_trie *trie, size_t node,
+                      size_t depth, size_t best, const char *var, int ind)
+{
+    const struct bth_lex_trie_node *n = trie->nodes + node;
+
+    if (n->idx < best)
+    {
+        best = n->idx;
+        fprintf(f, "%*s%s = %zu;\n", ind, "", var, best);
+    }
+
+    if (!n->child)
+        return;
+
+    fprintf(f, "%*sif (p + %zu < end)\n", ind, "", depth);
+    fprintf(f, "%*sswitch ((unsigned char)p[%zu])\n", ind + 4, "", depth);
+    fprintf(f, "%*s{\n", ind + 4, "");
+
+    for (size_t c = n->child; c; c = trie->nodes[c].next)
+    {
+        fprintf(f, "%*scase ", ind + 4, "");
+        emit_byte(f, trie->nodes[c].byte);
+        fprintf(f, ":\n");
+        emit_node(f, trie, c, depth + 1, best, var, ind + 8);
+        fprintf(f, "%*sbreak;\n", ind + 8, "");
+    }
+
+    fprintf(f, "%*s}\n", ind + 4, "");
+}
+
+static void emit(FILE *f, const struct bth_lexer *lex)
+{
+    const struct bth_lex_trie *st = lex->symbols_trie;
+    const struct bth_lex_trie *dt = lex->delims_trie;
+
+    fprintf(f,
+        "// Generated by tools/lexgen from src/token.c, do not edit.\n"
+        "\n"
+        "#include \"../include/bth_lex.h\"\n"
+        "#include \"../include/token.h\"\n"
+        "\n"
+        "static struct bth_lex_token get_raw_token(struct bth_lexer *lex)\n"
+        "{\n"
+        "    struct bth_lex_token tok = {\n"
+        "        .kind = INVALID,\n"
+        "        .id = lex->ids[INVALID],\n"
+        "        .trivia = lex->buffer + lex->cur,\n"
+        "        .begin = lex->buffer + lex->cur,\n"
+        "    };\n"
+        "    const char *p = lex->buffer + lex->cur;\n"
+        "    const char *end = lex->buffer + lex->size;\n"
+        "    size_t d = BTH_LEX_NOMATCH;\n"
+        "    size_t s = BTH_LEX_NOMATCH;\n"
+        "\n"
+        "    if (p >= end)\n"
+        "    {\n"
+        "        tok.kind = LK_END;\n"
+        "        tok.id = lex->ids[LK_END];\n"
+        "        tok.begin = end;\n"
+        "        tok.end = end;\n"
+        "        return tok;\n"
+        "    }\n"
+        "\n"
+        "    switch ((unsigned char)*p)\n"
+        "    {\n");
+
+    for (size_t c = 0; c < 256; c++)
+    {
+        int ident = BTH_LEX_ISCLASS(c, BTH_LEX_CLASS_IDENT);
+
+        // identifiers take over symbols, never over delimiters
+        if (!dt->first[c] && (ident || !st->first[c]))
+            continue;
+
+        fprintf(f, "    case ");
+        emit_byte(f, c);
+        fprintf(f, ":\n");
+
+        if (dt->first[c])
+            emit_node(f, dt, dt->first[c], 1, BTH_LEX_NOMATCH, "d", 8);
+        if (!ident && st->first[c])
+            emit_node(f, st, st->first[c], 1, BTH_LEX_NOMATCH, "s", 8);
+
+        fprintf(f, "        break;\n");
+    }
+
+    fprintf(f,
+        "    default:\n"
+        "        break;\n"
+        "    }\n"
+        "\n"
+        "    switch (d)\n"
+        "    {\n");
+
+    for (size_t i = 0; i < lex->delims_count; i++)
+        fprintf(f,
+            "    case %zu:\n"
+            "        if (bth_lex_close_delim(lex, &tok, %zu, %u, %u))\n"
+            "            return tok;\n"
+            "        break;\n",
+            i, i, lex->delims[i].len, lex->delims[i].close_len);
+
+    fprintf(f,
+        "    }\n"
+        "\n"
+        "    if (bth_lex_get_number(lex, &tok))\n"
+        "        return tok;\n"
+        "\n"
+        "    if (bth_lex_get_ident(lex, &tok))\n"
+        "        return tok;\n"
+        "\n"
+        "    switch (s)\n"
+        "    {\n");
+
+    for (size_t i = 0; i < lex->symbols_count; i++)
+        fprintf(f,
+            "    case %zu:\n"
+            "        bth_lex_take_symbol(lex, &tok, %zu, %u);\n"
+            "        break;\n",
+            i, i, lex->symbols[i].len);
+
+    fprintf(f,
+        "    }\n"
+        "\n"
+        "    return tok;\n"
+        "}\n"
+        "\n"
+        "struct bth_lex_token lex_gen_get_token(struct bth_lexer *lex)\n"
+        "{\n"
+        "    if (lex->trivia)\n"
+        "        return bth_lex_fold_trivia(lex, get_raw_token);\n"
+        "\n"
+        "    return bth_lex_pull(lex, get_raw_token);\n"
+        "}\n");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+        errx(2, "usage: %s OUTPUT", argv[0]);
+
+    size_t hay;
+    size_t sub;
+
+    if (check_prefix_collisions(&hay, &sub))
+        errx(1, "Collisions detected: idx(%s) > idx(%s)",
+             KEYWORD_TABLE[hay].str, KEYWORD_TABLE[sub].str);
+
+    const char *word;
+
+    if (check_keywords(&word))
+        errx(1, "Keyword %s is not found back by keyword_lookup", word);
+
+    struct bth_lexer lexer = token_lexer(NULL, 0);
+
+    if (!bth_lex_init(&lexer))
+        errx(1, "Could not build lexer tables");
+
+    FILE *f = fopen(argv[1], "w");
+
+    if (!f)
+        err(1, "%s", argv[1]);
+
+    emit(f, &lexer);
+
+    if (fclose(f))
+        err(1, "%s", argv[1]);
+
+    bth_lex_fini(&lexer);
+
+    return 0;
+}